@@ -9,6 +9,17 @@
 #include <SDL2/SDL_image.h>
 #include "tinyfiledialogs.h"
 #include <SDL2/SDL2_gfxPrimitives.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <poll.h>
+#endif
 using namespace std;
 
 // ════════════════════════════════════════════
@@ -34,18 +45,28 @@ static const int   BASE_CAT_PANEL_WIDTH  = 130;
 static const int   BASE_STAGE_WIDTH      = 360;
 static const int   BASE_STAGE_HEIGHT     = 270;
 static const int   BASE_SPRITE_THUMB     = 70;
+static const int   BASE_WS_X             = BASE_PALETTE_WIDTH + BASE_STAGE_WIDTH;
+
+// The stage has its own fixed logical size (sprite coordinates, centre origin).
+static const int   STAGE_LOGICAL_W       = 480;
+static const int   STAGE_LOGICAL_H       = 360;
+static const float SPRITE_SIZE           = 40.0f;   // stage units at size 100%
+static const int   STAGE_TEXT_SCALE      = 2;
 static bool costumeEditMode = false;
 static SDL_Texture* costumeCanvas = nullptr;
 static int canvasW = 480, canvasH = 360;
 static Uint8 penColorR = 0, penColorG = 0, penColorB = 0;
 static int penSize = 3;
 static bool isDrawing = false;
-static int lastDrawX = -1, lastDrawY = -1;
 static int selectedCostumeSpriteIdx = -1;
 
 // ════════════════════════════════════════════
 //  Scaling system
 // ════════════════════════════════════════════
+static void invalidateTextLayouts();
+static void releasePaletteTextures();
+static void buildUiTree();
+
 struct LayoutScale {
     float sx, sy, s;
     int winW, winH;
@@ -58,15 +79,12 @@ struct LayoutScale {
     int   STAGE_WIDTH;
     int   STAGE_HEIGHT;
     int   SPRITE_THUMB;
-    float BLOCK_WIDTH;
-    float BLOCK_HEIGHT;
-    float CBLOCK_MIN_H;
-    float CBLOCK_MOUTH_H;
+    int   WS_X;
     float CBLOCK_BAR_H;
     float BLOCK_CORNER_R;
-    float SNAP_DISTANCE;
     float SNAP_VERT_OVERLAP;
     int   fontScale;
+    float camX = 0, camY = 0;   // workspace scroll, design units
 
     void update(int w, int h) {
         winW = w;  winH = h;
@@ -83,21 +101,135 @@ struct LayoutScale {
         STAGE_WIDTH      = (int)(BASE_STAGE_WIDTH      * sx);
         STAGE_HEIGHT     = (int)(BASE_STAGE_HEIGHT     * sy);
         SPRITE_THUMB     = (int)(BASE_SPRITE_THUMB     * s);
-        BLOCK_WIDTH      = BASE_BLOCK_WIDTH  * s;
-        BLOCK_HEIGHT     = BASE_BLOCK_HEIGHT * s;
-        CBLOCK_MIN_H     = BASE_CBLOCK_MIN_H * s;
-        CBLOCK_MOUTH_H   = BASE_CBLOCK_MOUTH_H * s;
+        WS_X             = PALETTE_WIDTH + STAGE_WIDTH;
         CBLOCK_BAR_H     = BASE_CBLOCK_BAR_H * s;
         BLOCK_CORNER_R   = BASE_BLOCK_CORNER_R * s;
-        SNAP_DISTANCE    = BASE_SNAP_DISTANCE * s;
         SNAP_VERT_OVERLAP= BASE_SNAP_VERT_OVERLAP * s;
 
+        int oldFontScale = fontScale;
         fontScale = max(1, (int)(s + 0.5f));
         if (fontScale < 1) fontScale = 1;
+        if (fontScale != oldFontScale) invalidateTextLayouts();
+        releasePaletteTextures();
+        buildUiTree();
     }
+
+    // Block geometry is kept in design units (pixels of the base layout).
+    // Workspace blocks hang off the workspace's top-left corner, shifted by
+    // the camera and scaled by s when drawn or hit-tested, so neither a
+    // resize nor a scroll touches them.
+    float blockPxX(float x) const { return WS_X + (x - BASE_WS_X - camX) * s; }
+    float blockPxY(float y) const { return TOOLBAR_HEIGHT + (y - BASE_TOOLBAR_HEIGHT - camY) * s; }
+    float designX(float px) const { return BASE_WS_X + camX + (px - WS_X) / s; }
+    float designY(float py) const { return BASE_TOOLBAR_HEIGHT + camY + (py - TOOLBAR_HEIGHT) / s; }
 };
 static LayoutScale L;
 
+// ════════════════════════════════════════════
+//  Frame profiler: instrumentation
+// ════════════════════════════════════════════
+// PROF_SCOPE(phase) times a block of the main loop and counts the SDL draw
+// calls issued inside it. Samples are only taken while the HUD (F3) is open
+// or a trace (F4) is being captured; build with -DSCRATCH_PROFILER=0 to
+// compile all of it out.
+#ifndef SCRATCH_PROFILER
+#define SCRATCH_PROFILER 1
+#endif
+
+#if SCRATCH_PROFILER
+enum ProfPhase { PP_EVENTS, PP_SPRITE_TIMERS, PP_SCRIPTS, PP_TOOLBAR, PP_CATEGORY, PP_PALETTE,
+                 PP_STAGE, PP_PARTICLES, PP_PEN, PP_SPRITE_PANEL, PP_WORKSPACE, PP_DRAG_PREVIEW,
+                 PP_PRESENT, PP_COUNT };
+static const char* PROF_PHASE_NAMES[PP_COUNT] = {
+    "events", "sprite timers", "scripts", "toolbar", "category panel", "palette",
+    "stage", "particles", "pen", "sprite panel", "workspace", "drag preview", "present" };
+static const int PROF_HISTORY = 240;            // frames kept for the HUD graph
+static const int PROF_TRACE_MAX_FRAMES = 1200;  // capture stops itself after this
+
+struct ProfFrame {
+    float frameMs;
+    int frameDraws;
+    float ms[PP_COUNT];
+    int draws[PP_COUNT];
+};
+struct ProfTraceEvent {
+    int phase;              // -1 = whole frame
+    double tsUs, durUs;
+    int draws;
+};
+struct Profiler {
+    bool hud = false, capturing = false, frameSampled = false;
+    Uint64 freq = 0, frameStart = 0, traceStart = 0;
+    int drawCalls = 0, frameDraws0 = 0;
+    ProfFrame cur = {};
+    ProfFrame history[PROF_HISTORY] = {};
+    int head = 0, filled = 0;
+    vector<ProfTraceEvent> trace;
+    int traceFrames = 0;
+
+    bool active() const { return hud || capturing; }
+    double us(Uint64 t) const { return (double)(t - traceStart) * 1e6 / (double)freq; }
+};
+static Profiler gProf;
+
+struct ProfScope {
+    int phase;
+    Uint64 t0 = 0;
+    int d0 = 0;
+    explicit ProfScope(int p) : phase(p) {
+        if (gProf.frameSampled) { t0 = SDL_GetPerformanceCounter(); d0 = gProf.drawCalls; }
+    }
+    ~ProfScope() { end(); }
+    void end() {
+        if (!t0) return;
+        Uint64 t1 = SDL_GetPerformanceCounter();
+        int draws = gProf.drawCalls - d0;
+        gProf.cur.ms[phase] += (float)((double)(t1 - t0) * 1000.0 / (double)gProf.freq);
+        gProf.cur.draws[phase] += draws;
+        if (gProf.capturing) gProf.trace.push_back({phase, gProf.us(t0), gProf.us(t1) - gProf.us(t0), draws});
+        t0 = 0;
+    }
+};
+
+#define PROF_CAT2(a, b) a##b
+#define PROF_CAT(a, b) PROF_CAT2(a, b)
+#define PROF_SCOPE(phase) ProfScope PROF_CAT(profScope_, __LINE__)(phase)
+// For spans that aren't a block of their own.
+#define PROF_BEGIN(var, phase) ProfScope var(phase)
+#define PROF_END(var) var.end()
+
+#define PROF_COUNT_DRAW() (gProf.drawCalls++)
+
+static void profFrameBegin() {
+    if (!gProf.freq) gProf.freq = SDL_GetPerformanceFrequency();
+    gProf.frameSampled = gProf.active();
+    if (!gProf.frameSampled) return;
+    gProf.cur = {};
+    gProf.frameDraws0 = gProf.drawCalls;
+    gProf.frameStart = SDL_GetPerformanceCounter();
+}
+#else
+#define PROF_SCOPE(phase)
+#define PROF_BEGIN(var, phase)
+#define PROF_END(var)
+#define PROF_COUNT_DRAW() ((void)0)
+static void profFrameBegin() {}
+#endif
+
+// SDL draw calls go through these so the profiler can count them.
+static int renderClear(SDL_Renderer* r) { PROF_COUNT_DRAW(); return SDL_RenderClear(r); }
+static int renderFillRect(SDL_Renderer* r, const SDL_Rect* rc) { PROF_COUNT_DRAW(); return SDL_RenderFillRect(r, rc); }
+static int renderFillRects(SDL_Renderer* r, const SDL_Rect* rc, int n) { PROF_COUNT_DRAW(); return SDL_RenderFillRects(r, rc, n); }
+static int renderDrawRect(SDL_Renderer* r, const SDL_Rect* rc) { PROF_COUNT_DRAW(); return SDL_RenderDrawRect(r, rc); }
+static int renderDrawLine(SDL_Renderer* r, int x0, int y0, int x1, int y1) { PROF_COUNT_DRAW(); return SDL_RenderDrawLine(r, x0, y0, x1, y1); }
+static int renderDrawPoint(SDL_Renderer* r, int x, int y) { PROF_COUNT_DRAW(); return SDL_RenderDrawPoint(r, x, y); }
+static int renderCopy(SDL_Renderer* r, SDL_Texture* t, const SDL_Rect* src, const SDL_Rect* dst) {
+    PROF_COUNT_DRAW(); return SDL_RenderCopy(r, t, src, dst);
+}
+static int renderGeometry(SDL_Renderer* r, SDL_Texture* t, const SDL_Vertex* v, int nv, const int* idx, int ni) {
+    PROF_COUNT_DRAW(); return SDL_RenderGeometry(r, t, v, nv, idx, ni);
+}
+
 // ════════════════════════════════════════════
 //  Bitmap Font 5x7
 // ════════════════════════════════════════════
@@ -204,22 +336,64 @@ static const unsigned char FONT_5x7[][7] = {
     {0x00,0x00,0x08,0x15,0x02,0x00,0x00}, // 126 '~'
 };
 
-static void drawChar(SDL_Renderer* rnd, int x, int y, char ch, int scale,
-                     Uint8 r, Uint8 g, Uint8 b, Uint8 a)
-{
-    int idx = (int)ch - FONT_FIRST_CHAR;
-    if (idx < 0 || idx > (FONT_LAST_CHAR - FONT_FIRST_CHAR)) return;
-    SDL_SetRenderDrawColor(rnd, r, g, b, a);
-    const unsigned char* glyph = FONT_5x7[idx];
-    for (int row = 0; row < GLYPH_H; row++) {
-        unsigned char bits = glyph[row];
-        for (int col = 0; col < GLYPH_W; col++) {
-            if (bits & (1 << (GLYPH_W - 1 - col))) {
-                SDL_Rect px = { x + col * scale, y + row * scale, scale, scale };
-                SDL_RenderFillRect(rnd, &px);
+// ── Text layout cache ──
+// A string's layout at a given scale (size plus the lit pixels of every glyph,
+// merged into horizontal runs relative to the text origin) is built once and
+// reused, so drawing a label is one SDL_RenderFillRects call and measuring it
+// is a lookup. Edited values simply key a new entry; the whole cache is
+// dropped when fontScale changes or when it grows past TEXT_LAYOUT_CAP.
+// Entries are keyed by string_view into the cache's own copy of each text
+// (a deque, so the copies never move): a hit hashes the caller's chars
+// without building a std::string.
+struct TextLayout {
+    int w, h;
+    vector<SDL_Rect> runs;
+};
+struct TextLayoutCache {
+    deque<string> texts;
+    unordered_map<string_view, TextLayout> byText;
+};
+static const size_t TEXT_LAYOUT_CAP = 4096;
+static unordered_map<int, TextLayoutCache> gTextLayouts;
+static vector<SDL_Rect> gTextRunScratch;
+
+static void invalidateTextLayouts() { gTextLayouts.clear(); }
+
+static const TextLayout& textLayout(const char* text, int scale) {
+    TextLayoutCache& cache = gTextLayouts[scale];
+    auto it = cache.byText.find(string_view(text));
+    if (it != cache.byText.end()) return it->second;
+    if (cache.byText.size() >= TEXT_LAYOUT_CAP) { cache.byText.clear(); cache.texts.clear(); }
+
+    cache.texts.emplace_back(text);
+    TextLayout& lay = cache.byText[string_view(cache.texts.back())];
+    int spacing = (GLYPH_W + 1) * scale, lineH = (GLYPH_H + 2) * scale;
+    int cx = 0, cy = 0, lines = 1, maxW = 0;
+    for (int i = 0; text[i] != '\0'; i++) {
+        if (text[i] == '\n') {
+            maxW = max(maxW, cx);
+            cx = 0; cy += lineH; lines++;
+            continue;
+        }
+        int idx = (int)text[i] - FONT_FIRST_CHAR;
+        if (idx >= 0 && idx <= (FONT_LAST_CHAR - FONT_FIRST_CHAR)) {
+            const unsigned char* glyph = FONT_5x7[idx];
+            for (int row = 0; row < GLYPH_H; row++) {
+                unsigned char bits = glyph[row];
+                for (int col = 0; col < GLYPH_W; col++) {
+                    if (!(bits & (1 << (GLYPH_W - 1 - col)))) continue;
+                    int run = 1;
+                    while (col + run < GLYPH_W && (bits & (1 << (GLYPH_W - 1 - col - run)))) run++;
+                    lay.runs.push_back({cx + col * scale, cy + row * scale, run * scale, scale});
+                    col += run - 1;
+                }
             }
         }
+        cx += spacing;
     }
+    lay.w = max(maxW, cx);
+    lay.h = lines * lineH;
+    return lay;
 }
 
 static void drawText(SDL_Renderer* rnd, int x, int y, const char* text,
@@ -227,44 +401,28 @@ static void drawText(SDL_Renderer* rnd, int x, int y, const char* text,
 {
     if (!text) return;
     if (scale < 0) scale = L.fontScale;
-    int cx = x;
-    int spacing = (GLYPH_W + 1) * scale;
-    for (int i = 0; text[i] != '\0'; i++) {
-        if (text[i] == '\n') {
-            cx = x;
-            y += (GLYPH_H + 2) * scale;
-            continue;
-        }
-        drawChar(rnd, cx, y, text[i], scale, r, g, b, a);
-        cx += spacing;
+    const TextLayout& lay = textLayout(text, scale);
+    if (lay.runs.empty()) return;
+    gTextRunScratch.resize(lay.runs.size());
+    for (size_t i = 0; i < lay.runs.size(); i++) {
+        SDL_Rect rc = lay.runs[i];
+        rc.x += x; rc.y += y;
+        gTextRunScratch[i] = rc;
     }
+    SDL_SetRenderDrawColor(rnd, r, g, b, a);
+    renderFillRects(rnd, gTextRunScratch.data(), (int)gTextRunScratch.size());
 }
 
 static int textWidth(const char* text, int scale = -1) {
     if (!text) return 0;
     if (scale < 0) scale = L.fontScale;
-    int maxW = 0, curW = 0;
-    int spacing = (GLYPH_W + 1) * scale;
-    for (int i = 0; text[i]; i++) {
-        if (text[i] == '\n') {
-            if (curW > maxW) maxW = curW;
-            curW = 0;
-        } else {
-            curW += spacing;
-        }
-    }
-    if (curW > maxW) maxW = curW;
-    return maxW;
+    return textLayout(text, scale).w;
 }
 
 static int textHeight(const char* text, int scale = -1) {
     if (!text) return 0;
     if (scale < 0) scale = L.fontScale;
-    int lines = 1;
-    for (int i = 0; text[i]; i++) {
-        if (text[i] == '\n') lines++;
-    }
-    return lines * (GLYPH_H + 2) * scale;
+    return textLayout(text, scale).h;
 }
 
 // ════════════════════════════════════════════
@@ -275,18 +433,18 @@ static void fillRoundedRect(SDL_Renderer* rnd, int x, int y, int w, int h,
 {
     SDL_SetRenderDrawColor(rnd, r, g, b, a);
     SDL_Rect rc = {x + radius, y, w - 2*radius, h};
-    SDL_RenderFillRect(rnd, &rc);
+    renderFillRect(rnd, &rc);
     SDL_Rect rl = {x, y + radius, radius, h - 2*radius};
-    SDL_RenderFillRect(rnd, &rl);
+    renderFillRect(rnd, &rl);
     SDL_Rect rr2 = {x + w - radius, y + radius, radius, h - 2*radius};
-    SDL_RenderFillRect(rnd, &rr2);
+    renderFillRect(rnd, &rr2);
     for (int cy2 = -radius; cy2 <= radius; cy2++) {
         for (int cx2 = -radius; cx2 <= radius; cx2++) {
             if (cx2*cx2 + cy2*cy2 <= radius*radius) {
-                SDL_RenderDrawPoint(rnd, x + radius + cx2, y + radius + cy2);
-                SDL_RenderDrawPoint(rnd, x + w - radius + cx2, y + radius + cy2);
-                SDL_RenderDrawPoint(rnd, x + radius + cx2, y + h - radius + cy2);
-                SDL_RenderDrawPoint(rnd, x + w - radius + cx2, y + h - radius + cy2);
+                renderDrawPoint(rnd, x + radius + cx2, y + radius + cy2);
+                renderDrawPoint(rnd, x + w - radius + cx2, y + radius + cy2);
+                renderDrawPoint(rnd, x + radius + cx2, y + h - radius + cy2);
+                renderDrawPoint(rnd, x + w - radius + cx2, y + h - radius + cy2);
             }
         }
     }
@@ -298,7 +456,7 @@ static void fillEllipse(SDL_Renderer* rnd, int cx, int cy, int rx, int ry,
     SDL_SetRenderDrawColor(rnd, r, g, b, a);
     for (int dy = -ry; dy <= ry; dy++) {
         int halfW = (int)(rx * sqrt(1.0 - (double)(dy*dy)/(double)(ry*ry)));
-        SDL_RenderDrawLine(rnd, cx - halfW, cy + dy, cx + halfW, cy + dy);
+        renderDrawLine(rnd, cx - halfW, cy + dy, cx + halfW, cy + dy);
     }
 }
 
@@ -306,17 +464,17 @@ static void drawRoundedRectOutline(SDL_Renderer* rnd, int x, int y, int w, int h
                                    int radius, Uint8 r, Uint8 g, Uint8 b, Uint8 a)
 {
     SDL_SetRenderDrawColor(rnd, r, g, b, a);
-    SDL_RenderDrawLine(rnd, x + radius, y, x + w - radius, y);
-    SDL_RenderDrawLine(rnd, x + radius, y + h, x + w - radius, y + h);
-    SDL_RenderDrawLine(rnd, x, y + radius, x, y + h - radius);
-    SDL_RenderDrawLine(rnd, x + w, y + radius, x + w, y + h - radius);
+    renderDrawLine(rnd, x + radius, y, x + w - radius, y);
+    renderDrawLine(rnd, x + radius, y + h, x + w - radius, y + h);
+    renderDrawLine(rnd, x, y + radius, x, y + h - radius);
+    renderDrawLine(rnd, x + w, y + radius, x + w, y + h - radius);
 }
 
 // ════════════════════════════════════════════
 //  Category
 // ════════════════════════════════════════════
-enum class Category { MOTION, LOOKS, SOUND, EVENTS, CONTROL, SENSING, OPERATORS, VARIABLES };
-static const int NUM_CATEGORIES = 8;
+enum class Category { MOTION, LOOKS, SOUND, EVENTS, CONTROL, SENSING, OPERATORS, VARIABLES, PEN };
+static const int NUM_CATEGORIES = 9;
 
 static SDL_Color catColor(Category c) {
     switch(c){
@@ -328,6 +486,7 @@ static SDL_Color catColor(Category c) {
         case Category::SENSING:   return {92,177,214,255};
         case Category::OPERATORS: return {89,192,89,255};
         case Category::VARIABLES: return {255,140,26,255};
+        case Category::PEN:       return {15,189,140,255};
     }
     return {128,128,128,255};
 }
@@ -342,10 +501,147 @@ static const char* catName(Category c) {
         case Category::SENSING:   return "Sensing";
         case Category::OPERATORS: return "Operators";
         case Category::VARIABLES: return "Variables";
+        case Category::PEN:       return "Pen";
     }
     return "?";
 }
 
+// ════════════════════════════════════════════
+//  Retained UI layout + hit testing
+// ════════════════════════════════════════════
+// The fixed widgets (toolbar buttons, categories, stage BG button, sprite
+// panel buttons and info fields) are laid out into a small panel tree once
+// per LayoutScale::update. Rendering takes its rectangles from uiRect() and
+// the mouse-down handler asks uiHitTest(), which only descends into panels
+// containing the point. The thumbnail strip is a single widget whose items
+// are derived from their index, so adding sprites relayouts nothing.
+enum class UiId { NONE, PANEL, FLAG, STOP, RESET, CATEGORY, STAGE_BG, ADD_SPRITE,
+                  SPRITE_FIELD, UPLOAD, EDIT_COSTUME, LAYER_BACK, LAYER_FRONT,
+                  THUMB, THUMB_EYE, THUMB_DELETE };
+
+struct UiWidget {
+    UiId id;
+    int index;                   // category, sprite field or thumbnail number
+    SDL_Rect r;
+    vector<UiWidget> children;   // later children lie on top
+};
+
+struct UiHit {
+    UiId id = UiId::NONE;
+    int index = -1;
+};
+
+static const int NUM_SPRITE_FIELDS = 6;
+static const char* const SPRITE_FIELD_LABELS[NUM_SPRITE_FIELDS] = {"Name:", "X:", "Y:", "Sz:", "Dir:", "Gh:"};
+static const float SPRITE_FIELD_LABEL_W[NUM_SPRITE_FIELDS] = {40, 15, 15, 30, 25, 30};
+
+static UiWidget gUi;
+static int gUiThumbStride = 0;
+static int gThumbScroll = 0;        // px the thumbnail strip is scrolled right
+
+static bool inRect(const SDL_Rect& r, int x, int y) {
+    return x >= r.x && x <= r.x + r.w && y >= r.y && y <= r.y + r.h;
+}
+
+static void buildUiTree() {
+    float s = L.s;
+    gUi = {UiId::PANEL, 0, {0, 0, L.winW, L.winH}, {}};
+
+    int flagSz = L.TOOLBAR_HEIGHT - 10, flagX = (int)(L.winW * 0.4f), stopX = flagX + flagSz + 10;
+    gUi.children.push_back({UiId::PANEL, 0, {0, 0, L.winW, L.TOOLBAR_HEIGHT}, {
+        {UiId::FLAG,  0, {flagX, 5, flagSz, flagSz}, {}},
+        {UiId::STOP,  0, {stopX, 5, flagSz, flagSz}, {}},
+        {UiId::RESET, 0, {stopX + flagSz + 10, 5, (int)(60 * s), flagSz}, {}}}});
+
+    UiWidget cats{UiId::PANEL, 0, {0, L.TOOLBAR_HEIGHT, L.CAT_PANEL_WIDTH, L.winH - L.TOOLBAR_HEIGHT}, {}};
+    for (int i = 0; i < NUM_CATEGORIES; i++)
+        cats.children.push_back({UiId::CATEGORY, i, {0, L.TOOLBAR_HEIGHT + 5 + i * (L.CAT_BTN_HEIGHT + 3), L.CAT_PANEL_WIDTH, L.CAT_BTN_HEIGHT}, {}});
+    gUi.children.push_back(cats);
+
+    int stageX = L.PALETTE_WIDTH, stageW = L.STAGE_WIDTH;
+    gUi.children.push_back({UiId::PANEL, 0, {stageX, L.TOOLBAR_HEIGHT, stageW, L.STAGE_HEIGHT}, {
+        {UiId::STAGE_BG, 0, {stageX + stageW - (int)(35 * s), L.TOOLBAR_HEIGHT + 3, (int)(32 * s), (int)(18 * s)}, {}}}});
+
+    // sprite panel: info fields, then the buttons laid over their right end
+    int spriteAreaY = L.TOOLBAR_HEIGHT + L.STAGE_HEIGHT + 5, thumbSz = L.SPRITE_THUMB;
+    int infoX = stageX + 5, infoY = spriteAreaY + thumbSz + 10;
+    int fieldW2 = (int)(stageW * 0.35f), fieldH2 = (int)(22 * s), rowH = fieldH2 + 8;
+    UiWidget panel{UiId::PANEL, 0, {stageX, spriteAreaY, stageW, max(0, L.winH - spriteAreaY)}, {}};
+    const int fieldCol[NUM_SPRITE_FIELDS] = {0, 0, 1, 0, 1, 0}, fieldRow[NUM_SPRITE_FIELDS] = {0, 1, 1, 2, 2, 3};
+    for (int i = 0; i < NUM_SPRITE_FIELDS; i++) {
+        int fx = infoX + fieldCol[i] * fieldW2 + (int)(SPRITE_FIELD_LABEL_W[i] * s);
+        int fw = i == 0 ? fieldW2 * 2 : fieldW2 - (int)(20 * s);
+        panel.children.push_back({UiId::SPRITE_FIELD, i, {fx, infoY + fieldRow[i] * rowH, fw, fieldH2}, {}});
+    }
+    int btnW = (int)(60 * s), uploadX = infoX + fieldW2 * 2 - btnW - 10;
+    panel.children.push_back({UiId::UPLOAD, 0, {uploadX, infoY, btnW, fieldH2}, {}});
+    panel.children.push_back({UiId::EDIT_COSTUME, 0, {uploadX - btnW - 10, infoY, btnW, fieldH2}, {}});
+    int layerW = (int)(40 * s), frontX = infoX + fieldW2 * 2 - layerW - 5;
+    panel.children.push_back({UiId::LAYER_BACK, 0, {frontX - layerW - 5, infoY + 2 * rowH, layerW, fieldH2}, {}});
+    panel.children.push_back({UiId::LAYER_FRONT, 0, {frontX, infoY + 2 * rowH, layerW, fieldH2}, {}});
+    gUi.children.push_back(panel);
+
+    // the strip ends at the add button and scrolls sideways (gThumbScroll)
+    gUiThumbStride = thumbSz + 8;
+    int addX = stageX + stageW - (int)(40 * s);
+    gUi.children.push_back({UiId::THUMB, -1, {infoX, spriteAreaY, max(0, addX - 5 - infoX), thumbSz}, {}});
+    gUi.children.push_back({UiId::ADD_SPRITE, 0, {addX, spriteAreaY, (int)(30 * s), (int)(30 * s)}, {}});
+}
+
+static const UiWidget* uiFind(const UiWidget& w, UiId id, int index) {
+    if (w.id == id && w.index == index) return &w;
+    for (auto& c : w.children) if (const UiWidget* f = uiFind(c, id, index)) return f;
+    return nullptr;
+}
+
+static SDL_Rect uiRect(UiId id, int index = 0) {
+    const UiWidget* w = uiFind(gUi, id, index);
+    return w ? w->r : SDL_Rect{0, 0, 0, 0};
+}
+
+// Thumbnail i of the strip, or its eye / delete button.
+static SDL_Rect uiThumbRect(int i, UiId part = UiId::THUMB) {
+    SDL_Rect strip = uiRect(UiId::THUMB, -1);
+    int sz = strip.h, btn = (int)(16 * L.s);
+    SDL_Rect t = {strip.x + i * gUiThumbStride - gThumbScroll, strip.y, sz, sz};
+    if (part == UiId::THUMB_EYE) return {t.x + sz - 2 * btn - 6, t.y + 2, btn, btn};
+    if (part == UiId::THUMB_DELETE) return {t.x + sz - btn - 2, t.y + 2, btn, btn};
+    return t;
+}
+
+// numThumbs is the sprite count; the strip has no items past it.
+static UiHit uiHitTest(const UiWidget& w, int x, int y, int numThumbs) {
+    for (auto it = w.children.rbegin(); it != w.children.rend(); ++it) {
+        if (!inRect(it->r, x, y)) continue;
+        if (it->id == UiId::THUMB) {
+            int i = (x - it->r.x + gThumbScroll) / max(1, gUiThumbStride);
+            if (i >= numThumbs || !inRect(uiThumbRect(i), x, y)) continue;
+            for (UiId part : {UiId::THUMB_EYE, UiId::THUMB_DELETE})
+                if (inRect(uiThumbRect(i, part), x, y)) return {part, i};
+            return {UiId::THUMB, i};
+        }
+        if (it->id != UiId::PANEL) return {it->id, it->index};
+        UiHit h = uiHitTest(*it, x, y, numThumbs);
+        if (h.id != UiId::NONE) return h;
+    }
+    return {};
+}
+
+static UiHit uiHitTest(int x, int y, int numThumbs) { return uiHitTest(gUi, x, y, numThumbs); }
+
+static void clampThumbScroll(int numThumbs) {
+    int overflow = numThumbs * gUiThumbStride - 8 - uiRect(UiId::THUMB, -1).w;
+    gThumbScroll = max(0, min(gThumbScroll, overflow));
+}
+
+// Scrolls the strip just far enough for thumbnail i to be fully visible.
+static void scrollThumbIntoView(int i, int numThumbs) {
+    SDL_Rect strip = uiRect(UiId::THUMB, -1), t = uiThumbRect(i);
+    if (t.x < strip.x) gThumbScroll -= strip.x - t.x;
+    else if (t.x + t.w > strip.x + strip.w) gThumbScroll += t.x + t.w - strip.x - strip.w;
+    clampThumbScroll(numThumbs);
+}
+
 // ════════════════════════════════════════════
 //  Costume System
 // ════════════════════════════════════════════
@@ -360,6 +656,11 @@ struct Costume {
     int width = 0, height = 0;
     bool flippedH = false;
     bool flippedV = false;
+    string file{};               // PNG written by the costume editor
+    int saveJobId = -1;          // pending background save, if any
+    const Uint8* assetData = nullptr;  // encoded image inside the open project,
+    Uint32 assetSize = 0;              // decoded on first display
+    bool imageMissing = false;         // decode failed; don't retry every frame
 };
 struct UploadedImage {
     string filename;
@@ -372,14 +673,14 @@ struct UploadedImage {
     UploadedImage() : texture(nullptr), width(0), height(0), scale(1.0f), rotation(0), flippedH(false), flippedV(false) {}
     ~UploadedImage() { if(texture) SDL_DestroyTexture(texture); }
 };
-struct Particle {
-    float x, y;
-    float vx, vy;
-    float radius;
-    SDL_Color color;
-    float colorPhase;
+// Stage particles, one array per field (see "Stage particles").
+struct ParticleSystem {
+    vector<float> x, y, vx, vy, radius;
+    vector<float> phase;    // colour cycle, 256 = one turn
+    vector<Uint8> alpha;
+    size_t size() const { return x.size(); }
 };
-static vector<Particle> gParticles;
+static ParticleSystem gParticles;
 static bool gParticlesInitialized = false;
 // ════════════════════════════════════════════
 //  Sprite
@@ -402,6 +703,14 @@ struct Sprite {
     int currentCostume;
     SDL_Texture* uploadedTexture;
     vector<Costume> costumes;
+    string uploadedFile;
+    const Uint8* uploadedAsset = nullptr;
+    Uint32 uploadedAssetSize = 0;
+    bool uploadedMissing = false;
+
+    bool penDown = false;
+    float penSize = 1, penHue = 66;     // hue 0..100, as Scratch's pen color
+    float penX = 0, penY = 0;           // where the last stroke ended
 };
 
 static int gNextSpriteNum = 2;
@@ -429,14 +738,45 @@ static Sprite createDefaultSprite(const char* name, float x, float y, SDL_Color
 // ════════════════════════════════════════════
 //  Block types
 // ════════════════════════════════════════════
+// A Block owns no heap memory of its own: labels and default values are
+// interned strings shared with the palette, inputs and slots live inline,
+// and short input values fit std::string's in-place buffer. Copying a block
+// (clone, undo, vector growth) is a flat copy instead of a dozen mallocs.
 enum class BlockShape { COMMAND, C_BLOCK, HAT, CAP, REPORTER, BOOLEAN };
 
+static const int MAX_BLOCK_INPUTS = 3;
+static const int MAX_BLOCK_SLOTS  = 2;
+
+// Fixed-capacity array stored inside its owner; pushes past N are dropped.
+template <class T, int N>
+struct InlineVec {
+    T items[N];
+    Uint8 n = 0;
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    void clear() { n = 0; }
+    void resize(size_t k) { n = (Uint8)min(k, (size_t)N); }
+    void push_back(const T& v) { if (n < N) items[n++] = v; }
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+    T* begin() { return items; }
+    T* end() { return items + n; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + n; }
+};
+
+// Interned, never freed; equal labels share one pointer.
+static const string* internLabel(const string& s) {
+    static unordered_set<string> pool;
+    return &*pool.insert(s).first;
+}
+
 struct InputField {
     string value;
     float relX, relY;
     float width, height;
     bool editing;
-    string defaultVal;
+    const string* defaultVal;
 };
 
 struct OperatorSlot {
@@ -446,27 +786,67 @@ struct OperatorSlot {
 };
 
 struct Block {
+    // hot: touched by every workspace scan
     int id;
-    Category cat;
     BlockShape shape;
-    string text;
+    Category cat;
+    bool inPalette;
     float x, y;
     float w, h;
-    bool inPalette;
     int nextBlockId;
     int parentBlockId;
     int childHeadId;
-    vector<InputField> inputs;
-    vector<OperatorSlot> opSlots;
+    // cold
+    const string* text;
+    InlineVec<InputField, MAX_BLOCK_INPUTS> inputs;
+    InlineVec<OperatorSlot, MAX_BLOCK_SLOTS> opSlots;
 };
 
 static int gNextBlockId = 1000;
 
+// ════════════════════════════════════════════
+//  Execution engine: script threads
+// ════════════════════════════════════════════
+static int gNextThreadId = 0;
+
+struct ScriptThread {
+    int id;                  // increasing, so gActiveThreads stays sorted by id
+    int currentBlockId;      // بلوک فعلی که داره اجرا میشه
+    int spriteIdx;           // کدوم sprite
+    float waitTimer;         // تایمر انتظار
+    bool isWaiting;          // آیا منتظره؟
+    int tweenWait;           // unfinished tweens this thread is parked on
+    vector<pair<int,int>> loopStack;  // (loop blockId, iterations done); -1 = forever
+
+    ScriptThread(int blockId, int sprite)
+        : id(gNextThreadId++), currentBlockId(blockId), spriteIdx(sprite), waitTimer(0), isWaiting(false), tweenWait(0) {}
+};
+static vector<ScriptThread> gActiveThreads;
+
+// Per-block execution profile (see "Execution engine").
+struct BlockProfile {
+    Uint64 runs = 0;
+    Uint64 selfTicks = 0;
+    Uint64 inclTicks = 0;
+};
+struct SpriteProfile {
+    Uint64 runs = 0;
+    Uint64 ticks = 0;
+};
+enum class ProfSort { SELF, INCLUSIVE, RUNS };
+
+static unordered_map<int, BlockProfile> gBlockProfile;
+static vector<SpriteProfile> gSpriteProfile;
+static Uint64 gBlockProfMaxSelf = 0;
+static bool gBlockProfView = false;
+static ProfSort gBlockProfSort = ProfSort::SELF;
+
 // ════════════════════════════════════════════
 //  Global state
 // ════════════════════════════════════════════
 static bool gIsRunning = false;
 static float gTimer = 0;
+static float gMyVariable = 0;    // «my variable»
 static int gBgColor = 0;
 static float gToolbarAnimOffset = 0;
 static int gHighlightBlockId = -1;
@@ -491,6 +871,11 @@ struct ActiveEdit {
 };
 static ActiveEdit gEdit = {-1, -1, -1, false, "", 0};
 
+// Edits not yet written to the autosave journal (see "Autosave").
+static unordered_set<int> gDirtyBlocks;     // block ids
+static unordered_set<int> gDirtySprites;    // sprite indices
+static bool gAutosaveSnapshotWanted = false;
+
 static string intToString(int n) {
     char buf[32];
     snprintf(buf, sizeof(buf), "%d", n);
@@ -509,24 +894,25 @@ static string floatToString(float f) {
 // ════════════════════════════════════════════
 static Block makeBlock(int id, Category cat, BlockShape shape, const string& text,
                        float x, float y, bool inPalette,
-                       vector<InputField> fields = {},
-                       vector<OperatorSlot> slots = {})
+                       initializer_list<InputField> fields = {},
+                       initializer_list<OperatorSlot> slots = {})
 {
     Block b;
-    b.id = id; b.cat = cat; b.shape = shape; b.text = text;
+    b.id = id; b.cat = cat; b.shape = shape; b.text = internLabel(text);
     b.x = x; b.y = y;
-    b.w = L.BLOCK_WIDTH;
-    b.h = (shape == BlockShape::C_BLOCK) ? L.CBLOCK_MIN_H : L.BLOCK_HEIGHT;
+    b.w = BASE_BLOCK_WIDTH;
+    b.h = (shape == BlockShape::C_BLOCK) ? BASE_CBLOCK_MIN_H : BASE_BLOCK_HEIGHT;
     b.inPalette = inPalette;
     b.nextBlockId = -1; b.parentBlockId = -1; b.childHeadId = -1;
-    b.inputs = fields; b.opSlots = slots;
+    for (auto& f : fields) b.inputs.push_back(f);
+    for (auto& sl : slots) b.opSlots.push_back(sl);
     return b;
 }
 
 static InputField makeInput(float rx, float ry, float w, float h, const string& def) {
     InputField f;
     f.relX = rx; f.relY = ry; f.width = w; f.height = h;
-    f.value = def; f.defaultVal = def; f.editing = false;
+    f.value = def; f.defaultVal = internLabel(def); f.editing = false;
     return f;
 }
 
@@ -540,7 +926,7 @@ static OperatorSlot makeOpSlot(float rx, float ry, float w, float h) {
 static vector<Block> buildPaletteBlocks() {
     vector<Block> blocks;
     int id = 0;
-    float bw = L.BLOCK_WIDTH, bh = L.BLOCK_HEIGHT;
+    float bw = BASE_BLOCK_WIDTH, bh = BASE_BLOCK_HEIGHT;
     float fieldH = bh * 0.55f, fieldW = bw * 0.2f, slotW = bw * 0.25f;
 
     // MOTION
@@ -627,48 +1013,105 @@ static vector<Block> buildPaletteBlocks() {
     blocks.push_back(makeBlock(id++, Category::VARIABLES, BlockShape::COMMAND, "set var to ", 0,0,true, {makeInput(bw*0.55f,bh*0.15f,fieldW,fieldH,"0")}, {makeOpSlot(bw*0.55f,bh*0.15f,slotW,fieldH)}));
     blocks.push_back(makeBlock(id++, Category::VARIABLES, BlockShape::COMMAND, "change var by ", 0,0,true, {makeInput(bw*0.6f,bh*0.15f,fieldW,fieldH,"1")}, {makeOpSlot(bw*0.6f,bh*0.15f,slotW,fieldH)}));
 
-    gNextBlockId = id + 100;
+    // PEN (last, so the ids above stay what saved journals refer to)
+    blocks.push_back(makeBlock(id++, Category::PEN, BlockShape::COMMAND, "clear", 0,0,true,{},{}));
+    blocks.push_back(makeBlock(id++, Category::PEN, BlockShape::COMMAND, "stamp", 0,0,true,{},{}));
+    blocks.push_back(makeBlock(id++, Category::PEN, BlockShape::COMMAND, "pen down", 0,0,true,{},{}));
+    blocks.push_back(makeBlock(id++, Category::PEN, BlockShape::COMMAND, "pen up", 0,0,true,{},{}));
+    blocks.push_back(makeBlock(id++, Category::PEN, BlockShape::COMMAND, "set pen color to ", 0,0,true, {makeInput(bw*0.7f,bh*0.15f,fieldW,fieldH,"66")}, {makeOpSlot(bw*0.7f,bh*0.15f,slotW,fieldH)}));
+    blocks.push_back(makeBlock(id++, Category::PEN, BlockShape::COMMAND, "change pen color by ", 0,0,true, {makeInput(bw*0.75f,bh*0.15f,fieldW,fieldH,"10")}, {makeOpSlot(bw*0.75f,bh*0.15f,slotW,fieldH)}));
+    blocks.push_back(makeBlock(id++, Category::PEN, BlockShape::COMMAND, "set pen size to ", 0,0,true, {makeInput(bw*0.65f,bh*0.15f,fieldW,fieldH,"1")}, {makeOpSlot(bw*0.65f,bh*0.15f,slotW,fieldH)}));
+    blocks.push_back(makeBlock(id++, Category::PEN, BlockShape::COMMAND, "change pen size by ", 0,0,true, {makeInput(bw*0.72f,bh*0.15f,fieldW,fieldH,"1")}, {makeOpSlot(bw*0.72f,bh*0.15f,slotW,fieldH)}));
+
     return blocks;
 }
 
+// Blocks are appended with increasing ids (clones, loads and the journal
+// all keep that order), so a binary search normally finds the block; the
+// linear scan only covers an out-of-order vector.
 static Block* findBlock(vector<Block>& blocks, int id) {
+    if (id < 0) return nullptr;
+    size_t lo = 0, hi = blocks.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (blocks[mid].id < id) lo = mid + 1; else hi = mid;
+    }
+    if (lo < blocks.size() && blocks[lo].id == id) return &blocks[lo];
     for (auto& b : blocks) if (b.id == id) return &b;
     return nullptr;
 }
 
-static float calcCBlockHeight(vector<Block>& blocks, Block& cb) {
-    float barH = L.CBLOCK_BAR_H, mouthH = L.CBLOCK_MOUTH_H;
-    float childrenH = 0;
-    int cid = cb.childHeadId;
-    while (cid >= 0) {
-        Block* child = findBlock(blocks, cid);
-        if (!child) break;
-        childrenH += (child->shape == BlockShape::C_BLOCK) ? calcCBlockHeight(blocks, *child) : child->h;
-        cid = child->nextBlockId;
+// ════════════════════════════════════════════
+//  Block stacks
+// ════════════════════════════════════════════
+// Stacks are walked with an explicit work list, never by recursion, so a
+// script's length or nesting never turns into call depth. The visit order
+// is pre-order; a visit covers the following blocks, C-block bodies and
+// (nested) reporters in operator slots. Broken links that loop are cut off
+// after blocks.size() visits.
+template <class F>
+static void forEachInStack(vector<Block>& blocks, int rootId, F&& visit) {
+    vector<int> todo(1, rootId);
+    size_t budget = blocks.size();
+    while (!todo.empty() && budget--) {
+        Block* b = findBlock(blocks, todo.back());
+        todo.pop_back();
+        if (!b) continue;
+        visit(*b);
+        if (b->nextBlockId >= 0) todo.push_back(b->nextBlockId);
+        for (auto& sl : b->opSlots) if (sl.embeddedBlockId >= 0) todo.push_back(sl.embeddedBlockId);
+        if (b->shape == BlockShape::C_BLOCK && b->childHeadId >= 0) todo.push_back(b->childHeadId);
     }
-    if (childrenH < mouthH) childrenH = mouthH;
-    return barH + childrenH + barH;
 }
 
-static void updateCBlockChildren(vector<Block>& blocks, Block& cb) {
-    float barH = L.CBLOCK_BAR_H, indent = 20 * L.s;
-    float cy = cb.y + barH;
-    int cid = cb.childHeadId;
-    while (cid >= 0) {
-        Block* child = findBlock(blocks, cid);
-        if (!child) break;
-        child->x = cb.x + indent;
-        child->y = cy;
-        if (child->shape == BlockShape::C_BLOCK) {
-            child->h = calcCBlockHeight(blocks, *child);
-            updateCBlockChildren(blocks, *child);
+// Design-unit bounding box of everything forEachInStack visits.
+static SDL_FRect stackBounds(vector<Block>& blocks, int rootId) {
+    float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX;
+    forEachInStack(blocks, rootId, [&](Block& b) {
+        x0 = min(x0, b.x); y0 = min(y0, b.y); x1 = max(x1, b.x + b.w); y1 = max(y1, b.y + b.h);
+    });
+    return x0 <= x1 ? SDL_FRect{x0, y0, x1 - x0, y1 - y0} : SDL_FRect{0, 0, 0, 0};
+}
+
+// Lays out a C-block's body (children indented under the top bar, nested
+// C-blocks first) and returns its height. With apply=false nothing is
+// written, which is calcCBlockHeight.
+static float layoutCBlock(vector<Block>& blocks, Block& root, bool apply) {
+    const float barH = BASE_CBLOCK_BAR_H, mouthH = BASE_CBLOCK_MOUTH_H, indent = 20;
+    struct Frame { Block* cb; int cid; float top, cy; };
+    vector<Frame> st(1, Frame{&root, root.childHeadId, root.y + barH, root.y + barH});
+    size_t budget = blocks.size();
+    float h = 0;
+    while (!st.empty()) {
+        Frame f = st.back();
+        Block* child = f.cid >= 0 && budget ? findBlock(blocks, f.cid) : nullptr;
+        if (child) {
+            budget--;
+            float cx = f.cb->x + indent;
+            if (apply) {
+                if (child->x != cx || child->y != f.cy) gDirtyBlocks.insert(child->id);
+                child->x = cx; child->y = f.cy;
+            }
+            if (child->shape == BlockShape::C_BLOCK) {
+                float top = f.cy + barH;
+                st.push_back({child, child->childHeadId, top, top});
+                continue;
+            }
+            st.back().cy += child->h;
+            st.back().cid = child->nextBlockId;
+            continue;
         }
-        cy += child->h;
-        cid = child->nextBlockId;
+        h = barH + max(f.cy - f.top, mouthH) + barH;
+        if (apply && h != f.cb->h) { f.cb->h = h; gDirtyBlocks.insert(f.cb->id); }
+        st.pop_back();
+        if (!st.empty()) { st.back().cy += h; st.back().cid = f.cb->nextBlockId; }
     }
-    cb.h = calcCBlockHeight(blocks, cb);
+    return h;
 }
 
+static float calcCBlockHeight(vector<Block>& blocks, Block& cb) { return layoutCBlock(blocks, cb, false); }
+static void updateCBlockChildren(vector<Block>& blocks, Block& cb) { layoutCBlock(blocks, cb, true); }
+
 static Block cloneBlock(const Block& src, float x, float y) {
     Block b = src;
     b.id = gNextBlockId++;
@@ -680,51 +1123,55 @@ static Block cloneBlock(const Block& src, float x, float y) {
     return b;
 }
 
-static void drawBlock(SDL_Renderer* rnd, Block& b, vector<Block>& allBlocks, bool highlight = false) {
+// `at` overrides the block's workspace position (in pixels), e.g. for palette columns.
+static void drawBlock(SDL_Renderer* rnd, Block& b, vector<Block>& allBlocks, bool highlight = false,
+                      const SDL_FPoint* at = nullptr) {
     SDL_Color col = catColor(b.cat);
     Uint8 cr = col.r, cg = col.g, cb2 = col.b;
     if (highlight) { cr=min(255,cr+40); cg=min(255,cg+40); cb2=min(255,cb2+40); }
     bool isHighlighted = (b.id == gHighlightBlockId);
-    int bx=(int)b.x, by=(int)b.y, bw=(int)b.w, bh=(int)b.h, r=(int)L.BLOCK_CORNER_R;
+    float s=L.s;
+    SDL_FPoint p = at ? *at : SDL_FPoint{L.blockPxX(b.x), L.blockPxY(b.y)};
+    int bx=(int)p.x, by=(int)p.y, bw=(int)(b.w*s), bh=(int)(b.h*s), r=(int)L.BLOCK_CORNER_R;
 
     switch (b.shape) {
     case BlockShape::COMMAND:
     case BlockShape::CAP:
         fillRoundedRect(rnd, bx, by, bw, bh, r, cr, cg, cb2, 255);
-        { SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_Rect notch={bx+(int)(20*L.s),by-(int)(4*L.s),(int)(30*L.s),(int)(4*L.s)}; SDL_RenderFillRect(rnd,&notch); }
-        if (b.shape != BlockShape::CAP) { SDL_Rect notchB={bx+(int)(20*L.s),by+bh,(int)(30*L.s),(int)(4*L.s)}; SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_RenderFillRect(rnd,&notchB); }
+        { SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_Rect notch={bx+(int)(20*L.s),by-(int)(4*L.s),(int)(30*L.s),(int)(4*L.s)}; renderFillRect(rnd,&notch); }
+        if (b.shape != BlockShape::CAP) { SDL_Rect notchB={bx+(int)(20*L.s),by+bh,(int)(30*L.s),(int)(4*L.s)}; SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); renderFillRect(rnd,&notchB); }
         break;
     case BlockShape::HAT:
         fillRoundedRect(rnd, bx, by+(int)(10*L.s), bw, bh-(int)(10*L.s), r, cr, cg, cb2, 255);
         fillEllipse(rnd, bx+bw/2, by+(int)(10*L.s), bw/2, (int)(12*L.s), cr, cg, cb2, 255);
-        { SDL_Rect notchB={bx+(int)(20*L.s),by+bh,(int)(30*L.s),(int)(4*L.s)}; SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_RenderFillRect(rnd,&notchB); }
+        { SDL_Rect notchB={bx+(int)(20*L.s),by+bh,(int)(30*L.s),(int)(4*L.s)}; SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); renderFillRect(rnd,&notchB); }
         break;
     case BlockShape::C_BLOCK: {
         float barH=L.CBLOCK_BAR_H, indent=20*L.s;
         fillRoundedRect(rnd,bx,by,bw,(int)barH,r,cr,cg,cb2,255);
-        { SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_Rect notch={bx+(int)(20*L.s),by-(int)(4*L.s),(int)(30*L.s),(int)(4*L.s)}; SDL_RenderFillRect(rnd,&notch); }
-        { SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_Rect notchIn={bx+(int)indent+(int)(20*L.s),by+(int)barH,(int)(30*L.s),(int)(4*L.s)}; SDL_RenderFillRect(rnd,&notchIn); }
+        { SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_Rect notch={bx+(int)(20*L.s),by-(int)(4*L.s),(int)(30*L.s),(int)(4*L.s)}; renderFillRect(rnd,&notch); }
+        { SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_Rect notchIn={bx+(int)indent+(int)(20*L.s),by+(int)barH,(int)(30*L.s),(int)(4*L.s)}; renderFillRect(rnd,&notchIn); }
         float mouthTop=by+barH, mouthBot=by+bh-barH;
         SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255);
-        SDL_Rect leftBar={bx,(int)mouthTop,(int)indent,(int)(mouthBot-mouthTop)}; SDL_RenderFillRect(rnd,&leftBar);
-        { Uint8 mr=(Uint8)max(0,(int)cr-30),mg=(Uint8)max(0,(int)cg-30),mb=(Uint8)max(0,(int)cb2-30); SDL_SetRenderDrawColor(rnd,mr,mg,mb,80); SDL_Rect mouth={bx+(int)indent,(int)mouthTop,bw-(int)indent,(int)(mouthBot-mouthTop)}; SDL_RenderFillRect(rnd,&mouth); }
+        SDL_Rect leftBar={bx,(int)mouthTop,(int)indent,(int)(mouthBot-mouthTop)}; renderFillRect(rnd,&leftBar);
+        { Uint8 mr=(Uint8)max(0,(int)cr-30),mg=(Uint8)max(0,(int)cg-30),mb=(Uint8)max(0,(int)cb2-30); SDL_SetRenderDrawColor(rnd,mr,mg,mb,80); SDL_Rect mouth={bx+(int)indent,(int)mouthTop,bw-(int)indent,(int)(mouthBot-mouthTop)}; renderFillRect(rnd,&mouth); }
         fillRoundedRect(rnd,bx,(int)mouthBot,bw,(int)barH,r,cr,cg,cb2,255);
-        { SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_Rect notchB={bx+(int)(20*L.s),by+(int)b.h,(int)(30*L.s),(int)(4*L.s)}; SDL_RenderFillRect(rnd,&notchB); }
+        { SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_Rect notchB={bx+(int)(20*L.s),by+bh,(int)(30*L.s),(int)(4*L.s)}; renderFillRect(rnd,&notchB); }
         break; }
     case BlockShape::REPORTER: { int rr=bh/2; fillRoundedRect(rnd,bx,by,bw,bh,rr,cr,cg,cb2,255); break; }
     case BlockShape::BOOLEAN: {
         int pointW=bh/2;
-        for (int row=0;row<bh;row++) { int y=by+row; float t=(float)row/bh; int ind2=(t<0.5f)?(int)(pointW*(1.0f-2.0f*t)):(int)(pointW*(2.0f*t-1.0f)); SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); SDL_RenderDrawLine(rnd,bx+ind2,y,bx+bw-ind2,y); }
+        for (int row=0;row<bh;row++) { int y=by+row; float t=(float)row/bh; int ind2=(t<0.5f)?(int)(pointW*(1.0f-2.0f*t)):(int)(pointW*(2.0f*t-1.0f)); SDL_SetRenderDrawColor(rnd,cr,cg,cb2,255); renderDrawLine(rnd,bx+ind2,y,bx+bw-ind2,y); }
         break; }
     }
 
-    { int tx=bx+(int)(8*L.s), ty; if(b.shape==BlockShape::C_BLOCK) ty=by+(int)(L.CBLOCK_BAR_H*0.25f); else if(b.shape==BlockShape::HAT) ty=by+(int)(14*L.s); else ty=by+(int)(bh/2)-textHeight("A")/2; drawText(rnd,tx,ty,b.text.c_str(),255,255,255,255); }
+    { int tx=bx+(int)(8*L.s), ty; if(b.shape==BlockShape::C_BLOCK) ty=by+(int)(L.CBLOCK_BAR_H*0.25f); else if(b.shape==BlockShape::HAT) ty=by+(int)(14*L.s); else ty=by+(int)(bh/2)-textHeight("A")/2; drawText(rnd,tx,ty,b.text->c_str(),255,255,255,255); }
 
     for (int fi=0;fi<(int)b.inputs.size();fi++) {
         auto& inp=b.inputs[fi];
-        int fx=bx+(int)inp.relX, fy=by+(int)inp.relY, fw=(int)inp.width, fh=(int)inp.height;
+        int fx=bx+(int)(inp.relX*s), fy=by+(int)(inp.relY*s), fw=(int)(inp.width*s), fh=(int)(inp.height*s);
         fillRoundedRect(rnd,fx,fy,fw,fh,4,255,255,255,255);
-        if (inp.editing) { drawRoundedRectOutline(rnd,fx-1,fy-1,fw+2,fh+2,4,50,150,255,255); int tw=textWidth(inp.value.c_str()); int cursorX=fx+3+tw; SDL_SetRenderDrawColor(rnd,0,0,0,255); SDL_RenderDrawLine(rnd,cursorX,fy+2,cursorX,fy+fh-2); }
+        if (inp.editing) { drawRoundedRectOutline(rnd,fx-1,fy-1,fw+2,fh+2,4,50,150,255,255); int tw=textWidth(inp.value.c_str()); int cursorX=fx+3+tw; SDL_SetRenderDrawColor(rnd,0,0,0,255); renderDrawLine(rnd,cursorX,fy+2,cursorX,fy+fh-2); }
         drawText(rnd,fx+3,fy+(fh-textHeight("0"))/2,inp.value.c_str(),0,0,0,255);
     }
 
@@ -733,17 +1180,125 @@ static void drawBlock(SDL_Renderer* rnd, Block& b, vector<Block>& allBlocks, boo
         if (sl.embeddedBlockId<0) {
             bool hasInput=false;
             for (auto& inp:b.inputs) if (abs(inp.relX-sl.relX)<5&&abs(inp.relY-sl.relY)<5){hasInput=true;break;}
-            if (!hasInput) { int sx2=bx+(int)sl.relX,sy2=by+(int)sl.relY,sw2=(int)sl.width,sh2=(int)sl.height; fillRoundedRect(rnd,sx2,sy2,sw2,sh2,sh2/2,255,255,255,120); }
-            // حاشیه زرد برای بلاک در حال اجرا
-            if (isHighlighted) {
-                SDL_SetRenderDrawColor(rnd, 255, 220, 0, 255);
-                SDL_Rect hlRect = {bx-3, by-3, bw+6, bh+6};
-                SDL_RenderDrawRect(rnd, &hlRect);
-                SDL_Rect hlRect2 = {bx-2, by-2, bw+4, bh+4};
-                SDL_RenderDrawRect(rnd, &hlRect2);
-            }
+            if (!hasInput) { int sx2=bx+(int)(sl.relX*s),sy2=by+(int)(sl.relY*s),sw2=(int)(sl.width*s),sh2=(int)(sl.height*s); fillRoundedRect(rnd,sx2,sy2,sw2,sh2,sh2/2,255,255,255,120); }
         }
     }
+
+    // heatmap: قرمز به نسبت زمان اجرای خود بلاک
+    if (gBlockProfView && !b.inPalette && gBlockProfMaxSelf > 0) {
+        auto it = gBlockProfile.find(b.id);
+        if (it != gBlockProfile.end()) {
+            float heat = (float)it->second.selfTicks / (float)gBlockProfMaxSelf;
+            int hh = b.shape == BlockShape::C_BLOCK ? (int)L.CBLOCK_BAR_H : bh;
+            fillRoundedRect(rnd, bx, by, bw, hh, r, 255, (Uint8)(200 * (1 - heat)), 0, (Uint8)(40 + 150 * heat));
+        }
+    }
+
+    // حاشیه زرد برای بلاک در حال اجرا
+    if (isHighlighted) {
+        SDL_SetRenderDrawColor(rnd, 255, 220, 0, 255);
+        SDL_Rect hlRect = {bx-3, by-3, bw+6, bh+6};
+        renderDrawRect(rnd, &hlRect);
+        SDL_Rect hlRect2 = {bx-2, by-2, bw+4, bh+4};
+        renderDrawRect(rnd, &hlRect2);
+    }
+}
+
+// ════════════════════════════════════════════
+//  Block palette catalog
+// ════════════════════════════════════════════
+// Palette templates live apart from the workspace `blocks`, in a catalog
+// sorted by category and laid out once in design units. Each category is
+// drawn once per layout scale into a tall target texture, so scrolling is an
+// offset blit and a click only tests the row under the pointer.
+struct PaletteColumn {
+    int first = 0, count = 0;   // range in gPalette
+    float h = 0;                // design units
+    int texW = 0, texH = 0;
+    SDL_Texture* tex = nullptr;
+};
+static vector<Block> gPalette;  // x/y relative to the column's top-left
+static PaletteColumn gPaletteCols[NUM_CATEGORIES];
+
+static void releasePaletteTextures() {
+    for (auto& c : gPaletteCols) { if (c.tex) SDL_DestroyTexture(c.tex); c.tex = nullptr; }
+}
+
+static void ensurePaletteCatalog() {
+    if (!gPalette.empty()) return;
+    gPalette = buildPaletteBlocks();
+    stable_sort(gPalette.begin(), gPalette.end(), [](const Block& a, const Block& b) { return a.cat < b.cat; });
+    for (int i = 0; i < (int)gPalette.size();) {
+        Category cat = gPalette[i].cat;
+        PaletteColumn& c = gPaletteCols[(int)cat];
+        c.first = i;
+        float y = 5;
+        for (; i < (int)gPalette.size() && gPalette[i].cat == cat; i++, c.count++) {
+            gPalette[i].x = 5; gPalette[i].y = y;
+            y += gPalette[i].h + 8;
+        }
+        c.h = y;
+    }
+}
+
+static const Block* paletteBlock(int id) {
+    ensurePaletteCatalog();
+    for (auto& b : gPalette) if (b.id == id) return &b;
+    return nullptr;
+}
+
+static int paletteColumnHeight(Category cat) {
+    ensurePaletteCatalog();
+    return (int)ceilf(gPaletteCols[(int)cat].h * L.s);
+}
+
+// Template under column-relative pixel (x, y). Rows are sorted by y, so only
+// the last row starting above the pointer can contain it.
+static const Block* paletteHitTest(Category cat, float x, float y) {
+    ensurePaletteCatalog();
+    x /= L.s; y /= L.s;
+    const PaletteColumn& c = gPaletteCols[(int)cat];
+    auto first = gPalette.begin() + c.first, last = first + c.count;
+    auto it = upper_bound(first, last, y, [](float v, const Block& b) { return v < b.y; });
+    if (it == first) return nullptr;
+    const Block& b = *--it;
+    return x >= b.x && x <= b.x + b.w && y <= b.y + b.h ? &b : nullptr;
+}
+
+// Visible slice of a category's column at (x, y), scrolled by scrollY <= 0.
+// Renderers without target textures draw the visible rows directly.
+static void drawPaletteColumn(SDL_Renderer* rnd, Category cat, int x, int y, int visibleH, int scrollY) {
+    ensurePaletteCatalog();
+    PaletteColumn& c = gPaletteCols[(int)cat];
+    float s = L.s;
+    int colW = L.PALETTE_WIDTH - L.CAT_PANEL_WIDTH, colH = (int)ceilf(c.h * s);
+    if (c.tex && (c.texW != colW || c.texH != colH)) releasePaletteTextures();
+    if (!c.tex && colH > 0 && (c.tex = SDL_CreateTexture(rnd, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, colW, colH))) {
+        c.texW = colW; c.texH = colH;
+        SDL_Texture* prev = SDL_GetRenderTarget(rnd);
+        SDL_SetTextureBlendMode(c.tex, SDL_BLENDMODE_NONE);
+        SDL_SetRenderTarget(rnd, c.tex);
+        SDL_SetRenderDrawColor(rnd, 50, 50, 65, 255);
+        renderClear(rnd);
+        for (int i = c.first; i < c.first + c.count; i++) {
+            SDL_FPoint at = {gPalette[i].x * s, gPalette[i].y * s};
+            drawBlock(rnd, gPalette[i], gPalette, false, &at);
+        }
+        SDL_SetRenderTarget(rnd, prev);
+    }
+    int top = -scrollY, h = min(visibleH, colH - top);
+    if (h <= 0) return;
+    if (c.tex) {
+        SDL_Rect src = {0, top, colW, h}, dst = {x, y, colW, h};
+        renderCopy(rnd, c.tex, &src, &dst);
+        return;
+    }
+    for (int i = c.first; i < c.first + c.count; i++) {
+        Block& b = gPalette[i];
+        if ((b.y + b.h) * s < top || b.y * s > top + h) continue;
+        SDL_FPoint at = {x + b.x * s, y - top + b.y * s};
+        drawBlock(rnd, b, gPalette, false, &at);
+    }
 }
 
 // ════════════════════════════════════════════
@@ -754,37 +1309,218 @@ static void drawCatSprite(SDL_Renderer* rnd, int cx, int cy, int sz, SDL_Color c
     int half=sz/2;
     fillEllipse(rnd,cx,cy,half,half,col.r,col.g,col.b,col.a);
     int earH=half*2/3, earW=half/3;
-    for (int row=0;row<earH;row++) { float t=(float)row/earH; int w=(int)(earW*(1.0f-t)); SDL_SetRenderDrawColor(rnd,col.r,col.g,col.b,col.a); SDL_RenderDrawLine(rnd,cx-half/2-w,cy-half-row,cx-half/2+w,cy-half-row); SDL_RenderDrawLine(rnd,cx+half/2-w,cy-half-row,cx+half/2+w,cy-half-row); }
+    for (int row=0;row<earH;row++) { float t=(float)row/earH; int w=(int)(earW*(1.0f-t)); SDL_SetRenderDrawColor(rnd,col.r,col.g,col.b,col.a); renderDrawLine(rnd,cx-half/2-w,cy-half-row,cx-half/2+w,cy-half-row); renderDrawLine(rnd,cx+half/2-w,cy-half-row,cx+half/2+w,cy-half-row); }
     fillEllipse(rnd,cx-half/3,cy-half/4,sz/10,sz/8,255,255,255,col.a);
     fillEllipse(rnd,cx+half/3,cy-half/4,sz/10,sz/8,255,255,255,col.a);
     fillEllipse(rnd,cx-half/3,cy-half/4,sz/20,sz/14,0,0,0,col.a);
     fillEllipse(rnd,cx+half/3,cy-half/4,sz/20,sz/14,0,0,0,col.a);
-SDL_SetRenderDrawColor(rnd,0,0,0,col.a);    SDL_RenderDrawLine(rnd,cx-half/5,cy+half/4,cx,cy+half/3);
-    SDL_RenderDrawLine(rnd,cx+half/5,cy+half/4,cx,cy+half/3);
+SDL_SetRenderDrawColor(rnd,0,0,0,col.a);    renderDrawLine(rnd,cx-half/5,cy+half/4,cx,cy+half/3);
+    renderDrawLine(rnd,cx+half/5,cy+half/4,cx,cy+half/3);
 }
 
 static void drawSpeechBubble(SDL_Renderer* rnd, int cx, int cy, const char* text, bool isThink) {
     if (!text||text[0]=='\0') return;
-    int tw=textWidth(text)+(int)(20*L.s), th=textHeight(text)+(int)(16*L.s);
-    int bx2=cx-tw/2, by2=cy-th-(int)(20*L.s);
+    int tw=textWidth(text,STAGE_TEXT_SCALE)+20, th=textHeight(text,STAGE_TEXT_SCALE)+16;
+    int bx2=cx-tw/2, by2=cy-th-20;
     fillRoundedRect(rnd,bx2,by2,tw,th,10,255,255,255,255);
     SDL_SetRenderDrawColor(rnd,180,180,180,255);
-    SDL_Rect bdr={bx2,by2,tw,th}; SDL_RenderDrawRect(rnd,&bdr);
+    SDL_Rect bdr={bx2,by2,tw,th}; renderDrawRect(rnd,&bdr);
     if (isThink) { fillEllipse(rnd,cx,by2+th+5,5,5,255,255,255,255); fillEllipse(rnd,cx+3,by2+th+12,3,3,255,255,255,255); }
-    else { SDL_SetRenderDrawColor(rnd,255,255,255,255); for(int row=0;row<12;row++){int y=by2+th+row;float t=row/12.0f;int lx=(int)((1-t)*(cx-5)+t*cx),rx=(int)((1-t)*(cx+5)+t*cx);SDL_RenderDrawLine(rnd,lx,y,rx,y);} }
-    drawText(rnd,bx2+(int)(10*L.s),by2+(int)(8*L.s),text,0,0,0,255);
+    else { SDL_SetRenderDrawColor(rnd,255,255,255,255); for(int row=0;row<12;row++){int y=by2+th+row;float t=row/12.0f;int lx=(int)((1-t)*(cx-5)+t*cx),rx=(int)((1-t)*(cx+5)+t*cx);renderDrawLine(rnd,lx,y,rx,y);} }
+    drawText(rnd,bx2+10,by2+8,text,0,0,0,255,STAGE_TEXT_SCALE);
+}
+
+static void ensureSpriteTextures(SDL_Renderer* rnd, Sprite& sp);
+
+// Sprites in stage units, centred on (stageCX, stageCY); see "Stage render target".
+// Costume (or the default cat) with colour and ghost effects, centred on (sx, sy).
+// The effects are passed in: a pen stamp uses the ones it was queued with.
+static void drawSpriteBody(SDL_Renderer* rnd, Sprite& sp, int costume, float ghostEffect, float colorEffect,
+                           int sx, int sy, int sz) {
+    // اعمال colorEffect
+    SDL_Color drawCol = sp.color;
+    if (colorEffect == 1) { drawCol = {255,100,100,255}; }
+    else if (colorEffect == 2) { drawCol = {100,255,100,255}; }
+    else if (colorEffect == 3) { drawCol = {100,100,255,255}; }
+    else if (colorEffect == 4) { drawCol = {255,255,100,255}; }
+    else if (colorEffect == 5) { drawCol = {200,100,255,255}; }
+
+    // اعمال ghostEffect (شفافیت)
+    drawCol.a = (Uint8)(255 * (1.0f - ghostEffect / 100.0f));
+
+    ensureSpriteTextures(rnd, sp);
+    SDL_Texture* spTex = sp.uploadedTexture;
+    if (costume >= 0 && costume < (int)sp.costumes.size() && sp.costumes[costume].texture)
+        spTex = sp.costumes[costume].texture;
+    if (spTex) {
+        // رسم تصویر آپلود شده
+        SDL_Rect srcRect = {0,0,0,0};
+        SDL_QueryTexture(spTex, NULL, NULL, &srcRect.w, &srcRect.h);
+        SDL_Rect dstRect = {sx-sz/2, sy-sz/2, sz, sz};
+        renderCopy(rnd, spTex, &srcRect, &dstRect);
+    } else {
+        // رسم گربه پیش‌فرض
+        drawCatSprite(rnd,sx,sy,sz,drawCol);
+    }
+}
+
+static void drawStageSprites(SDL_Renderer* rnd, vector<Sprite>& sprites, int stageCX, int stageCY, int selectedSpriteIdx) {
+    for(int si=0;si<(int)sprites.size();si++){
+        Sprite& sp=sprites[si];
+        if(!sp.visible) continue;
+        int sx=stageCX+(int)sp.x, sy=stageCY-(int)sp.y;
+        int sz=(int)(SPRITE_SIZE*sp.size/100.0f);
+
+        drawSpriteBody(rnd, sp, sp.currentCostume, sp.ghostEffect, sp.colorEffect, sx, sy, sz);
+        // نشانگر جهت
+        float angle=(sp.direction-90)*M_PI/180.0f;
+        int arrowX=sx+(int)((sz*0.8f)*cos(angle));
+        int arrowY=sy+(int)((sz*0.8f)*sin(angle));
+        SDL_SetRenderDrawColor(rnd,0,0,0,180);
+        renderDrawLine(rnd,sx,sy,arrowX,arrowY);
+        fillEllipse(rnd,arrowX,arrowY,4,4,0,0,0,255);
+
+        // کادر انتخاب
+        if(si==selectedSpriteIdx){SDL_SetRenderDrawColor(rnd,50,150,255,255);SDL_Rect selR={sx-sz-3,sy-sz-3,2*sz+6,2*sz+6};renderDrawRect(rnd,&selR);}
+
+        if(!sp.sayText.empty()) drawSpeechBubble(rnd,sx,sy-sz-5,sp.sayText.c_str(),false);
+        if(!sp.thinkText.empty()) drawSpeechBubble(rnd,sx,sy-sz-5,sp.thinkText.c_str(),true);
+    }
+}
+
+// ════════════════════════════════════════════
+//  Pen layer
+// ════════════════════════════════════════════
+// A persistent transparent stage-sized texture drawn under the sprites.
+// Scripts only queue work: strokes are collected once per tick from the
+// sprites whose pen is down, and drawStage flushes the queue into the
+// texture as one thick-line geometry batch (split only around stamps).
+// Old strokes are never redrawn, so cost follows new ink, not total ink.
+struct PenSegment { float x0, y0, x1, y1, w; SDL_Color col; };   // stage coords
+struct PenStamp { int sprite; float x, y, size, ghost, color; int costume; size_t seg; };
+struct PenLayer {
+    SDL_Texture* tex = nullptr;
+    bool clearPending = true;
+    vector<PenSegment> segs;
+    vector<PenStamp> stamps;        // seg = strokes queued before the stamp
+};
+static PenLayer gPen;
+
+static SDL_Color penColor(float hue) {
+    float h = fmodf(hue, 100.0f); if (h < 0) h += 100;
+    float f = h * 0.06f;                       // 0..6
+    int i = (int)f; float t = f - i;
+    auto c = [](float v) { return (Uint8)(v * 255); };
+    switch (i % 6) {
+    case 0: return {255, c(t), 0, 255};
+    case 1: return {c(1 - t), 255, 0, 255};
+    case 2: return {0, 255, c(t), 255};
+    case 3: return {0, c(1 - t), 255, 255};
+    case 4: return {c(t), 0, 255, 255};
+    default: return {255, 0, c(1 - t), 255};
+    }
+}
+
+static void penSegment(const Sprite& sp, float x0, float y0) {
+    gPen.segs.push_back({x0, y0, sp.x, sp.y, sp.penSize, penColor(sp.penHue)});
+}
+
+static void penStamp(int spriteIdx, const Sprite& sp) {
+    gPen.stamps.push_back({spriteIdx, sp.x, sp.y, sp.size, sp.ghostEffect, sp.colorEffect, sp.currentCostume, gPen.segs.size()});
+}
+
+static void clearPen() {
+    gPen.segs.clear();
+    gPen.stamps.clear();
+    gPen.clearPending = true;
+}
+
+// Once per tick: one stroke per sprite that moved with its pen down.
+static void trackPen(vector<Sprite>& sprites) {
+    for (auto& sp : sprites) {
+        if (sp.penDown && (sp.x != sp.penX || sp.y != sp.penY)) penSegment(sp, sp.penX, sp.penY);
+        sp.penX = sp.x; sp.penY = sp.y;
+    }
+}
+
+static void drawPenSegments(SDL_Renderer* rnd, size_t from, size_t to) {
+    static vector<SDL_Vertex> verts;
+    static vector<int> idx;
+    size_t n = to - from;
+    if (!n) return;
+    verts.resize(n * 4);
+    for (size_t i = idx.size() / 6; i < n; i++) {
+        int b = (int)i * 4;
+        int quad[6] = {b, b+1, b+2, b, b+2, b+3};
+        idx.insert(idx.end(), quad, quad + 6);
+    }
+    const float cx = STAGE_LOGICAL_W * 0.5f, cy = STAGE_LOGICAL_H * 0.5f;
+    for (size_t i = 0; i < n; i++) {
+        const PenSegment& g = gPen.segs[from + i];
+        float x0 = cx + g.x0, y0 = cy - g.y0, x1 = cx + g.x1, y1 = cy - g.y1;
+        float len = hypotf(x1 - x0, y1 - y0), r = max(0.5f, g.w * 0.5f);
+        float ux = len > 1e-4f ? (x1 - x0) / len : 1, uy = len > 1e-4f ? (y1 - y0) / len : 0;
+        float nx = -uy * r, ny = ux * r;
+        x0 -= ux * r; y0 -= uy * r; x1 += ux * r; y1 += uy * r;   // square caps
+        SDL_Vertex* v = &verts[i * 4];
+        v[0] = {{x0 + nx, y0 + ny}, g.col, {0, 0}};
+        v[1] = {{x1 + nx, y1 + ny}, g.col, {0, 0}};
+        v[2] = {{x1 - nx, y1 - ny}, g.col, {0, 0}};
+        v[3] = {{x0 - nx, y0 - ny}, g.col, {0, 0}};
+    }
+    renderGeometry(rnd, nullptr, verts.data(), (int)n * 4, idx.data(), (int)n * 6);
+}
+
+// Applies queued clears, strokes and stamps to the pen texture and returns
+// it (null if the renderer has no target textures).
+static SDL_Texture* flushPen(SDL_Renderer* rnd, vector<Sprite>& sprites) {
+    PenLayer& P = gPen;
+    if (!P.tex) {
+        P.tex = SDL_CreateTexture(rnd, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, STAGE_LOGICAL_W, STAGE_LOGICAL_H);
+        if (!P.tex) { P.segs.clear(); P.stamps.clear(); return nullptr; }
+        SDL_SetTextureBlendMode(P.tex, SDL_BLENDMODE_BLEND);
+        P.clearPending = true;
+    }
+    if (!P.clearPending && P.segs.empty() && P.stamps.empty()) return P.tex;
+    SDL_Texture* prev = SDL_GetRenderTarget(rnd);
+    float scx, scy;
+    SDL_RenderGetScale(rnd, &scx, &scy);
+    SDL_SetRenderTarget(rnd, P.tex);
+    SDL_RenderSetScale(rnd, 1, 1);
+    if (P.clearPending) {
+        SDL_SetRenderDrawColor(rnd, 0, 0, 0, 0);
+        renderClear(rnd);
+        P.clearPending = false;
+    }
+    size_t done = 0;
+    for (auto& st : P.stamps) {
+        drawPenSegments(rnd, done, st.seg);
+        done = st.seg;
+        if (st.sprite < 0 || st.sprite >= (int)sprites.size()) continue;
+        drawSpriteBody(rnd, sprites[st.sprite], st.costume, st.ghost, st.color, STAGE_LOGICAL_W / 2 + (int)st.x,
+                       STAGE_LOGICAL_H / 2 - (int)st.y, (int)(SPRITE_SIZE * st.size / 100.0f));
+    }
+    drawPenSegments(rnd, done, P.segs.size());
+    SDL_SetRenderTarget(rnd, prev);
+    SDL_RenderSetScale(rnd, scx, scy);
+    P.segs.clear();
+    P.stamps.clear();
+    return P.tex;
 }
 
 static void detachBlock(vector<Block>& blocks, int blockId) {
     Block* b=findBlock(blocks,blockId);
     if (!b) return;
     int parentId=b->parentBlockId;
+    gDirtyBlocks.insert(blockId);
+    if (b->nextBlockId>=0) gDirtyBlocks.insert(b->nextBlockId);
     if (parentId>=0) {
+        gDirtyBlocks.insert(parentId);
         Block* parent=findBlock(blocks,parentId);
         if (parent) {
             if (parent->nextBlockId==blockId) parent->nextBlockId=-1;
             if (parent->childHeadId==blockId) { parent->childHeadId=b->nextBlockId; if(b->nextBlockId>=0){Block* next=findBlock(blocks,b->nextBlockId);if(next)next->parentBlockId=parentId;} }
-            else if (parent->childHeadId>=0) { int prevId=parent->childHeadId; while(prevId>=0){Block* prev=findBlock(blocks,prevId);if(!prev)break;if(prev->nextBlockId==blockId){prev->nextBlockId=b->nextBlockId;if(b->nextBlockId>=0){Block* nxt=findBlock(blocks,b->nextBlockId);if(nxt)nxt->parentBlockId=prevId;}break;}prevId=prev->nextBlockId;} }
+            else if (parent->childHeadId>=0) { int prevId=parent->childHeadId; while(prevId>=0){Block* prev=findBlock(blocks,prevId);if(!prev)break;if(prev->nextBlockId==blockId){gDirtyBlocks.insert(prevId);prev->nextBlockId=b->nextBlockId;if(b->nextBlockId>=0){Block* nxt=findBlock(blocks,b->nextBlockId);if(nxt)nxt->parentBlockId=prevId;}break;}prevId=prev->nextBlockId;} }
             for (auto& sl:parent->opSlots) if(sl.embeddedBlockId==blockId) sl.embeddedBlockId=-1;
         }
     }
@@ -792,36 +1528,300 @@ static void detachBlock(vector<Block>& blocks, int blockId) {
 }
 
 static void moveBlockChain(vector<Block>& blocks, int blockId, float dx, float dy) {
-    Block* b=findBlock(blocks,blockId);
-    if (!b) return;
-    b->x+=dx; b->y+=dy;
-    if (b->shape==BlockShape::C_BLOCK&&b->childHeadId>=0) { int cid=b->childHeadId; while(cid>=0){Block* c=findBlock(blocks,cid);if(!c)break;moveBlockChain(blocks,cid,dx,dy);cid=c->nextBlockId;} }
-    for (auto& sl:b->opSlots) if(sl.embeddedBlockId>=0){Block* emb=findBlock(blocks,sl.embeddedBlockId);if(emb){emb->x+=dx;emb->y+=dy;}}
-    if (b->nextBlockId>=0) moveBlockChain(blocks,b->nextBlockId,dx,dy);
+    forEachInStack(blocks, blockId, [&](Block& b) { b.x+=dx; b.y+=dy; gDirtyBlocks.insert(b.id); });
+}
+
+// A stack being dragged. Members and bounds are captured when the drag
+// starts; motion only updates (dx, dy), which drawing adds on the fly, and
+// the blocks themselves move once, on drop.
+struct StackDrag {
+    int root = -1;
+    vector<Uint8> member;       // by index into blocks
+    SDL_FRect box = {0, 0, 0, 0};
+    float dx = 0, dy = 0;
+    bool has(size_t i) const { return i < member.size() && member[i]; }
+};
+static StackDrag gStackDrag;
+
+static void beginStackDrag(vector<Block>& blocks, int rootId) {
+    StackDrag& d = gStackDrag;
+    d.root = rootId; d.dx = d.dy = 0;
+    d.member.assign(blocks.size(), 0);
+    forEachInStack(blocks, rootId, [&](Block& b) { d.member[&b - blocks.data()] = 1; });
+    d.box = stackBounds(blocks, rootId);
+}
+
+static void cancelStackDrag() { gStackDrag = StackDrag{}; }
+
+static void endStackDrag(vector<Block>& blocks) {
+    StackDrag& d = gStackDrag;
+    if (d.root >= 0 && (d.dx != 0 || d.dy != 0))
+        for (size_t i = 0; i < blocks.size(); i++)
+            if (d.has(i)) { blocks[i].x += d.dx; blocks[i].y += d.dy; gDirtyBlocks.insert(blocks[i].id); }
+    cancelStackDrag();
+}
+
+// ════════════════════════════════════════════
+//  Workspace selection + clipboard
+// ════════════════════════════════════════════
+// The unit of selection is a top-level stack. The rubber band queries a
+// uniform grid over stack bounds built when the band starts, so each motion
+// event costs the cells it covers rather than a pass over every block.
+// Copied stacks are kept sorted by id; paste gives the copy consecutive new
+// ids in one pass, remapping links by binary search into the copy and
+// cutting the ones that leave it, and journals every new block as a palette
+// clone plus its state.
+static void journalClone(int srcId, int newId);
+static void journalDelete(int id);
+
+struct StackGrid {
+    static constexpr float CELL = 256;     // design units
+    vector<int> roots;
+    vector<SDL_FRect> box;
+    vector<Uint32> seen;                   // query stamp per root
+    Uint32 query = 0;
+    unordered_map<Uint64, vector<int>> cells;
+    int cx0 = 0, cy0 = 0, cx1 = -1, cy1 = -1;
+};
+static StackGrid gStackGrid;
+
+struct RubberBand {
+    bool active = false;
+    float x0 = 0, y0 = 0, x1 = 0, y1 = 0;  // design units
+    vector<int> base;                      // selection kept when shift is held
+};
+static RubberBand gBand;
+
+static vector<int> gSelectedRoots;         // sorted ids
+static vector<Uint8> gSelectedMark;        // by index into blocks, see markSelection
+static vector<Block> gClipboard;           // sorted by id
+static int gPasteCount = 0;
+
+static Uint64 stackGridKey(int cx, int cy) { return ((Uint64)(Uint32)cx << 32) | (Uint32)cy; }
+
+static void buildStackGrid(vector<Block>& blocks) {
+    StackGrid& g = gStackGrid;
+    g.roots.clear(); g.box.clear(); g.cells.clear();
+    g.cx0 = g.cy0 = INT_MAX; g.cx1 = g.cy1 = INT_MIN;
+    for (auto& b : blocks) {
+        if (b.parentBlockId >= 0) continue;
+        SDL_FRect r = stackBounds(blocks, b.id);
+        int k = (int)g.roots.size();
+        g.roots.push_back(b.id); g.box.push_back(r);
+        int x0 = (int)floorf(r.x / g.CELL), y0 = (int)floorf(r.y / g.CELL);
+        int x1 = (int)floorf((r.x + r.w) / g.CELL), y1 = (int)floorf((r.y + r.h) / g.CELL);
+        for (int cy = y0; cy <= y1; cy++)
+            for (int cx = x0; cx <= x1; cx++) g.cells[stackGridKey(cx, cy)].push_back(k);
+        g.cx0 = min(g.cx0, x0); g.cy0 = min(g.cy0, y0); g.cx1 = max(g.cx1, x1); g.cy1 = max(g.cy1, y1);
+    }
+    g.seen.assign(g.roots.size(), 0);
+    g.query = 0;
+}
+
+// Appends the roots of stacks whose bounds overlap r.
+static void queryStackGrid(SDL_FRect r, vector<int>& out) {
+    StackGrid& g = gStackGrid;
+    if (g.roots.empty()) return;
+    int x0 = max(g.cx0, (int)floorf(r.x / g.CELL)), y0 = max(g.cy0, (int)floorf(r.y / g.CELL));
+    int x1 = min(g.cx1, (int)floorf((r.x + r.w) / g.CELL)), y1 = min(g.cy1, (int)floorf((r.y + r.h) / g.CELL));
+    if (++g.query == 0) { fill(g.seen.begin(), g.seen.end(), 0); g.query = 1; }
+    for (int cy = y0; cy <= y1; cy++)
+        for (int cx = x0; cx <= x1; cx++) {
+            auto it = g.cells.find(stackGridKey(cx, cy));
+            if (it == g.cells.end()) continue;
+            for (int k : it->second) {
+                if (g.seen[k] == g.query) continue;
+                g.seen[k] = g.query;
+                const SDL_FRect& b = g.box[k];
+                if (b.x <= r.x + r.w && r.x <= b.x + b.w && b.y <= r.y + r.h && r.y <= b.y + b.h) out.push_back(g.roots[k]);
+            }
+        }
+}
+
+static void clearSelection() {
+    gSelectedRoots.clear(); gSelectedMark.clear();
+    gBand.active = false;
+}
+
+// Drops roots that were deleted or snapped under another stack, then marks
+// every member of the remaining ones.
+static void markSelection(vector<Block>& blocks) {
+    gSelectedMark.assign(gSelectedRoots.empty() ? 0 : blocks.size(), 0);
+    size_t keep = 0;
+    for (int id : gSelectedRoots) {
+        Block* b = findBlock(blocks, id);
+        if (!b || b->parentBlockId >= 0) continue;
+        gSelectedRoots[keep++] = id;
+        forEachInStack(blocks, id, [&](Block& m) { gSelectedMark[&m - blocks.data()] = 1; });
+    }
+    gSelectedRoots.resize(keep);
+}
+
+static bool isSelected(size_t i) { return i < gSelectedMark.size() && gSelectedMark[i]; }
+
+static void selectAllStacks(vector<Block>& blocks) {
+    gSelectedRoots.clear();
+    for (auto& b : blocks) if (b.parentBlockId < 0) gSelectedRoots.push_back(b.id);
+    sort(gSelectedRoots.begin(), gSelectedRoots.end());
+}
+
+static void beginRubberBand(vector<Block>& blocks, float x, float y, bool additive) {
+    buildStackGrid(blocks);
+    gBand.active = true;
+    gBand.x0 = gBand.x1 = x; gBand.y0 = gBand.y1 = y;
+    gBand.base = additive ? gSelectedRoots : vector<int>();
+    gSelectedRoots = gBand.base;
+}
+
+static void updateRubberBand(float x, float y) {
+    RubberBand& r = gBand;
+    r.x1 = x; r.y1 = y;
+    SDL_FRect rect = {min(r.x0, r.x1), min(r.y0, r.y1), fabsf(r.x1 - r.x0), fabsf(r.y1 - r.y0)};
+    gSelectedRoots = r.base;
+    queryStackGrid(rect, gSelectedRoots);
+    sort(gSelectedRoots.begin(), gSelectedRoots.end());
+    gSelectedRoots.erase(unique(gSelectedRoots.begin(), gSelectedRoots.end()), gSelectedRoots.end());
+}
+
+// Drags every selected stack as one; nothing is detached and nothing snaps.
+static void beginSelectionDrag(vector<Block>& blocks) {
+    StackDrag& d = gStackDrag;
+    markSelection(blocks);
+    d.root = gSelectedRoots.empty() ? -1 : gSelectedRoots[0];
+    d.dx = d.dy = 0;
+    d.member = gSelectedMark;
+    float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX;
+    for (int id : gSelectedRoots) {
+        SDL_FRect r = stackBounds(blocks, id);
+        x0 = min(x0, r.x); y0 = min(y0, r.y); x1 = max(x1, r.x + r.w); y1 = max(y1, r.y + r.h);
+    }
+    d.box = x0 <= x1 ? SDL_FRect{x0, y0, x1 - x0, y1 - y0} : SDL_FRect{0, 0, 0, 0};
+}
+
+// Erases the marked blocks (by index) in one compaction pass and cuts any
+// link a survivor still holds into them.
+static void deleteMarkedBlocks(vector<Block>& blocks, const vector<Uint8>& mark) {
+    vector<int> gone;
+    for (size_t i = 0; i < blocks.size() && i < mark.size(); i++) if (mark[i]) gone.push_back(blocks[i].id);
+    if (gone.empty()) return;
+    sort(gone.begin(), gone.end());
+    auto dead = [&](int id) { return id >= 0 && binary_search(gone.begin(), gone.end(), id); };
+    size_t w = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        Block& b = blocks[i];
+        if (i < mark.size() && mark[i]) { journalDelete(b.id); continue; }
+        bool cut = false;
+        if (dead(b.nextBlockId)) { b.nextBlockId = -1; cut = true; }
+        if (dead(b.parentBlockId)) { b.parentBlockId = -1; cut = true; }
+        if (dead(b.childHeadId)) { b.childHeadId = -1; cut = true; }
+        for (auto& sl : b.opSlots) if (dead(sl.embeddedBlockId)) { sl.embeddedBlockId = -1; cut = true; }
+        if (cut) gDirtyBlocks.insert(b.id);
+        if (w != i) blocks[w] = move(b);
+        w++;
+    }
+    blocks.resize(w);
+}
+
+static void deleteSelection(vector<Block>& blocks) {
+    markSelection(blocks);
+    deleteMarkedBlocks(blocks, gSelectedMark);
+    clearSelection();
+}
+
+// Members of the given stacks, sorted by id.
+static vector<Block> copyStacks(vector<Block>& blocks, const vector<int>& roots) {
+    vector<Block> out;
+    for (int id : roots) forEachInStack(blocks, id, [&](Block& b) { out.push_back(b); });
+    sort(out.begin(), out.end(), [](const Block& a, const Block& b) { return a.id < b.id; });
+    out.erase(unique(out.begin(), out.end(), [](const Block& a, const Block& b) { return a.id == b.id; }), out.end());
+    return out;
+}
+
+// Palette prototype a workspace block was cloned from, or -1.
+static int paletteSourceId(const Block& b) {
+    static unordered_map<const string*, int> byLabel;
+    if (byLabel.empty()) {
+        ensurePaletteCatalog();
+        for (auto& p : gPalette) byLabel.emplace(p.text, p.id);
+    }
+    auto it = byLabel.find(b.text);
+    if (it == byLabel.end()) return -1;
+    const Block* p = paletteBlock(it->second);
+    return p && p->shape == b.shape && p->inputs.size() == b.inputs.size() && p->opSlots.size() == b.opSlots.size() ? p->id : -1;
+}
+
+// Adds a copy of src (sorted by id) shifted by (dx, dy) and selects its roots.
+static void pasteBlocks(vector<Block>& blocks, const vector<Block>& src, float dx, float dy) {
+    if (src.empty()) return;
+    int base = gNextBlockId;
+    gNextBlockId += (int)src.size();
+    auto remap = [&](int id) {
+        if (id < 0) return -1;
+        auto it = lower_bound(src.begin(), src.end(), id, [](const Block& b, int v) { return b.id < v; });
+        return it != src.end() && it->id == id ? base + (int)(it - src.begin()) : -1;
+    };
+    blocks.reserve(blocks.size() + src.size());
+    gSelectedRoots.clear();
+    for (size_t i = 0; i < src.size(); i++) {
+        Block b = src[i];
+        b.id = base + (int)i;
+        b.x += dx; b.y += dy;
+        b.inPalette = false;
+        b.nextBlockId = remap(b.nextBlockId); b.parentBlockId = remap(b.parentBlockId); b.childHeadId = remap(b.childHeadId);
+        for (auto& inp : b.inputs) inp.editing = false;
+        for (auto& sl : b.opSlots) sl.embeddedBlockId = remap(sl.embeddedBlockId);
+        int proto = paletteSourceId(b);
+        if (proto >= 0) journalClone(proto, b.id);
+        else gAutosaveSnapshotWanted = true;
+        if (b.parentBlockId < 0) gSelectedRoots.push_back(b.id);
+        blocks.push_back(b);
+    }
+}
+
+static void copySelection(vector<Block>& blocks) {
+    markSelection(blocks);
+    if (gSelectedRoots.empty()) return;
+    gClipboard = copyStacks(blocks, gSelectedRoots);
+    gPasteCount = 0;
+}
+
+static void pasteClipboard(vector<Block>& blocks) {
+    float off = 30.0f * ++gPasteCount;
+    pasteBlocks(blocks, gClipboard, off, off);
+}
+
+static void duplicateSelection(vector<Block>& blocks) {
+    markSelection(blocks);
+    if (gSelectedRoots.empty()) return;
+    pasteBlocks(blocks, copyStacks(blocks, gSelectedRoots), 30, 30);
 }
 
 static void trySnapBlocks(vector<Block>& blocks, int dragId) {
     Block* drag=findBlock(blocks,dragId);
-    if (!drag||drag->inPalette) return;
-    float snapDist=L.SNAP_DISTANCE;
+    if (!drag) return;
+    float snapDist=BASE_SNAP_DISTANCE;
+    gDirtyBlocks.insert(dragId);
+    // بلوک‌های خود پشته‌ی کشیده‌شده هدف اتصال نیستند (وگرنه حلقه ساخته می‌شود)
+    vector<Uint8> own(blocks.size(),0);
+    forEachInStack(blocks,dragId,[&](Block& b){own[&b-blocks.data()]=1;});
 
     if (drag->shape==BlockShape::COMMAND||drag->shape==BlockShape::C_BLOCK||drag->shape==BlockShape::CAP) {
         for (auto& other:blocks) {
-            if (other.id==dragId||other.inPalette) continue;
+            if (own[&other-blocks.data()]) continue;
             if (other.nextBlockId>=0||other.shape==BlockShape::CAP||other.shape==BlockShape::REPORTER||other.shape==BlockShape::BOOLEAN) continue;
             float ox=other.x, oy=other.y+other.h;
-            if (abs(drag->x-ox)<snapDist&&abs(drag->y-oy)<snapDist) { float ddx=ox-drag->x,ddy=oy-drag->y; moveBlockChain(blocks,dragId,ddx,ddy); other.nextBlockId=dragId; drag->parentBlockId=other.id; return; }
+            if (abs(drag->x-ox)<snapDist&&abs(drag->y-oy)<snapDist) { float ddx=ox-drag->x,ddy=oy-drag->y; moveBlockChain(blocks,dragId,ddx,ddy); other.nextBlockId=dragId; drag->parentBlockId=other.id; gDirtyBlocks.insert(other.id); return; }
         }
     }
 
     if (drag->shape==BlockShape::COMMAND||drag->shape==BlockShape::C_BLOCK) {
         for (auto& other:blocks) {
-            if (other.id==dragId||other.inPalette||other.shape!=BlockShape::C_BLOCK) continue;
-            float indent=20*L.s, barH=L.CBLOCK_BAR_H, mouthX=other.x+indent, mouthY=other.y+barH;
+            if (own[&other-blocks.data()]||other.shape!=BlockShape::C_BLOCK) continue;
+            float indent=20, barH=BASE_CBLOCK_BAR_H, mouthX=other.x+indent, mouthY=other.y+barH;
             if (abs(drag->x-mouthX)<snapDist&&abs(drag->y-mouthY)<snapDist) {
                 float ddx=mouthX-drag->x,ddy=mouthY-drag->y; moveBlockChain(blocks,dragId,ddx,ddy);
-                if (other.childHeadId>=0) { int lastInDrag=dragId; while(true){Block* lb=findBlock(blocks,lastInDrag);if(!lb||lb->nextBlockId<0)break;lastInDrag=lb->nextBlockId;} Block* lastB=findBlock(blocks,lastInDrag); if(lastB){lastB->nextBlockId=other.childHeadId;Block* oldHead=findBlock(blocks,other.childHeadId);if(oldHead)oldHead->parentBlockId=lastInDrag;} }
-                other.childHeadId=dragId; drag->parentBlockId=other.id;
+                if (other.childHeadId>=0) { int lastInDrag=dragId; while(true){Block* lb=findBlock(blocks,lastInDrag);if(!lb||lb->nextBlockId<0)break;lastInDrag=lb->nextBlockId;} Block* lastB=findBlock(blocks,lastInDrag); if(lastB){lastB->nextBlockId=other.childHeadId;gDirtyBlocks.insert(lastInDrag);Block* oldHead=findBlock(blocks,other.childHeadId);if(oldHead){oldHead->parentBlockId=lastInDrag;gDirtyBlocks.insert(oldHead->id);}} }
+                other.childHeadId=dragId; drag->parentBlockId=other.id; gDirtyBlocks.insert(other.id);
                 updateCBlockChildren(blocks,other); return;
             }
         }
@@ -829,89 +1829,3795 @@ static void trySnapBlocks(vector<Block>& blocks, int dragId) {
 
     if (drag->shape==BlockShape::REPORTER||drag->shape==BlockShape::BOOLEAN) {
         for (auto& other:blocks) {
-            if (other.id==dragId||other.inPalette) continue;
+            if (own[&other-blocks.data()]) continue;
             for (auto& sl:other.opSlots) {
                 if (sl.embeddedBlockId>=0) continue;
                 float sx2=other.x+sl.relX,sy2=other.y+sl.relY;
-                if (abs(drag->x-sx2)<snapDist*0.7f&&abs(drag->y-sy2)<snapDist*0.7f) { drag->x=sx2;drag->y=sy2;sl.embeddedBlockId=dragId;drag->parentBlockId=other.id;return; }
+                if (abs(drag->x-sx2)<snapDist*0.7f&&abs(drag->y-sy2)<snapDist*0.7f) { drag->x=sx2;drag->y=sy2;sl.embeddedBlockId=dragId;drag->parentBlockId=other.id;gDirtyBlocks.insert(other.id);return; }
             }
         }
     }
 }
 
-static void resetProject(vector<Block>& blocks, vector<Sprite>& sprites) {
-    blocks.erase(remove_if(blocks.begin(),blocks.end(),[](const Block& b){return !b.inPalette;}),blocks.end());
-    sprites.clear();
-    sprites.push_back(createDefaultSprite("Sprite1",0,0,{255,140,0,255}));
-    gIsRunning=false; gTimer=0; gNextBlockId=1000; gNextSpriteNum=2;
-    gEdit={-1,-1,-1,false,"",0};
+// ════════════════════════════════════════════
+//  Execution engine: interpreter + block profiler
+// ════════════════════════════════════════════
+// Every executed step is charged to its block (self time) and to each
+// enclosing loop on the thread's loopStack (inclusive time), plus to the
+// sprite running it. The workspace tints blocks by self time and the F5
+// table lists the hottest blocks, so a slow `repeat` body stands out.
+static void resetBlockProfile() {
+    gBlockProfile.clear();
+    gSpriteProfile.clear();
+    gBlockProfMaxSelf = 0;
 }
-static void initParticles(int stageW, int stageH) {
-    if (gParticlesInitialized) return;
-    gParticles.clear();
-    for (int i = 0; i < 15; i++) {
-        Particle p;
-        p.x = (float)(rand() % stageW);
-        p.y = (float)(rand() % stageH);
-        p.vx = (float)((rand() % 3) - 1) * 0.5f;
-        p.vy = (float)((rand() % 3) - 1) * 0.5f;
-        p.radius = (float)(rand() % 8 + 3);
-        p.colorPhase = (float)(rand() % 360);
-        p.color = {255, 255, 255, (Uint8)(rand() % 100 + 50)};
-        gParticles.push_back(p);
-    }
-    gParticlesInitialized = true;
+
+static double ticksToMs(Uint64 t) {
+    return (double)t * 1000.0 / (double)SDL_GetPerformanceFrequency();
 }
 
-static void updateAndDrawParticles(SDL_Renderer* rnd, int stageX, int stageY, int stageW, int stageH, float dt) {
-    for (auto& p : gParticles) {
-        p.x += p.vx;
-        p.y += p.vy;
+static float getInputValue(const Block& block, int inputIdx) {
+    if (inputIdx < 0 || inputIdx >= (int)block.inputs.size()) return 0;
+    return (float)atof(block.inputs[inputIdx].value.c_str());
+}
+
+static string getInputString(const Block& block, int inputIdx) {
+    if (inputIdx < 0 || inputIdx >= (int)block.inputs.size()) return "";
+    return block.inputs[inputIdx].value;
+}
+
+// ════════════════════════════════════════════
+//  Tweens
+// ════════════════════════════════════════════
+// Animated sprite properties (glide). Active tweens live in flat arrays and
+// advance in one pass per tick: the value loop runs four tweens per SSE2
+// step; only writing the results back to sprites is scalar. A thread
+// that starts tweens parks on them and is woken when the last one finishes,
+// instead of counting down a timer of its own.
+enum class TweenProp : Uint8 { X, Y };
+
+struct TweenSystem {
+    vector<int> sprite, owner;               // owner = thread id, -1 = none
+    vector<Uint8> prop;
+    vector<float> from, to, elapsed, duration, value;
+    size_t size() const { return sprite.size(); }
+};
+static TweenSystem gTweens;
 
-        if (p.x <p.radius || p.x > stageW-p.radius) p.vx *= -1;
-        if (p.y < p.radius || p.y > stageH-p.radius) p.vy *= -1;
+static void clearTweens() {
+    TweenSystem& t = gTweens;
+    for (auto* v : {&t.sprite, &t.owner}) v->clear();
+    t.prop.clear();
+    for (auto* v : {&t.from, &t.to, &t.elapsed, &t.duration, &t.value}) v->clear();
+}
 
-        p.colorPhase += dt * 30;
-        if (p.colorPhase > 360) p.colorPhase -= 360;
+static float& tweenTarget(Sprite& sp, TweenProp p) {
+    return p == TweenProp::X ? sp.x : sp.y;
+}
 
-        p.color.r = (Uint8)(128 + 127 * sin(p.colorPhase * M_PI / 180));
-        p.color.g = (Uint8)(128 + 127 * sin((p.colorPhase + 120) * M_PI / 180));
-        p.color.b = (Uint8)(128 + 127 * sin((p.colorPhase + 240) * M_PI / 180));
+static void startTween(ScriptThread* owner, int spriteIdx, Sprite& sp, TweenProp p, float to, float duration) {
+    TweenSystem& t = gTweens;
+    t.sprite.push_back(spriteIdx); t.owner.push_back(owner ? owner->id : -1);
+    t.prop.push_back((Uint8)p);
+    t.from.push_back(tweenTarget(sp, p)); t.to.push_back(to);
+    t.elapsed.push_back(0); t.duration.push_back(max(duration, 1e-6f)); t.value.push_back(tweenTarget(sp, p));
+    if (owner) owner->tweenWait++;
+}
 
-        fillEllipse(rnd, stageX + (int)p.x, stageY + (int)p.y,
-                    (int)p.radius, (int)p.radius,
-                    p.color.r, p.color.g, p.color.b, p.color.a);
+static void stepTweens(int n, const float* __restrict from, const float* __restrict to, float* __restrict elapsed,
+                       const float* __restrict duration, float* __restrict value, float dt) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 vdt = _mm_set1_ps(dt);
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_loadu_ps(duration + i), f = _mm_loadu_ps(from + i);
+        __m128 e = _mm_min_ps(_mm_add_ps(_mm_loadu_ps(elapsed + i), vdt), d);
+        __m128 u = _mm_div_ps(e, d);
+        _mm_storeu_ps(elapsed + i, e);
+        _mm_storeu_ps(value + i, _mm_add_ps(f, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(to + i), f), u)));
     }
-}
-// ════════════════════════════════════════════
-//  MAIN
-// ════════════════════════════════════════════
-int main(int argc, char* argv[]) {
-    if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG)) {
-        cout << "SDL_image Error: " << IMG_GetError() << endl;
+#endif
+    for (; i < n; i++) {
+        float e = min(elapsed[i] + dt, duration[i]), u = e / duration[i];
+        elapsed[i] = e;
+        value[i] = from[i] + (to[i] - from[i]) * u;
     }
+}
 
-    SDL_Init(SDL_INIT_VIDEO);
-    IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG);
-    SDL_Window* window=SDL_CreateWindow("Scratch IDE - SDL2 (Enhanced)",SDL_WINDOWPOS_CENTERED,SDL_WINDOWPOS_CENTERED,BASE_WIDTH,BASE_HEIGHT,SDL_WINDOW_SHOWN|SDL_WINDOW_RESIZABLE);
-    SDL_Renderer* rnd=SDL_CreateRenderer(window,-1,SDL_RENDERER_ACCELERATED|SDL_RENDERER_PRESENTVSYNC);
-    SDL_SetRenderDrawBlendMode(rnd, SDL_BLENDMODE_BLEND);
-    int winW=BASE_WIDTH, winH=BASE_HEIGHT;
-    L.update(winW,winH);
-    SDL_StartTextInput();
-    SDL_SetRenderDrawBlendMode(rnd, SDL_BLENDMODE_BLEND);
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
+static void moveTween(TweenSystem& t, int w, int i) {
+    if (w == i) return;
+    t.sprite[w] = t.sprite[i]; t.owner[w] = t.owner[i]; t.prop[w] = t.prop[i];
+    t.from[w] = t.from[i]; t.to[w] = t.to[i]; t.elapsed[w] = t.elapsed[i]; t.duration[w] = t.duration[i];
+}
 
-    vector<Sprite> sprites;
-    sprites.push_back(createDefaultSprite("Sprite1",0,0,{255,140,0,255}));
-    vector<Block> blocks=buildPaletteBlocks();
+static void resizeTweens(TweenSystem& t, int n) {
+    for (auto* v : {&t.sprite, &t.owner}) v->resize(n);
+    t.prop.resize(n);
+    for (auto* v : {&t.from, &t.to, &t.elapsed, &t.duration, &t.value}) v->resize(n);
+}
 
-    Category selectedCategory=Category::MOTION;
-    int dragBlockId=-1;
-    float dragOffX=0, dragOffY=0;
-    int paletteScrollY=0;
-    bool draggingSprite=false;
-    int dragSpriteIdx=-1;
+static void wakeThread(int id) {
+    auto it = lower_bound(gActiveThreads.begin(), gActiveThreads.end(), id,
+                          [](const ScriptThread& th, int v) { return th.id < v; });
+    if (it != gActiveThreads.end() && it->id == id && it->tweenWait > 0) it->tweenWait--;
+}
+
+// Advances every tween by dt, writes the values to their sprites and drops
+// (and reports) the finished ones.
+static void updateTweens(vector<Sprite>& sprites, float dt) {
+    TweenSystem& t = gTweens;
+    int n = (int)t.size();
+    if (n == 0) return;
+    stepTweens(n, t.from.data(), t.to.data(), t.elapsed.data(), t.duration.data(), t.value.data(), dt);
+    int w = 0;
+    for (int i = 0; i < n; i++) {
+        if (t.sprite[i] < (int)sprites.size()) tweenTarget(sprites[t.sprite[i]], (TweenProp)t.prop[i]) = t.value[i];
+        if (t.elapsed[i] >= t.duration[i]) { if (t.owner[i] >= 0) wakeThread(t.owner[i]); continue; }
+        moveTween(t, w++, i);
+    }
+    resizeTweens(t, w);
+}
+
+// The sprite list changed under running glides: to[i] is the new index of
+// sprite i, or -1 if it is gone (an empty map drops every glide). Dropped
+// glides wake their threads as if they had finished.
+static void remapTweenSprites(const vector<int>& to) {
+    TweenSystem& t = gTweens;
+    int w = 0;
+    for (int i = 0; i < (int)t.size(); i++) {
+        int s = t.sprite[i] >= 0 && t.sprite[i] < (int)to.size() ? to[t.sprite[i]] : -1;
+        if (s < 0) { if (t.owner[i] >= 0) wakeThread(t.owner[i]); continue; }
+        moveTween(t, w, i);
+        t.sprite[w++] = s;
+    }
+    resizeTweens(t, w);
+}
+
+// شروع اجرا با کلیک روی پرچم سبز
+static void startGreenFlag(vector<Block>& blocks, vector<Sprite>& sprites) {
+    gActiveThreads.clear();
+    clearTweens();
+    resetBlockProfile();
+    gIsRunning = true;
+    gTimer = 0;
+    for (auto& block : blocks) {
+        if (*block.text != "when flag clicked" || block.nextBlockId < 0) continue;
+        for (int i = 0; i < (int)sprites.size(); i++)
+            gActiveThreads.push_back(ScriptThread(block.nextBlockId, i));
+    }
+}
+
+static void stopAllScripts() {
+    gActiveThreads.clear();
+    clearTweens();
+    gIsRunning = false;
+    gHighlightBlockId = -1;
+}
+
+// One block of one thread.
+static void executeStep(ScriptThread& thread, vector<Block>& blocks, vector<Sprite>& sprites, float dt) {
+    if (thread.currentBlockId == -1 || thread.tweenWait > 0) return;
+
+    if (thread.isWaiting) {
+        thread.waitTimer -= dt;
+        if (thread.waitTimer > 0) return;
+        thread.isWaiting = false;
+        Block* b = findBlock(blocks, thread.currentBlockId);
+        thread.currentBlockId = b ? b->nextBlockId : -1;
+        if (thread.currentBlockId == -1 && !thread.loopStack.empty())
+            thread.currentBlockId = thread.loopStack.back().first;
+        return;
+    }
+
+    Block* block = findBlock(blocks, thread.currentBlockId);
+    if (!block || thread.spriteIdx < 0 || thread.spriteIdx >= (int)sprites.size()) {
+        thread.currentBlockId = -1;
+        return;
+    }
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    int blockId = block->id;
+    gHighlightBlockId = blockId;
+
+    Sprite& sp = sprites[thread.spriteIdx];
+    const string& txt = *block->text;
+    int next = block->nextBlockId;
+
+    // ── Motion ──
+    if (txt == "move  steps") {
+        float steps = getInputValue(*block, 0), rad = sp.direction * (float)M_PI / 180.0f;
+        sp.x += sinf(rad) * steps;
+        sp.y += cosf(rad) * steps;
+    }
+    else if (txt == "turn R  deg") sp.direction += getInputValue(*block, 0);
+    else if (txt == "turn L  deg") sp.direction -= getInputValue(*block, 0);
+    else if (txt == "go to x:  y: ") { sp.x = getInputValue(*block, 0); sp.y = getInputValue(*block, 1); }
+    else if (txt == "glide  s x:  y: ") {
+        float secs = getInputValue(*block, 0), tx = getInputValue(*block, 1), ty = getInputValue(*block, 2);
+        if (secs > 0) {
+            // تا پایان حرکت پارک می‌شود؛ بعد مثل wait به بلوک بعدی می‌رود
+            startTween(&thread, thread.spriteIdx, sp, TweenProp::X, tx, secs);
+            startTween(&thread, thread.spriteIdx, sp, TweenProp::Y, ty, secs);
+            thread.isWaiting = true;
+            thread.waitTimer = 0;
+            next = blockId;
+        } else { sp.x = tx; sp.y = ty; }
+    }
+    else if (txt == "set x to ") sp.x = getInputValue(*block, 0);
+    else if (txt == "set y to ") sp.y = getInputValue(*block, 0);
+    else if (txt == "change x by ") sp.x += getInputValue(*block, 0);
+    else if (txt == "change y by ") sp.y += getInputValue(*block, 0);
+    else if (txt == "point dir ") sp.direction = getInputValue(*block, 0);
+
+    // ── Looks ──
+    else if (txt == "say  for  s" || txt == "think  for  s") {
+        bool say = txt[0] == 's';
+        (say ? sp.sayText : sp.thinkText) = getInputString(*block, 0);
+        (say ? sp.sayTimer : sp.thinkTimer) = getInputValue(*block, 1);
+        thread.isWaiting = true;
+        thread.waitTimer = getInputValue(*block, 1);
+        next = blockId;
+    }
+    else if (txt == "say ") { sp.sayText = getInputString(*block, 0); sp.sayTimer = -1; }
+    else if (txt == "show") sp.visible = true;
+    else if (txt == "hide") sp.visible = false;
+    else if (txt == "set size to %") sp.size = getInputValue(*block, 0);
+    else if (txt == "change size by ") sp.size += getInputValue(*block, 0);
+    else if (txt == "next costume") { if (!sp.costumes.empty()) sp.currentCostume = (sp.currentCostume + 1) % (int)sp.costumes.size(); }
+
+    // ── Control ──
+    else if (txt == "wait  secs") {
+        thread.isWaiting = true;
+        thread.waitTimer = getInputValue(*block, 0);
+        next = blockId;
+    }
+    else if (txt == "forever") {
+        if (block->childHeadId >= 0) {
+            if (thread.loopStack.empty() || thread.loopStack.back().first != blockId)
+                thread.loopStack.push_back({blockId, -1});
+            next = block->childHeadId;
+        } else {
+            thread.isWaiting = true;        // forever خالی: یک فریم صبر
+            thread.waitTimer = 0.016f;
+            next = blockId;
+        }
+    }
+    else if (txt == "repeat ") {
+        int count = (int)getInputValue(*block, 0);
+        if (!thread.loopStack.empty() && thread.loopStack.back().first == blockId) {
+            if (++thread.loopStack.back().second >= count) { thread.loopStack.pop_back(); }
+            else next = block->childHeadId;
+        } else if (count > 0 && block->childHeadId >= 0) {
+            thread.loopStack.push_back({blockId, 0});
+            next = block->childHeadId;
+        }
+    }
+    else if (txt == "reset timer") gTimer = 0;
+
+    // ── Variables ──
+    else if (txt == "set var to ") gMyVariable = getInputValue(*block, 0);
+    else if (txt == "change var by ") gMyVariable += getInputValue(*block, 0);
+
+    // ── Pen ──
+    else if (txt == "clear") clearPen();
+    else if (txt == "stamp") penStamp(thread.spriteIdx, sp);
+    else if (txt == "pen down") { sp.penDown = true; sp.penX = sp.x; sp.penY = sp.y; penSegment(sp, sp.x, sp.y); }
+    else if (txt == "pen up") sp.penDown = false;
+    else if (txt == "set pen color to ") sp.penHue = getInputValue(*block, 0);
+    else if (txt == "change pen color by ") sp.penHue += getInputValue(*block, 0);
+    else if (txt == "set pen size to ") sp.penSize = max(1.0f, getInputValue(*block, 0));
+    else if (txt == "change pen size by ") sp.penSize = max(1.0f, sp.penSize + getInputValue(*block, 0));
+    else if (txt == "stop all") {
+        stopAllScripts();
+        return;
+    }
+
+    if (!thread.isWaiting) {
+        thread.currentBlockId = next;
+        // آخر زنجیره داخل حلقه: برگرد به بلوک حلقه
+        if (thread.currentBlockId == -1 && !thread.loopStack.empty())
+            thread.currentBlockId = thread.loopStack.back().first;
+    }
+
+    Uint64 dtTicks = SDL_GetPerformanceCounter() - t0;
+    BlockProfile& bp = gBlockProfile[blockId];
+    bp.runs++;
+    bp.selfTicks += dtTicks;
+    bp.inclTicks += dtTicks;
+    gBlockProfMaxSelf = max(gBlockProfMaxSelf, bp.selfTicks);
+    for (auto& lp : thread.loopStack) if (lp.first != blockId) gBlockProfile[lp.first].inclTicks += dtTicks;
+    if ((int)gSpriteProfile.size() <= thread.spriteIdx) gSpriteProfile.resize(thread.spriteIdx + 1);
+    gSpriteProfile[thread.spriteIdx].runs++;
+    gSpriteProfile[thread.spriteIdx].ticks += dtTicks;
+}
+
+static void executeAllThreads(vector<Block>& blocks, vector<Sprite>& sprites, float dt) {
+    if (!gIsRunning) return;
+    for (size_t i = 0; i < gActiveThreads.size() && gIsRunning; i++)
+        executeStep(gActiveThreads[i], blocks, sprites, dt);
+    if (gIsRunning) updateTweens(sprites, dt);
+    gActiveThreads.erase(remove_if(gActiveThreads.begin(), gActiveThreads.end(),
+                                   [](const ScriptThread& t){ return t.currentBlockId == -1; }),
+                         gActiveThreads.end());
+    if (gActiveThreads.empty()) { gIsRunning = false; gHighlightBlockId = -1; }
+}
+
+// Timed say/think bubbles disappear when their timer runs out.
+static void updateSpriteTimers(vector<Sprite>& sprites, float dt) {
+    for (auto& sp:sprites) {
+        if(sp.sayTimer>0){sp.sayTimer-=dt;if(sp.sayTimer<=0){sp.sayTimer=0;sp.sayText.clear();}}
+        if(sp.thinkTimer>0){sp.thinkTimer-=dt;if(sp.thinkTimer<=0){sp.thinkTimer=0;sp.thinkText.clear();}}
+    }
+}
+
+// ── Profiler table (F5) ──
+static const int PROF_TABLE_ROWS = 12;
+
+static SDL_Rect blockProfTableRect(int winW, int winH) {
+    int w = (int)(420 * L.s), h = textHeight("A") * (PROF_TABLE_ROWS + 8) + (int)(90 * L.s);
+    return {winW - w - 10, winH - h - 10, w, h};
+}
+
+// Column x offsets inside the table: label, runs, self ms, incl ms.
+static void blockProfColumns(const SDL_Rect& r, int cols[4]) {
+    cols[0] = r.x + (int)(8 * L.s);
+    cols[1] = r.x + (int)(r.w * 0.50f);
+    cols[2] = r.x + (int)(r.w * 0.66f);
+    cols[3] = r.x + (int)(r.w * 0.83f);
+}
+
+// Returns true if the click landed on the table (header clicks re-sort).
+static bool blockProfTableClick(int mx, int my, int winW, int winH) {
+    if (!gBlockProfView) return false;
+    SDL_Rect r = blockProfTableRect(winW, winH);
+    if (mx < r.x || mx > r.x + r.w || my < r.y || my > r.y + r.h) return false;
+    int headerY = r.y + (int)(6 * L.s), lineH = textHeight("A") + (int)(4 * L.s);
+    if (my >= headerY && my < headerY + lineH) {
+        int cols[4];
+        blockProfColumns(r, cols);
+        if (mx >= cols[3]) gBlockProfSort = ProfSort::INCLUSIVE;
+        else if (mx >= cols[2]) gBlockProfSort = ProfSort::SELF;
+        else if (mx >= cols[1]) gBlockProfSort = ProfSort::RUNS;
+    }
+    return true;
+}
+
+static void drawBlockProfTable(SDL_Renderer* rnd, vector<Block>& blocks, const vector<Sprite>& sprites, int winW, int winH) {
+    if (!gBlockProfView) return;
+    SDL_Rect r = blockProfTableRect(winW, winH);
+    fillRoundedRect(rnd, r.x, r.y, r.w, r.h, 6, 30, 30, 42, 235);
+    int cols[4];
+    blockProfColumns(r, cols);
+    int lineH = textHeight("A") + (int)(4 * L.s), y = r.y + (int)(6 * L.s);
+
+    const char* heads[4] = {"Block", "Runs", "Self ms", "Incl ms"};
+    int sortCol = gBlockProfSort == ProfSort::RUNS ? 1 : gBlockProfSort == ProfSort::SELF ? 2 : 3;
+    for (int c = 0; c < 4; c++)
+        drawText(rnd, cols[c], y, heads[c], c == sortCol ? 255 : 170, c == sortCol ? 210 : 170, c == sortCol ? 60 : 190, 255);
+    y += lineH;
+
+    vector<pair<int, const BlockProfile*>> rows;
+    rows.reserve(gBlockProfile.size());
+    for (auto& kv : gBlockProfile) rows.push_back({kv.first, &kv.second});
+    auto key = [](const BlockProfile* p) {
+        return gBlockProfSort == ProfSort::RUNS ? p->runs : gBlockProfSort == ProfSort::SELF ? p->selfTicks : p->inclTicks;
+    };
+    size_t shown = min(rows.size(), (size_t)PROF_TABLE_ROWS);
+    partial_sort(rows.begin(), rows.begin() + shown, rows.end(),
+                 [&](const pair<int, const BlockProfile*>& a, const pair<int, const BlockProfile*>& b){ return key(a.second) > key(b.second); });
+    char buf[64];
+    for (size_t i = 0; i < shown; i++) {
+        const Block* b = findBlock(blocks, rows[i].first);
+        string label = b ? *b->text : "(deleted)";
+        if (b && !b->inputs.empty()) label += "[" + b->inputs[0].value + "]";
+        while (label.size() > 1 && cols[0] + textWidth(label.c_str()) > cols[1] - 4) label.pop_back();
+        drawText(rnd, cols[0], y, label.c_str(), 230, 230, 230, 255);
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long)rows[i].second->runs);
+        drawText(rnd, cols[1], y, buf, 230, 230, 230, 255);
+        snprintf(buf, sizeof(buf), "%.2f", ticksToMs(rows[i].second->selfTicks));
+        drawText(rnd, cols[2], y, buf, 230, 230, 230, 255);
+        snprintf(buf, sizeof(buf), "%.2f", ticksToMs(rows[i].second->inclTicks));
+        drawText(rnd, cols[3], y, buf, 230, 230, 230, 255);
+        y += lineH;
+    }
+
+    y = max(y, r.y + (int)(6 * L.s) + lineH * (PROF_TABLE_ROWS + 1)) + lineH / 2;
+    drawText(rnd, cols[0], y, "Sprite", 170, 170, 190, 255);
+    drawText(rnd, cols[1], y, "Runs", 170, 170, 190, 255);
+    drawText(rnd, cols[2], y, "ms", 170, 170, 190, 255);
+    drawText(rnd, cols[3], y, "share", 170, 170, 190, 255);
+    y += lineH;
+    Uint64 total = 0;
+    for (auto& p : gSpriteProfile) total += p.ticks;
+    for (size_t i = 0; i < gSpriteProfile.size() && y + lineH < r.y + r.h; i++) {
+        if (!gSpriteProfile[i].runs) continue;
+        drawText(rnd, cols[0], y, i < sprites.size() ? sprites[i].name.c_str() : "?", 230, 230, 230, 255);
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long)gSpriteProfile[i].runs);
+        drawText(rnd, cols[1], y, buf, 230, 230, 230, 255);
+        snprintf(buf, sizeof(buf), "%.2f", ticksToMs(gSpriteProfile[i].ticks));
+        drawText(rnd, cols[2], y, buf, 230, 230, 230, 255);
+        snprintf(buf, sizeof(buf), "%.0f%%", total ? 100.0 * gSpriteProfile[i].ticks / total : 0.0);
+        drawText(rnd, cols[3], y, buf, 230, 230, 230, 255);
+        y += lineH;
+    }
+}
+
+static void resetProject(vector<Block>& blocks, vector<Sprite>& sprites) {
+    blocks.clear();
+    sprites.clear();
+    sprites.push_back(createDefaultSprite("Sprite1",0,0,{255,140,0,255}));
+    gIsRunning=false; gTimer=0; gMyVariable=0; gNextBlockId=1000; gNextSpriteNum=2;
+    gEdit={-1,-1,-1,false,"",0};
+    gAutosaveSnapshotWanted=true;
+    stopAllScripts();
+    clearPen();
+    cancelStackDrag();
+    clearSelection();
+    L.camX=L.camY=0;
+    resetBlockProfile();
+}
+// ════════════════════════════════════════════
+//  Stage particles
+// ════════════════════════════════════════════
+// The update is straight float math over contiguous arrays, four particles
+// per SSE2 step: motion is scaled by dt, bounces are mask selects and
+// the colour cycle indexes a 256-entry sine table instead of calling sin()
+// three times per particle. Every particle is a quad over one pre-rendered
+// soft circle, and the whole set goes out in a single SDL_RenderGeometry.
+static const float PARTICLE_SPEED = 30;     // px/s
+static const float PARTICLE_CYCLE = 30;     // colour degrees/s
+static const int PARTICLE_TEX_SIZE = 64;
+
+static Uint8 gSineLut[256];     // 128 + 127·sin(2πi/256)
+static SDL_Texture* gParticleTex = nullptr;
+
+static void initParticles(int stageW, int stageH, int count = 15) {
+    if (gParticlesInitialized) return;
+    for (int i = 0; i < 256; i++) gSineLut[i] = (Uint8)(128 + 127 * sin(i * 2 * M_PI / 256));
+    ParticleSystem& P = gParticles;
+    P = ParticleSystem();
+    for (int i = 0; i < count; i++) {
+        P.x.push_back((float)(rand() % stageW));
+        P.y.push_back((float)(rand() % stageH));
+        P.vx.push_back((float)((rand() % 3) - 1) * PARTICLE_SPEED);
+        P.vy.push_back((float)((rand() % 3) - 1) * PARTICLE_SPEED);
+        P.radius.push_back((float)(rand() % 8 + 3));
+        P.phase.push_back((float)(rand() % 256));
+        P.alpha.push_back((Uint8)(rand() % 100 + 50));
+    }
+    gParticlesInitialized = true;
+}
+
+#if defined(__SSE2__)
+static inline __m128 selectPs(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+#endif
+
+static void stepParticles(size_t n, float* __restrict x, float* __restrict y, float* __restrict vx,
+                          float* __restrict vy, float* __restrict ph, const float* __restrict r,
+                          float w, float h, float dt, float dph)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 vdt = _mm_set1_ps(dt), vw = _mm_set1_ps(w), vh = _mm_set1_ps(h);
+    const __m128 vdph = _mm_set1_ps(dph), v256 = _mm_set1_ps(256), sign = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= n; i += 4) {
+        __m128 vxi = _mm_loadu_ps(vx + i), vyi = _mm_loadu_ps(vy + i), ri = _mm_loadu_ps(r + i);
+        __m128 xi = _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(vxi, vdt));
+        __m128 yi = _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(vyi, vdt));
+        __m128 ax = _mm_andnot_ps(sign, vxi), ay = _mm_andnot_ps(sign, vyi);
+        __m128 bx = selectPs(_mm_cmpgt_ps(xi, _mm_sub_ps(vw, ri)), _mm_or_ps(ax, sign), vxi);
+        __m128 by = selectPs(_mm_cmpgt_ps(yi, _mm_sub_ps(vh, ri)), _mm_or_ps(ay, sign), vyi);
+        _mm_storeu_ps(vx + i, selectPs(_mm_cmplt_ps(xi, ri), ax, bx));
+        _mm_storeu_ps(vy + i, selectPs(_mm_cmplt_ps(yi, ri), ay, by));
+        _mm_storeu_ps(x + i, xi); _mm_storeu_ps(y + i, yi);
+        __m128 p = _mm_add_ps(_mm_loadu_ps(ph + i), vdph);
+        _mm_storeu_ps(ph + i, _mm_sub_ps(p, _mm_and_ps(_mm_cmpge_ps(p, v256), v256)));
+    }
+#endif
+    for (; i < n; i++) {
+        float xi = x[i] + vx[i] * dt, yi = y[i] + vy[i] * dt;
+        float ax = fabsf(vx[i]), ay = fabsf(vy[i]);
+        float bx = xi > w - r[i] ? -ax : vx[i], by = yi > h - r[i] ? -ay : vy[i];
+        vx[i] = xi < r[i] ? ax : bx;
+        vy[i] = yi < r[i] ? ay : by;
+        x[i] = xi; y[i] = yi;
+        float p = ph[i] + dph;
+        ph[i] = p >= 256 ? p - 256 : p;
+    }
+}
+
+static void updateParticles(int stageW, int stageH, float dt) {
+    ParticleSystem& P = gParticles;
+    float dph = min(dt, 1.0f) * PARTICLE_CYCLE * 256 / 360;
+    stepParticles(P.size(), P.x.data(), P.y.data(), P.vx.data(), P.vy.data(), P.phase.data(),
+                  P.radius.data(), (float)stageW, (float)stageH, dt, dph);
+}
+
+// White disc with a soft alpha edge; vertex colours tint it.
+static SDL_Texture* particleTexture(SDL_Renderer* rnd) {
+    if (gParticleTex) return gParticleTex;
+    const int T = PARTICLE_TEX_SIZE;
+    vector<Uint32> px(T * T);
+    float c = (T - 1) * 0.5f;
+    for (int yy = 0; yy < T; yy++)
+        for (int xx = 0; xx < T; xx++) {
+            float d = hypotf(xx - c, yy - c) / c;
+            float a = max(0.0f, min(1.0f, (1 - d) * 4));
+            px[yy * T + xx] = 0xFFFFFF00u | (Uint32)(a * 255);
+        }
+    gParticleTex = SDL_CreateTexture(rnd, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, T, T);
+    if (!gParticleTex) return nullptr;
+    SDL_UpdateTexture(gParticleTex, nullptr, px.data(), T * 4);
+    SDL_SetTextureBlendMode(gParticleTex, SDL_BLENDMODE_BLEND);
+    return gParticleTex;
+}
+
+static void drawParticles(SDL_Renderer* rnd, int stageX, int stageY) {
+    static vector<SDL_Vertex> verts;
+    static vector<int> idx;
+    const ParticleSystem& P = gParticles;
+    size_t n = P.size();
+    SDL_Texture* tex = particleTexture(rnd);
+    if (!n || !tex) return;
+    verts.resize(n * 4);
+    for (size_t i = idx.size() / 6; i < n; i++) {
+        int b = (int)i * 4;
+        int quad[6] = {b, b+1, b+2, b, b+2, b+3};
+        idx.insert(idx.end(), quad, quad + 6);
+    }
+    for (size_t i = 0; i < n; i++) {
+        int k = (int)P.phase[i] & 255;
+        SDL_Color col = {gSineLut[k], gSineLut[(k + 85) & 255], gSineLut[(k + 171) & 255], P.alpha[i]};
+        float x0 = stageX + P.x[i] - P.radius[i], x1 = x0 + 2 * P.radius[i];
+        float y0 = stageY + P.y[i] - P.radius[i], y1 = y0 + 2 * P.radius[i];
+        SDL_Vertex* v = &verts[i * 4];
+        v[0] = {{x0, y0}, col, {0, 0}};
+        v[1] = {{x1, y0}, col, {1, 0}};
+        v[2] = {{x1, y1}, col, {1, 1}};
+        v[3] = {{x0, y1}, col, {0, 1}};
+    }
+    renderGeometry(rnd, tex, verts.data(), (int)n * 4, idx.data(), (int)n * 6);
+}
+
+static void updateAndDrawParticles(SDL_Renderer* rnd, int stageX, int stageY, int stageW, int stageH, float dt) {
+    updateParticles(stageW, stageH, dt);
+    drawParticles(rnd, stageX, stageY);
+}
+
+// ════════════════════════════════════════════
+//  Stage render target
+// ════════════════════════════════════════════
+// The stage (backdrop, particles, sprites, bubbles) is always drawn at its
+// 480x360 logical size into one target texture, which the GPU then scales
+// into the editor's stage slot or, in presentation mode (F11), the largest
+// 4:3 rectangle that fits the window. Stage cost is the same at any window
+// size, and nothing on it is re-rasterized on resize.
+static SDL_Texture* gStageTex = nullptr;
+static bool gPresentMode = false;
+
+static SDL_Rect stageViewRect(int winW, int winH) {
+    if (!gPresentMode) return {L.PALETTE_WIDTH, L.TOOLBAR_HEIGHT, L.STAGE_WIDTH, L.STAGE_HEIGHT};
+    int w = min(winW, winH * STAGE_LOGICAL_W / STAGE_LOGICAL_H), h = w * STAGE_LOGICAL_H / STAGE_LOGICAL_W;
+    return {(winW - w) / 2, (winH - h) / 2, w, h};
+}
+
+// Window pixel -> stage coordinates (centre origin, y up).
+static SDL_FPoint windowToStage(const SDL_Rect& view, int mx, int my) {
+    return {(mx - view.x) * (float)STAGE_LOGICAL_W / view.w - STAGE_LOGICAL_W / 2,
+            STAGE_LOGICAL_H / 2 - (my - view.y) * (float)STAGE_LOGICAL_H / view.h};
+}
+
+// Topmost visible sprite under a stage point, or -1.
+static int stageSpriteAt(const vector<Sprite>& sprites, SDL_FPoint p) {
+    for (int si = (int)sprites.size() - 1; si >= 0; si--) {
+        const Sprite& sp = sprites[si];
+        float sz = SPRITE_SIZE * sp.size / 100.0f;
+        if (sp.visible && fabsf(p.x - sp.x) < sz && fabsf(p.y - sp.y) < sz) return si;
+    }
+    return -1;
+}
+
+// Draws into whatever target is bound, in logical stage pixels.
+static void drawStage(SDL_Renderer* rnd, vector<Sprite>& sprites, float dt, int selectedSpriteIdx, bool axes) {
+    const int W = STAGE_LOGICAL_W, H = STAGE_LOGICAL_H;
+    SDL_Color bg = BG_COLORS[gBgColor];
+    SDL_SetRenderDrawColor(rnd, bg.r, bg.g, bg.b, 255);
+    SDL_Rect all = {0, 0, W, H};
+    renderFillRect(rnd, &all);
+    initParticles(W, H);
+    { PROF_SCOPE(PP_PARTICLES); updateAndDrawParticles(rnd, 0, 0, W, H, dt); }
+    if (axes) {
+        SDL_SetRenderDrawColor(rnd, 235, 235, 235, 255);
+        renderDrawLine(rnd, W / 2, 0, W / 2, H);
+        renderDrawLine(rnd, 0, H / 2, W, H / 2);
+    }
+    {
+        PROF_SCOPE(PP_PEN);
+        if (SDL_Texture* pen = flushPen(rnd, sprites)) renderCopy(rnd, pen, nullptr, &all);
+    }
+    drawStageSprites(rnd, sprites, W / 2, H / 2, selectedSpriteIdx);
+}
+
+static void presentStage(SDL_Renderer* rnd, const SDL_Rect& view, vector<Sprite>& sprites, float dt,
+                         int selectedSpriteIdx, bool axes)
+{
+    if (!gStageTex) {
+        gStageTex = SDL_CreateTexture(rnd, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, STAGE_LOGICAL_W, STAGE_LOGICAL_H);
+        static bool warned = false;
+        if (!gStageTex) { if (!warned) cout << "Stage target failed: " << SDL_GetError() << endl; warned = true; return; }
+        SDL_SetTextureBlendMode(gStageTex, SDL_BLENDMODE_NONE);
+    }
+    SDL_Texture* prev = SDL_GetRenderTarget(rnd);
+    SDL_SetRenderTarget(rnd, gStageTex);
+    drawStage(rnd, sprites, dt, selectedSpriteIdx, axes);
+    SDL_SetRenderTarget(rnd, prev);
+    renderCopy(rnd, gStageTex, nullptr, &view);
+}
+
+// ════════════════════════════════════════════
+//  Costume editor: batched strokes + tiled undo
+// ════════════════════════════════════════════
+// Mouse motion only queues points; the queue is flushed once per frame as a
+// single thick, round-capped polyline via SDL_RenderGeometry. Before a tile
+// (CANVAS_TILE x CANVAS_TILE) is painted for the first time in an edit its
+// pixels are saved, so undo memory grows with the edited area only.
+//
+// Fill and shape tools work on gCanvasPixels, a CPU copy of the canvas in
+// RGBA8888. GPU strokes only mark a stale rectangle that is read back before
+// the next CPU edit; CPU edits upload just their dirty rectangle.
+static const int CANVAS_TILE     = 64;
+static const int MAX_CANVAS_UNDO = 100;
+
+enum class PaintTool { PEN, FILL, RECT, ELLIPSE, LINE };
+static PaintTool gPaintTool = PaintTool::PEN;
+static bool gShapeDragging = false;
+static int gShapeX0 = 0, gShapeY0 = 0, gShapeX1 = 0, gShapeY1 = 0;
+
+struct CanvasTile {
+    int tx, ty;
+    vector<Uint32> pixels;   // contents to restore (swapped on undo/redo)
+};
+struct CanvasEdit {
+    vector<CanvasTile> tiles;
+};
+
+static vector<SDL_Point> gStrokePoints;    // canvas coords queued since last flush
+static bool gStrokeHasCarry = false;       // gStrokePoints[0] was already drawn
+static CanvasEdit gCanvasEdit;             // snapshots of the edit in progress
+static vector<bool> gCanvasEditTouched;
+static deque<CanvasEdit> gCanvasUndo;
+static vector<CanvasEdit> gCanvasRedo;
+
+static vector<Uint32> gCanvasPixels;       // CPU mirror of costumeCanvas
+static SDL_Rect gCanvasStale = {0,0,0,0};  // mirror area behind the GPU copy
+static SDL_Rect gCanvasDirty = {0,0,0,0};  // mirror area not yet uploaded
+
+static int canvasTilesX() { return (canvasW + CANVAS_TILE - 1) / CANVAS_TILE; }
+static int canvasTilesY() { return (canvasH + CANVAS_TILE - 1) / CANVAS_TILE; }
+
+static SDL_Rect canvasTileRect(int tx, int ty) {
+    SDL_Rect r = {tx * CANVAS_TILE, ty * CANVAS_TILE, CANVAS_TILE, CANVAS_TILE};
+    r.w = min(r.w, canvasW - r.x);
+    r.h = min(r.h, canvasH - r.y);
+    return r;
+}
+
+static void growRect(SDL_Rect& r, int x0, int y0, int x1, int y1) {
+    x0 = max(x0, 0); y0 = max(y0, 0); x1 = min(x1, canvasW - 1); y1 = min(y1, canvasH - 1);
+    if (x1 < x0 || y1 < y0) return;
+    if (r.w <= 0 || r.h <= 0) { r = {x0, y0, x1 - x0 + 1, y1 - y0 + 1}; return; }
+    int rx1 = max(r.x + r.w - 1, x1), ry1 = max(r.y + r.h - 1, y1);
+    r.x = min(r.x, x0); r.y = min(r.y, y0);
+    r.w = rx1 - r.x + 1; r.h = ry1 - r.y + 1;
+}
+
+// Render target must already be costumeCanvas.
+static void readCanvasTile(SDL_Renderer* rnd, int tx, int ty, vector<Uint32>& out) {
+    SDL_Rect r = canvasTileRect(tx, ty);
+    out.resize((size_t)r.w * r.h);
+    SDL_RenderReadPixels(rnd, &r, SDL_PIXELFORMAT_RGBA8888, out.data(), r.w * 4);
+}
+
+static void writeCanvasTile(int tx, int ty, const vector<Uint32>& px) {
+    SDL_Rect r = canvasTileRect(tx, ty);
+    SDL_UpdateTexture(costumeCanvas, &r, px.data(), r.w * 4);
+    if (gCanvasPixels.empty()) return;
+    for (int row = 0; row < r.h; row++)
+        memcpy(&gCanvasPixels[(size_t)(r.y + row) * canvasW + r.x], &px[(size_t)row * r.w], r.w * 4);
+}
+
+static void resetCanvasMirror(Uint32 fill) {
+    gCanvasPixels.assign((size_t)canvasW * canvasH, fill);
+    gCanvasStale = {0,0,0,0};
+    gCanvasDirty = {0,0,0,0};
+}
+
+static void syncCanvasMirror(SDL_Renderer* rnd) {
+    if (gCanvasStale.w <= 0 || gCanvasStale.h <= 0) return;
+    SDL_SetRenderTarget(rnd, costumeCanvas);
+    SDL_RenderReadPixels(rnd, &gCanvasStale, SDL_PIXELFORMAT_RGBA8888,
+                         &gCanvasPixels[(size_t)gCanvasStale.y * canvasW + gCanvasStale.x], canvasW * 4);
+    SDL_SetRenderTarget(rnd, nullptr);
+    gCanvasStale = {0,0,0,0};
+}
+
+static void uploadCanvasDirty() {
+    if (gCanvasDirty.w <= 0 || gCanvasDirty.h <= 0) return;
+    SDL_UpdateTexture(costumeCanvas, &gCanvasDirty,
+                      &gCanvasPixels[(size_t)gCanvasDirty.y * canvasW + gCanvasDirty.x], canvasW * 4);
+    gCanvasDirty = {0,0,0,0};
+}
+
+static void clearCanvasHistory() {
+    gStrokePoints.clear(); gStrokeHasCarry = false;
+    gCanvasEdit.tiles.clear(); gCanvasEditTouched.clear();
+    gCanvasUndo.clear(); gCanvasRedo.clear();
+    gShapeDragging = false;
+}
+
+static void beginCanvasEdit() {
+    gCanvasEdit.tiles.clear();
+    gCanvasEditTouched.assign(canvasTilesX() * canvasTilesY(), false);
+}
+
+static void commitCanvasEdit() {
+    if (gCanvasEdit.tiles.empty()) return;
+    gCanvasUndo.push_back(move(gCanvasEdit));
+    gCanvasEdit.tiles.clear();
+    while ((int)gCanvasUndo.size() > MAX_CANVAS_UNDO) gCanvasUndo.pop_front();
+    gCanvasRedo.clear();
+}
+
+// Saves tiles in [x0,x1]x[y0,y1] not yet saved by this edit. With rnd the
+// pixels come from the GPU canvas (render target must be costumeCanvas),
+// otherwise from the CPU mirror.
+static void snapshotCanvasTiles(SDL_Renderer* rnd, int x0, int y0, int x1, int y1) {
+    int tx0 = max(0, x0 / CANVAS_TILE), ty0 = max(0, y0 / CANVAS_TILE);
+    int tx1 = min(canvasTilesX() - 1, max(0, x1) / CANVAS_TILE);
+    int ty1 = min(canvasTilesY() - 1, max(0, y1) / CANVAS_TILE);
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            int ti = ty * canvasTilesX() + tx;
+            if (gCanvasEditTouched[ti]) continue;
+            gCanvasEditTouched[ti] = true;
+            CanvasTile t; t.tx = tx; t.ty = ty;
+            if (rnd) readCanvasTile(rnd, tx, ty, t.pixels);
+            else {
+                SDL_Rect r = canvasTileRect(tx, ty);
+                t.pixels.resize((size_t)r.w * r.h);
+                for (int row = 0; row < r.h; row++)
+                    memcpy(&t.pixels[(size_t)row * r.w], &gCanvasPixels[(size_t)(r.y + row) * canvasW + r.x], r.w * 4);
+            }
+            gCanvasEdit.tiles.push_back(move(t));
+        }
+    }
+}
+
+static void beginCanvasStroke(int x, int y) {
+    gStrokePoints.clear();
+    gStrokePoints.push_back({x, y});
+    gStrokeHasCarry = false;
+    beginCanvasEdit();
+}
+
+static void addCanvasStrokePoint(int x, int y) {
+    if (!gStrokePoints.empty() && gStrokePoints.back().x == x && gStrokePoints.back().y == y) return;
+    gStrokePoints.push_back({x, y});
+}
+
+static void appendRoundCap(vector<SDL_Vertex>& v, vector<int>& idx, float cx, float cy,
+                           float rad, SDL_Color col)
+{
+    int segs = max(8, min(32, (int)(rad * 2)));
+    int base = (int)v.size();
+    v.push_back({{cx, cy}, col, {0, 0}});
+    for (int i = 0; i < segs; i++) {
+        float a = (float)(2 * M_PI * i / segs);
+        v.push_back({{cx + rad * cosf(a), cy + rad * sinf(a)}, col, {0, 0}});
+    }
+    for (int i = 0; i < segs; i++) {
+        idx.push_back(base);
+        idx.push_back(base + 1 + i);
+        idx.push_back(base + 1 + (i + 1) % segs);
+    }
+}
+
+// Draw everything queued this frame into costumeCanvas in one geometry batch.
+static void flushCanvasStroke(SDL_Renderer* rnd) {
+    if (!costumeCanvas || gStrokePoints.empty()) return;
+    if (gStrokeHasCarry && gStrokePoints.size() < 2) return;
+
+    float rad = max(1, penSize) * 0.5f;
+    SDL_Color col = {penColorR, penColorG, penColorB, 255};
+
+    int minX = canvasW, minY = canvasH, maxX = -1, maxY = -1;
+    for (auto& p : gStrokePoints) {
+        minX = min(minX, p.x); minY = min(minY, p.y);
+        maxX = max(maxX, p.x); maxY = max(maxY, p.y);
+    }
+    int pad = (int)ceilf(rad) + 1;
+
+    SDL_SetRenderTarget(rnd, costumeCanvas);
+    snapshotCanvasTiles(rnd, minX - pad, minY - pad, maxX + pad, maxY + pad);
+
+    vector<SDL_Vertex> verts;
+    vector<int> idx;
+    verts.reserve(gStrokePoints.size() * 40);
+    idx.reserve(gStrokePoints.size() * 100);
+    for (size_t i = 0; i < gStrokePoints.size(); i++) {
+        float x = (float)gStrokePoints[i].x, y = (float)gStrokePoints[i].y;
+        if (i > 0 || !gStrokeHasCarry) appendRoundCap(verts, idx, x, y, rad, col);
+        if (i == 0) continue;
+        float px = (float)gStrokePoints[i-1].x, py = (float)gStrokePoints[i-1].y;
+        float dx = x - px, dy = y - py, len = sqrtf(dx*dx + dy*dy);
+        if (len < 0.001f) continue;
+        float nx = -dy / len * rad, ny = dx / len * rad;
+        int base = (int)verts.size();
+        verts.push_back({{px + nx, py + ny}, col, {0, 0}});
+        verts.push_back({{px - nx, py - ny}, col, {0, 0}});
+        verts.push_back({{x - nx, y - ny}, col, {0, 0}});
+        verts.push_back({{x + nx, y + ny}, col, {0, 0}});
+        int quad[6] = {base, base+1, base+2, base, base+2, base+3};
+        idx.insert(idx.end(), quad, quad + 6);
+    }
+    SDL_SetRenderDrawBlendMode(rnd, SDL_BLENDMODE_NONE);
+    renderGeometry(rnd, nullptr, verts.data(), (int)verts.size(), idx.data(), (int)idx.size());
+    SDL_SetRenderDrawBlendMode(rnd, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderTarget(rnd, nullptr);
+    growRect(gCanvasStale, minX - pad, minY - pad, maxX + pad, maxY + pad);
+
+    SDL_Point last = gStrokePoints.back();
+    gStrokePoints.clear();
+    gStrokePoints.push_back(last);
+    gStrokeHasCarry = true;
+}
+
+static void endCanvasStroke(SDL_Renderer* rnd) {
+    flushCanvasStroke(rnd);
+    gStrokePoints.clear();
+    gStrokeHasCarry = false;
+    commitCanvasEdit();
+}
+
+// ── CPU raster tools ──
+// All writes go through fillCanvasSpan so every edit saves its tiles first.
+static void fillCanvasSpan(int y, int x0, int x1, Uint32 c) {
+    if (y < 0 || y >= canvasH) return;
+    x0 = max(x0, 0); x1 = min(x1, canvasW - 1);
+    if (x1 < x0) return;
+    snapshotCanvasTiles(nullptr, x0, y, x1, y);
+    Uint32* row = &gCanvasPixels[(size_t)y * canvasW];
+    fill(row + x0, row + x1 + 1, c);
+    growRect(gCanvasDirty, x0, y, x1, y);
+}
+
+// First index in [x, end) whose pixel differs from c (end if none).
+static int scanMatchRight(const Uint32* row, int x, int end, Uint32 c) {
+#if defined(__SSE2__)
+    __m128i cc = _mm_set1_epi32((int)c);
+    for (; x + 4 <= end; x += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(row + x)), cc);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (mask != 0xF) return x + __builtin_ctz(~mask & 0xF);
+    }
+#endif
+    while (x < end && row[x] == c) x++;
+    return x;
+}
+
+// Smallest index i >= begin such that row[i..x] all equal c (x must match).
+static int scanMatchLeft(const Uint32* row, int x, int begin, Uint32 c) {
+#if defined(__SSE2__)
+    __m128i cc = _mm_set1_epi32((int)c);
+    for (; x - 4 >= begin; x -= 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(row + x - 4)), cc);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (mask != 0xF) return x - 4 + (32 - __builtin_clz(~mask & 0xF));
+    }
+#endif
+    while (x - 1 >= begin && row[x - 1] == c) x--;
+    return x;
+}
+
+// First index in [x, end) whose pixel equals c (end if none).
+static int scanFindRight(const Uint32* row, int x, int end, Uint32 c) {
+#if defined(__SSE2__)
+    __m128i cc = _mm_set1_epi32((int)c);
+    for (; x + 4 <= end; x += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(row + x)), cc);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (mask) return x + __builtin_ctz(mask);
+    }
+#endif
+    while (x < end && row[x] != c) x++;
+    return x;
+}
+
+// Scanline span flood fill (exact colour match).
+static void floodFillCanvas(int sx, int sy, Uint32 c) {
+    if (sx < 0 || sy < 0 || sx >= canvasW || sy >= canvasH) return;
+    Uint32 target = gCanvasPixels[(size_t)sy * canvasW + sx];
+    if (target == c) return;
+    vector<SDL_Point> seeds;
+    seeds.push_back({sx, sy});
+    while (!seeds.empty()) {
+        SDL_Point s = seeds.back(); seeds.pop_back();
+        Uint32* row = &gCanvasPixels[(size_t)s.y * canvasW];
+        if (row[s.x] != target) continue;
+        int xl = scanMatchLeft(row, s.x, 0, target);
+        int xr = scanMatchRight(row, s.x, canvasW, target) - 1;
+        fillCanvasSpan(s.y, xl, xr, c);
+        for (int ny = s.y - 1; ny <= s.y + 1; ny += 2) {
+            if (ny < 0 || ny >= canvasH) continue;
+            const Uint32* nrow = &gCanvasPixels[(size_t)ny * canvasW];
+            int x = xl;
+            while (x <= xr) {
+                x = scanFindRight(nrow, x, xr + 1, target);
+                if (x > xr) break;
+                seeds.push_back({x, ny});
+                x = scanMatchRight(nrow, x, xr + 1, target);
+            }
+        }
+    }
+}
+
+// Shape outlines as horizontal spans, span(y, x0, x1). A shape tool commits
+// these spans to the canvas and previews the same spans on screen, so the
+// preview has the committed stroke width.
+template <class Span>
+static void rectSpans(int x0, int y0, int x1, int y1, int t, Span span) {
+    if (x0 > x1) swap(x0, x1);
+    if (y0 > y1) swap(y0, y1);
+    int h = t / 2;
+    x0 -= h; y0 -= h; x1 += t - 1 - h; y1 += t - 1 - h;
+    for (int y = y0; y <= y1; y++) {
+        if (y < y0 + t || y > y1 - t) span(y, x0, x1);
+        else { span(y, x0, x0 + t - 1); span(y, x1 - t + 1, x1); }
+    }
+}
+
+template <class Span>
+static void ellipseSpans(int x0, int y0, int x1, int y1, int t, Span span) {
+    float cx = (x0 + x1) * 0.5f, cy = (y0 + y1) * 0.5f;
+    float rx = fabsf(x1 - x0) * 0.5f, ry = fabsf(y1 - y0) * 0.5f, h = t * 0.5f;
+    float orx = rx + h, ory = ry + h, irx = rx - h, iry = ry - h;
+    for (int y = (int)floorf(cy - ory); y <= (int)ceilf(cy + ory); y++) {
+        float dy = y - cy;
+        if (dy * dy > ory * ory) continue;
+        int ow = (int)(orx * sqrtf(1.0f - dy * dy / (ory * ory)));
+        if (irx <= 0 || iry <= 0 || dy * dy >= iry * iry) {
+            span(y, (int)cx - ow, (int)cx + ow);
+        } else {
+            int iw = (int)(irx * sqrtf(1.0f - dy * dy / (iry * iry)));
+            span(y, (int)cx - ow, (int)cx - iw);
+            span(y, (int)cx + iw, (int)cx + ow);
+        }
+    }
+}
+
+// Thick line as a capsule; each row of a capsule is a single span.
+template <class Span>
+static void lineSpans(int x0, int y0, int x1, int y1, int t, Span span) {
+    float r = max(1, t) * 0.5f;
+    float dx = (float)(x1 - x0), dy = (float)(y1 - y0), len2 = dx*dx + dy*dy;
+    int by0 = (int)floorf(min(y0, y1) - r), by1 = (int)ceilf(max(y0, y1) + r);
+    int bx0 = (int)floorf(min(x0, x1) - r), bx1 = (int)ceilf(max(x0, x1) + r);
+    for (int y = by0; y <= by1; y++) {
+        int lo = INT_MAX, hi = INT_MIN;
+        for (int x = max(bx0, 0); x <= min(bx1, canvasW - 1); x++) {
+            float u = len2 > 0 ? ((x - x0) * dx + (y - y0) * dy) / len2 : 0;
+            u = max(0.0f, min(1.0f, u));
+            float ex = x0 + u * dx - x, ey = y0 + u * dy - y;
+            if (ex*ex + ey*ey <= r*r) { lo = min(lo, x); hi = max(hi, x); }
+        }
+        if (lo <= hi) span(y, lo, hi);
+    }
+}
+
+template <class Span>
+static void shapeSpans(PaintTool tool, int x0, int y0, int x1, int y1, int t, Span span) {
+    switch (tool) {
+        case PaintTool::RECT:    rectSpans(x0, y0, x1, y1, t, span); break;
+        case PaintTool::ELLIPSE: ellipseSpans(x0, y0, x1, y1, t, span); break;
+        case PaintTool::LINE:    lineSpans(x0, y0, x1, y1, t, span); break;
+        default: break;
+    }
+}
+
+static void drawCanvasRect(int x0, int y0, int x1, int y1, int t, Uint32 c) {
+    rectSpans(x0, y0, x1, y1, t, [c](int y, int a, int b) { fillCanvasSpan(y, a, b, c); });
+}
+
+static void drawCanvasEllipse(int x0, int y0, int x1, int y1, int t, Uint32 c) {
+    ellipseSpans(x0, y0, x1, y1, t, [c](int y, int a, int b) { fillCanvasSpan(y, a, b, c); });
+}
+
+static void drawCanvasLine(int x0, int y0, int x1, int y1, int t, Uint32 c) {
+    lineSpans(x0, y0, x1, y1, t, [c](int y, int a, int b) { fillCanvasSpan(y, a, b, c); });
+}
+
+static Uint32 penColorRGBA8888() {
+    return ((Uint32)penColorR << 24) | ((Uint32)penColorG << 16) | ((Uint32)penColorB << 8) | 0xFFu;
+}
+
+static void canvasBucketFill(SDL_Renderer* rnd, int x, int y) {
+    syncCanvasMirror(rnd);
+    beginCanvasEdit();
+    floodFillCanvas(x, y, penColorRGBA8888());
+    uploadCanvasDirty();
+    commitCanvasEdit();
+}
+
+static void commitCanvasShape(SDL_Renderer* rnd) {
+    gShapeDragging = false;
+    syncCanvasMirror(rnd);
+    beginCanvasEdit();
+    Uint32 c = penColorRGBA8888();
+    shapeSpans(gPaintTool, gShapeX0, gShapeY0, gShapeX1, gShapeY1, max(1, penSize),
+               [c](int y, int a, int b) { fillCanvasSpan(y, a, b, c); });
+    uploadCanvasDirty();
+    commitCanvasEdit();
+}
+
+// Restores an edit's tiles and stores the replaced pixels back into it, so the
+// same record serves as its own inverse.
+static void swapCanvasEdit(SDL_Renderer* rnd, CanvasEdit& ed) {
+    vector<Uint32> cur;
+    SDL_SetRenderTarget(rnd, costumeCanvas);
+    for (auto& t : ed.tiles) {
+        readCanvasTile(rnd, t.tx, t.ty, cur);
+        writeCanvasTile(t.tx, t.ty, t.pixels);
+        t.pixels.swap(cur);
+    }
+    SDL_SetRenderTarget(rnd, nullptr);
+}
+
+static void canvasUndo(SDL_Renderer* rnd) {
+    if (!costumeCanvas || isDrawing || gShapeDragging || gCanvasUndo.empty()) return;
+    CanvasEdit ed = move(gCanvasUndo.back()); gCanvasUndo.pop_back();
+    swapCanvasEdit(rnd, ed);
+    gCanvasRedo.push_back(move(ed));
+}
+
+static void canvasRedo(SDL_Renderer* rnd) {
+    if (!costumeCanvas || isDrawing || gShapeDragging || gCanvasRedo.empty()) return;
+    CanvasEdit ed = move(gCanvasRedo.back()); gCanvasRedo.pop_back();
+    swapCanvasEdit(rnd, ed);
+    gCanvasUndo.push_back(move(ed));
+}
+
+// ════════════════════════════════════════════
+//  Costume save: background PNG encoder
+// ════════════════════════════════════════════
+// Save copies the canvas mirror once and queues it here. A single worker
+// thread filters, deflates (fixed Huffman + LZ77) and writes the PNG to a
+// temp file that is renamed over the target, so the UI never waits on
+// compression or disk I/O.
+struct ProjectMapping;
+struct CostumeSaveJob {
+    int id;
+    string path;
+    int w, h;
+    vector<Uint32> pixels;          // RGBA8888
+    shared_ptr<atomic<int>> rowsDone;
+    // project save (Ctrl+S): a copy of the project, written after the
+    // costume PNGs queued before it are on disk
+    bool project = false;
+    vector<Block> blocks;
+    vector<Sprite> sprites;
+    Sint32 nextBlockId = 0, nextSpriteNum = 0, bgColor = 0;
+    shared_ptr<ProjectMapping> map;     // keeps assetData pointers alive
+};
+struct CostumeSaveResult {
+    int id;
+    string path;
+    bool ok;
+    size_t bytes;
+    float ms;
+    bool project;
+};
+
+static mutex gSaveMutex;
+static condition_variable gSaveCv;
+static deque<CostumeSaveJob> gSaveQueue;
+static vector<CostumeSaveResult> gSaveDone;
+static thread gSaveThread;
+static bool gSaveThreadQuit = false;
+static bool gSaveBusy = false;       // worker is encoding a popped job
+static int gNextSaveJobId = 1;
+
+// Shown by the UI while a save runs / shortly after it completes.
+static shared_ptr<atomic<int>> gSaveProgressRows;
+static int gSaveProgressTotal = 0;
+static string gSaveStatusText;
+static float gSaveStatusTimer = 0;
+
+static Uint32 pngCrc32(const Uint8* data, size_t n, Uint32 crc = 0) {
+    // encoder pool, costume save worker and journal call this concurrently;
+    // a function-local static is initialised exactly once
+    static const array<Uint32, 256> table = [] {
+        array<Uint32, 256> t;
+        for (Uint32 i = 0; i < 256; i++) {
+            Uint32 c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+struct DeflateBits {
+    vector<Uint8>& out;
+    Uint32 acc = 0;
+    int n = 0;
+    explicit DeflateBits(vector<Uint8>& o) : out(o) {}
+    void put(Uint32 bits, int cnt) {
+        acc |= bits << n; n += cnt;
+        while (n >= 8) { out.push_back((Uint8)acc); acc >>= 8; n -= 8; }
+    }
+    // Huffman codes are stored MSB first.
+    void putCode(Uint32 code, int len) {
+        Uint32 r = 0;
+        for (int i = 0; i < len; i++) { r = (r << 1) | (code & 1); code >>= 1; }
+        put(r, len);
+    }
+    void flush() { if (n > 0) out.push_back((Uint8)acc); acc = 0; n = 0; }
+};
+
+static void deflateFixedLiteral(DeflateBits& bw, int sym) {
+    if (sym < 144)      bw.putCode(0x30 + sym, 8);
+    else if (sym < 256) bw.putCode(0x190 + sym - 144, 9);
+    else if (sym < 280) bw.putCode(sym - 256, 7);
+    else                bw.putCode(0xC0 + sym - 280, 8);
+}
+
+static void deflateFixedMatch(DeflateBits& bw, int len, int dist) {
+    static const int lenBase[29]  = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+    static const int lenExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+    static const int distBase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+    static const int distExtra[30]= {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+    int li = (int)(upper_bound(lenBase, lenBase + 29, len) - lenBase) - 1;
+    deflateFixedLiteral(bw, 257 + li);
+    if (lenExtra[li]) bw.put(len - lenBase[li], lenExtra[li]);
+    int di = (int)(upper_bound(distBase, distBase + 30, dist) - distBase) - 1;
+    bw.putCode(di, 5);
+    if (distExtra[di]) bw.put(dist - distBase[di], distExtra[di]);
+}
+
+// zlib stream with one fixed-Huffman block. progress(pos) is called
+// periodically with the number of input bytes consumed.
+template <class Progress>
+static void zlibCompress(const vector<Uint8>& in, vector<Uint8>& out, Progress progress) {
+    const int WINDOW = 32768, HASH_BITS = 15, MAX_CHAIN = 16, MIN_MATCH = 3, MAX_MATCH = 258;
+    out.push_back(0x78); out.push_back(0x01);
+    DeflateBits bw(out);
+    bw.put(1, 1); bw.put(1, 2);      // BFINAL, BTYPE=fixed
+
+    vector<int> head(1 << HASH_BITS, -1), prev(WINDOW, -1);
+    size_t n = in.size(), i = 0, nextReport = 0;
+    auto hashAt = [&](size_t p) {
+        return (int)(((in[p] << 10) ^ (in[p+1] << 5) ^ in[p+2]) & ((1 << HASH_BITS) - 1));
+    };
+    auto insert = [&](size_t p) {
+        if (p + MIN_MATCH > n) return;
+        int hv = hashAt(p);
+        prev[p % WINDOW] = head[hv];
+        head[hv] = (int)p;
+    };
+    while (i < n) {
+        int bestLen = 0, bestDist = 0;
+        if (i + MIN_MATCH <= n) {
+            int cand = head[hashAt(i)];
+            int maxLen = (int)min((size_t)MAX_MATCH, n - i);
+            for (int chain = 0; cand >= 0 && (int)(i - cand) <= WINDOW && chain < MAX_CHAIN; chain++) {
+                int l = 0;
+                while (l < maxLen && in[cand + l] == in[i + l]) l++;
+                if (l > bestLen) { bestLen = l; bestDist = (int)(i - cand); if (l == maxLen) break; }
+                int nc = prev[cand % WINDOW];
+                if (nc >= cand) break;
+                cand = nc;
+            }
+        }
+        if (bestLen >= MIN_MATCH) {
+            deflateFixedMatch(bw, bestLen, bestDist);
+            for (int k = 0; k < bestLen; k++) insert(i + k);
+            i += bestLen;
+        } else {
+            deflateFixedLiteral(bw, in[i]);
+            insert(i);
+            i++;
+        }
+        if (i >= nextReport) { progress(i); nextReport = i + 4096; }
+    }
+    deflateFixedLiteral(bw, 256);
+    bw.flush();
+
+    Uint32 a = 1, b = 0;
+    for (size_t k = 0; k < n; k++) { a = (a + in[k]) % 65521; b = (b + a) % 65521; }
+    Uint32 adler = (b << 16) | a;
+    for (int s = 24; s >= 0; s -= 8) out.push_back((Uint8)(adler >> s));
+}
+
+static void pngPutChunk(vector<Uint8>& png, const char* type, const vector<Uint8>& data) {
+    Uint32 len = (Uint32)data.size();
+    for (int s = 24; s >= 0; s -= 8) png.push_back((Uint8)(len >> s));
+    size_t typeAt = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    Uint32 crc = pngCrc32(&png[typeAt], 4 + data.size());
+    for (int s = 24; s >= 0; s -= 8) png.push_back((Uint8)(crc >> s));
+}
+
+// RGBA8888 pixels -> PNG file image. rowsDone is advanced as rows are compressed.
+static void encodePng(const vector<Uint32>& px, int w, int h, vector<Uint8>& png,
+                      atomic<int>* rowsDone = nullptr)
+{
+    size_t stride = (size_t)w * 4 + 1;
+    vector<Uint8> raw(stride * h);
+    for (int y = 0; y < h; y++) {
+        Uint8* dst = &raw[y * stride];
+        dst[0] = 1;                          // Sub filter: flat colour becomes zeros
+        const Uint32* src = &px[(size_t)y * w];
+        Uint8 prevPx[4] = {0,0,0,0};
+        for (int x = 0; x < w; x++) {
+            Uint32 p = src[x];
+            Uint8 c[4] = {(Uint8)(p >> 24), (Uint8)(p >> 16), (Uint8)(p >> 8), (Uint8)p};
+            for (int k = 0; k < 4; k++) { dst[1 + x*4 + k] = (Uint8)(c[k] - prevPx[k]); prevPx[k] = c[k]; }
+        }
+    }
+    vector<Uint8> idat;
+    idat.reserve(raw.size() / 4);
+    zlibCompress(raw, idat, [&](size_t pos) { if (rowsDone) rowsDone->store((int)(pos / stride)); });
+    if (rowsDone) rowsDone->store(h);
+
+    static const Uint8 sig[8] = {137,80,78,71,13,10,26,10};
+    png.assign(sig, sig + 8);
+    vector<Uint8> ihdr(13, 0);
+    for (int s = 24, k = 0; s >= 0; s -= 8, k++) { ihdr[k] = (Uint8)(w >> s); ihdr[4 + k] = (Uint8)(h >> s); }
+    ihdr[8] = 8; ihdr[9] = 6;                // 8-bit RGBA
+    pngPutChunk(png, "IHDR", ihdr);
+    pngPutChunk(png, "IDAT", idat);
+    pngPutChunk(png, "IEND", {});
+}
+
+static bool writeFileAtomic(const string& path, const vector<Uint8>& data) {
+    string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = (fflush(f) == 0) && ok;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) { remove(tmp.c_str()); return false; }
+    error_code ec;
+    filesystem::rename(tmp, path, ec);
+    if (ec) { remove(tmp.c_str()); return false; }
+    return true;
+}
+
+static void buildProjectImage(const vector<Block>& blocks, const vector<Sprite>& sprites,
+                              bool embedAssets, Sint32 autosaveGen, Sint32 nextBlockId,
+                              Sint32 nextSpriteNum, Sint32 bgColor, vector<Uint8>& out);
+
+static void costumeSaveWorker() {
+    for (;;) {
+        CostumeSaveJob job;
+        {
+            unique_lock<mutex> lk(gSaveMutex);
+            gSaveCv.wait(lk, []{ return gSaveThreadQuit || !gSaveQueue.empty(); });
+            if (gSaveQueue.empty()) return;
+            job = move(gSaveQueue.front());
+            gSaveQueue.pop_front();
+            gSaveBusy = true;
+        }
+        auto t0 = chrono::steady_clock::now();
+        vector<Uint8> png;
+        if (job.project)
+            buildProjectImage(job.blocks, job.sprites, true, 0, job.nextBlockId, job.nextSpriteNum, job.bgColor, png);
+        else
+            encodePng(job.pixels, job.w, job.h, png, job.rowsDone.get());
+        error_code ec;
+        filesystem::path dir = filesystem::path(job.path).parent_path();
+        if (!dir.empty()) filesystem::create_directories(dir, ec);
+        bool ok = writeFileAtomic(job.path, png);
+        float ms = chrono::duration<float, milli>(chrono::steady_clock::now() - t0).count();
+        {
+            lock_guard<mutex> lk(gSaveMutex);
+            gSaveDone.push_back({job.id, job.path, ok, png.size(), ms, job.project});
+            gSaveBusy = false;
+        }
+        gSaveCv.notify_all();
+    }
+}
+
+static int queueCostumeSave(const string& path, const vector<Uint32>& px, int w, int h) {
+    CostumeSaveJob job;
+    job.id = gNextSaveJobId++;
+    job.path = path; job.w = w; job.h = h; job.pixels = px;
+    job.rowsDone = make_shared<atomic<int>>(0);
+    gSaveProgressRows = job.rowsDone;
+    gSaveProgressTotal = h;
+    {
+        lock_guard<mutex> lk(gSaveMutex);
+        if (!gSaveThread.joinable()) { gSaveThreadQuit = false; gSaveThread = thread(costumeSaveWorker); }
+        gSaveQueue.push_back(move(job));
+    }
+    gSaveCv.notify_all();
+    return gNextSaveJobId - 1;
+}
+
+static shared_ptr<ProjectMapping> gProjectMap;
+
+// Ctrl+S: the worker images and writes a copy of the project after the
+// costume saves ahead of it; the result arrives through gSaveDone.
+static void queueProjectSave(const string& path, const vector<Block>& blocks, const vector<Sprite>& sprites) {
+    CostumeSaveJob job;
+    job.id = gNextSaveJobId++;
+    job.path = path; job.w = job.h = 0;
+    job.project = true;
+    job.blocks = blocks; job.sprites = sprites;
+    job.nextBlockId = gNextBlockId; job.nextSpriteNum = gNextSpriteNum; job.bgColor = gBgColor;
+    job.map = gProjectMap;
+    {
+        lock_guard<mutex> lk(gSaveMutex);
+        if (!gSaveThread.joinable()) { gSaveThreadQuit = false; gSaveThread = thread(costumeSaveWorker); }
+        gSaveQueue.push_back(move(job));
+    }
+    gSaveCv.notify_all();
+}
+
+// Blocks until every queued costume PNG is on disk.
+static void flushCostumeSaves() {
+    unique_lock<mutex> lk(gSaveMutex);
+    gSaveCv.wait(lk, []{ return gSaveQueue.empty() && !gSaveBusy; });
+}
+
+// Finishes pending saves (called once at shutdown).
+static void stopCostumeSaveWorker() {
+    {
+        lock_guard<mutex> lk(gSaveMutex);
+        gSaveThreadQuit = true;
+    }
+    gSaveCv.notify_one();
+    if (gSaveThread.joinable()) gSaveThread.join();
+}
+
+// Encode throughput on a painted and on a noisy canvas (--bench-png [iters]).
+static int runPngBenchmark(int iters) {
+    if (iters < 1) iters = 1;
+    resetCanvasMirror(0xFFFFFFFFu);
+    beginCanvasEdit();
+    drawCanvasEllipse(60, 40, 300, 280, 6, 0xFF8C00FFu);
+    floodFillCanvas(180, 160, 0x4285F4FFu);
+    drawCanvasRect(320, 200, 450, 340, 4, 0x000000FFu);
+    drawCanvasLine(0, 0, canvasW - 1, canvasH - 1, 9, 0x59C059FFu);
+    vector<Uint32> painted = gCanvasPixels;
+    gCanvasEdit.tiles.clear();
+
+    vector<Uint32> noisy(painted.size());
+    Uint32 seed = 12345;
+    for (auto& p : noisy) { seed = seed * 1664525u + 1013904223u; p = seed | 0xFF; }
+
+    const pair<const char*, vector<Uint32>*> cases[] = {{"painted", &painted}, {"noise", &noisy}};
+    for (auto& c : cases) {
+        vector<Uint8> png;
+        auto t0 = chrono::steady_clock::now();
+        for (int i = 0; i < iters; i++) encodePng(*c.second, canvasW, canvasH, png);
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        double mb = (double)canvasW * canvasH * 4 * iters / (1024.0 * 1024.0);
+        printf("png %-8s %dx%d x%d: %.2f ms/frame, %.1f MB/s, %zu bytes (%.1f%% of raw)\n",
+               c.first, canvasW, canvasH, iters, sec * 1000.0 / iters, mb / sec, png.size(),
+               100.0 * png.size() / ((double)canvasW * canvasH * 4));
+    }
+    return 0;
+}
+
+// ════════════════════════════════════════════
+//  Project file: flat binary format + lazy assets
+// ════════════════════════════════════════════
+// A project is a header followed by fixed-size record arrays (blocks, inputs,
+// op slots, sprites, costumes), a string table and the encoded bytes of every
+// image, each section 8-byte aligned in native little-endian layout. Links
+// (next/parent/child/embedded) are stored as block ids. Loading maps the
+// file and rebuilds the workspace straight from the records; images stay in
+// the mapping until the stage first shows them.
+static const char   PROJECT_MAGIC[4] = {'S','C','R','P'};
+static const Uint32 PROJECT_VERSION  = 2;
+
+enum ProjectSection { PS_BLOCKS, PS_INPUTS, PS_SLOTS, PS_SPRITES, PS_COSTUMES,
+                      PS_STRINGS, PS_STRING_BYTES, PS_ASSETS, PS_ASSET_BYTES, PS_COUNT };
+
+struct ProjectHeader {
+    char   magic[4];
+    Uint32 version;
+    Uint64 offset[PS_COUNT];
+    Uint64 count[PS_COUNT];     // records, or bytes for the *_BYTES sections
+    Sint32 nextBlockId, nextSpriteNum, bgColor;
+    Sint32 autosaveGen;         // pairs an autosave snapshot with its journal
+};
+struct ProjBlockRec {
+    Sint32 id, text;            // text: string index
+    Uint8  cat, shape, pad[2];
+    float  x, y, w, h;
+    Sint32 nextBlockId, parentBlockId, childHeadId;
+    Uint32 firstInput, numInputs, firstSlot, numSlots;
+};
+struct ProjInputRec { Sint32 value, defaultVal; float relX, relY, width, height; };
+struct ProjSlotRec  { float relX, relY, width, height; Sint32 embeddedBlockId; };
+struct ProjSpriteRec {
+    Sint32 name;
+    float  x, y, direction, size, ghostEffect, colorEffect;
+    Uint8  visible, pad[3];
+    Uint8  color[4];
+    Sint32 currentCostume, uploadedAsset, uploadedFile;
+    Uint32 firstCostume, numCostumes;
+};
+struct ProjCostumeRec {
+    Sint32 name, file, asset;
+    Uint8  type, flippedH, flippedV, pad;
+    Uint8  primary[4], secondary[4];
+    Sint32 width, height;
+};
+struct ProjStringRec { Uint32 offset, length; };
+struct ProjAssetRec  { Uint64 offset, size; };
+
+static const size_t PROJECT_REC_SIZE[PS_COUNT] = {
+    sizeof(ProjBlockRec), sizeof(ProjInputRec), sizeof(ProjSlotRec), sizeof(ProjSpriteRec),
+    sizeof(ProjCostumeRec), sizeof(ProjStringRec), 1, sizeof(ProjAssetRec), 1 };
+
+// The open project file. Costumes loaded from it point into this mapping,
+// so it is only released when another project replaces it.
+struct ProjectMapping {
+    const Uint8* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    vector<Uint8> heap;         // fallback where mmap is unavailable
+    ~ProjectMapping() {
+#ifndef _WIN32
+        if (mapped) munmap((void*)data, size);
+#endif
+    }
+};
+static string gProjectPath;
+
+static shared_ptr<ProjectMapping> mapProjectFile(const string& path) {
+    auto m = make_shared<ProjectMapping>();
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return nullptr; }
+    void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return nullptr;
+    m->data = (const Uint8*)p; m->size = (size_t)st.st_size; m->mapped = true;
+#else
+    ifstream in(path, ios::binary);
+    if (!in) return nullptr;
+    m->heap.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    m->data = m->heap.data(); m->size = m->heap.size();
+#endif
+    return m;
+}
+
+struct ProjectWriter {
+    vector<ProjBlockRec> blocks;
+    vector<ProjInputRec> inputs;
+    vector<ProjSlotRec> slots;
+    vector<ProjSpriteRec> sprites;
+    vector<ProjCostumeRec> costumes;
+    vector<ProjStringRec> strings;
+    string stringBytes;
+    vector<ProjAssetRec> assets;
+    vector<Uint8> assetBytes;
+    unordered_map<string, Sint32> stringIds;
+    unordered_map<string, Sint32> fileAssets;
+    unordered_map<const Uint8*, Sint32> memAssets;
+
+    Sint32 str(const string& s) {
+        auto it = stringIds.find(s);
+        if (it != stringIds.end()) return it->second;
+        Sint32 id = (Sint32)strings.size();
+        strings.push_back({(Uint32)stringBytes.size(), (Uint32)s.size()});
+        stringBytes += s;
+        stringIds.emplace(s, id);
+        return id;
+    }
+    Sint32 addAsset(const Uint8* data, size_t n) {
+        while (assetBytes.size() % 8) assetBytes.push_back(0);
+        assets.push_back({(Uint64)assetBytes.size(), (Uint64)n});
+        assetBytes.insert(assetBytes.end(), data, data + n);
+        return (Sint32)assets.size() - 1;
+    }
+    // Prefers bytes already in the open project, then the file on disk.
+    Sint32 asset(const Uint8* data, Uint32 size, const string& file) {
+        if (data) {
+            auto it = memAssets.find(data);
+            if (it != memAssets.end()) return it->second;
+            return memAssets[data] = addAsset(data, size);
+        }
+        if (file.empty()) return -1;
+        auto it = fileAssets.find(file);
+        if (it != fileAssets.end()) return it->second;
+        ifstream in(file, ios::binary);
+        if (!in) { cout << "Project: missing image " << file << endl; return fileAssets[file] = -1; }
+        vector<Uint8> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        return fileAssets[file] = addAsset(bytes.data(), bytes.size());
+    }
+};
+
+// Without embedAssets images are stored by file path only (autosave snapshots).
+// The header counters are passed in so the autosave worker can image a copy.
+static void buildProjectImage(const vector<Block>& blocks, const vector<Sprite>& sprites,
+                              bool embedAssets, Sint32 autosaveGen, Sint32 nextBlockId,
+                              Sint32 nextSpriteNum, Sint32 bgColor, vector<Uint8>& out) {
+    ProjectWriter w;
+    for (auto& b : blocks) {
+        ProjBlockRec r = {};
+        r.id = b.id; r.text = w.str(*b.text);
+        r.cat = (Uint8)b.cat; r.shape = (Uint8)b.shape;
+        r.x = b.x; r.y = b.y; r.w = b.w; r.h = b.h;
+        r.nextBlockId = b.nextBlockId; r.parentBlockId = b.parentBlockId; r.childHeadId = b.childHeadId;
+        r.firstInput = (Uint32)w.inputs.size(); r.numInputs = (Uint32)b.inputs.size();
+        r.firstSlot = (Uint32)w.slots.size(); r.numSlots = (Uint32)b.opSlots.size();
+        for (auto& f : b.inputs)
+            w.inputs.push_back({w.str(f.value), w.str(*f.defaultVal), f.relX, f.relY, f.width, f.height});
+        for (auto& sl : b.opSlots)
+            w.slots.push_back({sl.relX, sl.relY, sl.width, sl.height, sl.embeddedBlockId});
+        w.blocks.push_back(r);
+    }
+    // Without embedAssets (autosave snapshots) images are referenced by path,
+    // except ones that only live inside the open project and have no file.
+    auto image = [&](const Uint8* data, Uint32 size, const string& file) -> Sint32 {
+        if (embedAssets) return w.asset(data, size, file);
+        error_code ec;
+        return data && (file.empty() || !filesystem::exists(file, ec)) ? w.asset(data, size, string()) : -1;
+    };
+    for (auto& sp : sprites) {
+        ProjSpriteRec r = {};
+        r.name = w.str(sp.name);
+        r.x = sp.x; r.y = sp.y; r.direction = sp.direction; r.size = sp.size;
+        r.ghostEffect = sp.ghostEffect; r.colorEffect = sp.colorEffect;
+        r.visible = sp.visible;
+        r.color[0] = sp.color.r; r.color[1] = sp.color.g; r.color[2] = sp.color.b; r.color[3] = sp.color.a;
+        r.currentCostume = sp.currentCostume;
+        r.uploadedAsset = image(sp.uploadedAsset, sp.uploadedAssetSize, sp.uploadedFile);
+        r.uploadedFile = w.str(sp.uploadedFile);
+        r.firstCostume = (Uint32)w.costumes.size(); r.numCostumes = (Uint32)sp.costumes.size();
+        for (auto& c : sp.costumes) {
+            ProjCostumeRec cr = {};
+            cr.name = w.str(c.name); cr.file = w.str(c.file);
+            cr.asset = image(c.assetData, c.assetSize, c.file);
+            cr.type = (Uint8)c.type; cr.flippedH = c.flippedH; cr.flippedV = c.flippedV;
+            cr.primary[0] = c.primaryColor.r; cr.primary[1] = c.primaryColor.g;
+            cr.primary[2] = c.primaryColor.b; cr.primary[3] = c.primaryColor.a;
+            cr.secondary[0] = c.secondaryColor.r; cr.secondary[1] = c.secondaryColor.g;
+            cr.secondary[2] = c.secondaryColor.b; cr.secondary[3] = c.secondaryColor.a;
+            cr.width = c.width; cr.height = c.height;
+            w.costumes.push_back(cr);
+        }
+        w.sprites.push_back(r);
+    }
+
+    ProjectHeader hdr = {};
+    memcpy(hdr.magic, PROJECT_MAGIC, 4);
+    hdr.version = PROJECT_VERSION;
+    hdr.nextBlockId = nextBlockId; hdr.nextSpriteNum = nextSpriteNum; hdr.bgColor = bgColor;
+    hdr.autosaveGen = autosaveGen;
+    const pair<const void*, size_t> sections[PS_COUNT] = {
+        {w.blocks.data(), w.blocks.size()}, {w.inputs.data(), w.inputs.size()},
+        {w.slots.data(), w.slots.size()}, {w.sprites.data(), w.sprites.size()},
+        {w.costumes.data(), w.costumes.size()}, {w.strings.data(), w.strings.size()},
+        {w.stringBytes.data(), w.stringBytes.size()}, {w.assets.data(), w.assets.size()},
+        {w.assetBytes.data(), w.assetBytes.size()} };
+    out.assign(sizeof(hdr), 0);
+    for (int i = 0; i < PS_COUNT; i++) {
+        out.resize((out.size() + 7) & ~(size_t)7);
+        size_t bytes = sections[i].second * PROJECT_REC_SIZE[i];
+        hdr.offset[i] = out.size();
+        hdr.count[i] = sections[i].second;
+        out.insert(out.end(), (const Uint8*)sections[i].first, (const Uint8*)sections[i].first + bytes);
+    }
+    memcpy(out.data(), &hdr, sizeof(hdr));
+}
+
+static bool saveProject(const string& path, const vector<Block>& blocks, const vector<Sprite>& sprites) {
+    flushCostumeSaves();
+    vector<Uint8> out;
+    buildProjectImage(blocks, sprites, true, 0, gNextBlockId, gNextSpriteNum, gBgColor, out);
+    return writeFileAtomic(path, out);
+}
+
+static SDL_Texture* decodeProjectAsset(SDL_Renderer* rnd, const Uint8* data, Uint32 size, int* w, int* h) {
+    SDL_Surface* surf = IMG_Load_RW(SDL_RWFromConstMem(data, (int)size), 1);
+    if (!surf) { cout << "Failed to decode project image: " << IMG_GetError() << endl; return nullptr; }
+    SDL_Texture* tex = SDL_CreateTextureFromSurface(rnd, surf);
+    if (w) *w = surf->w;
+    if (h) *h = surf->h;
+    SDL_FreeSurface(surf);
+    return tex;
+}
+
+static SDL_Texture* loadImageFile(SDL_Renderer* rnd, const string& file, int* w, int* h) {
+    SDL_Surface* surf = IMG_Load(file.c_str());
+    if (!surf) { cout << "Failed to load: " << file << endl; return nullptr; }
+    SDL_Texture* tex = SDL_CreateTextureFromSurface(rnd, surf);
+    if (w) *w = surf->w;
+    if (h) *h = surf->h;
+    SDL_FreeSurface(surf);
+    return tex;
+}
+
+// Decodes the images the stage is about to show for this sprite: from the
+// open project's bytes, else (autosave snapshots) from the file on disk.
+static void ensureSpriteTextures(SDL_Renderer* rnd, Sprite& sp) {
+    if (!sp.uploadedTexture && !sp.uploadedMissing) {
+        if (sp.uploadedAsset)
+            sp.uploadedTexture = decodeProjectAsset(rnd, sp.uploadedAsset, sp.uploadedAssetSize, nullptr, nullptr);
+        else if (!sp.uploadedFile.empty())
+            sp.uploadedTexture = loadImageFile(rnd, sp.uploadedFile, nullptr, nullptr);
+        sp.uploadedMissing = !sp.uploadedTexture;
+    }
+    if (sp.currentCostume < 0 || sp.currentCostume >= (int)sp.costumes.size()) return;
+    Costume& c = sp.costumes[sp.currentCostume];
+    if (!c.texture && !c.imageMissing && (c.assetData || !c.file.empty())) {
+        if (c.assetData) c.texture = decodeProjectAsset(rnd, c.assetData, c.assetSize, &c.width, &c.height);
+        else if (c.saveJobId < 0) c.texture = loadImageFile(rnd, c.file, &c.width, &c.height);
+        else return;            // PNG still being written
+        c.imageMissing = !c.texture;
+    }
+}
+
+// The interpreter, findBlock and forEachInStack trust block ids and links:
+// ids are unique and below nextBlockId, every link names a loaded block, and
+// following next/child/embedded links never comes back to a block on the
+// current path. A crafted or truncated file could break any of that.
+static bool checkBlockLinks(const vector<Block>& nb, Sint32 nextBlockId, string& err) {
+    vector<pair<int, int>> ids;         // (id, index), sorted by id
+    ids.reserve(nb.size());
+    for (int i = 0; i < (int)nb.size(); i++) ids.push_back({nb[i].id, i});
+    sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (ids[i].first < 0) { err = "negative block id"; return false; }
+        if (i && ids[i].first == ids[i - 1].first) { err = "duplicate block id " + intToString(ids[i].first); return false; }
+    }
+    if (!ids.empty() && nextBlockId <= ids.back().first) { err = "next block id not above the loaded ids"; return false; }
+    auto index = [&](int id) {
+        auto it = lower_bound(ids.begin(), ids.end(), make_pair(id, INT_MIN));
+        return it != ids.end() && it->first == id ? it->second : -1;
+    };
+    auto linkOk = [&](int id) { return id < 0 || index(id) >= 0; };
+    for (auto& b : nb) {
+        bool ok = linkOk(b.nextBlockId) && linkOk(b.parentBlockId) && linkOk(b.childHeadId);
+        for (auto& sl : b.opSlots) ok = ok && linkOk(sl.embeddedBlockId);
+        if (!ok) { err = "block " + intToString(b.id) + " links to a missing block"; return false; }
+    }
+    // depth-first over next/child/embedded links; 1 = on the current path
+    vector<Uint8> state(nb.size(), 0);
+    vector<pair<int, int>> path;        // (index, next edge to follow)
+    for (int root = 0; root < (int)nb.size(); root++) {
+        if (state[root]) continue;
+        state[root] = 1;
+        path.push_back({root, 0});
+        while (!path.empty()) {
+            const Block& b = nb[path.back().first];
+            int e = path.back().second++, to = -1;
+            if (e == 0) to = b.nextBlockId;
+            else if (e == 1) to = b.childHeadId;
+            else if (e - 2 < (int)b.opSlots.size()) to = b.opSlots[e - 2].embeddedBlockId;
+            else { state[path.back().first] = 2; path.pop_back(); continue; }
+            if (to < 0) continue;
+            int j = index(to);
+            if (state[j] == 1) { err = "block links loop back to block " + intToString(to); return false; }
+            if (state[j] == 0) { state[j] = 1; path.push_back({j, 0}); }
+        }
+    }
+    return true;
+}
+
+static bool loadProject(const string& path, vector<Block>& blocks, vector<Sprite>& sprites, string& err,
+                        Sint32* autosaveGen = nullptr) {
+    auto t0 = chrono::steady_clock::now();
+    auto m = mapProjectFile(path);
+    if (!m) { err = "cannot open " + path; return false; }
+    ProjectHeader hdr;
+    if (m->size < sizeof(hdr)) { err = "file too small"; return false; }
+    memcpy(&hdr, m->data, sizeof(hdr));
+    if (memcmp(hdr.magic, PROJECT_MAGIC, 4) != 0) { err = "not a project file"; return false; }
+    if (hdr.version != PROJECT_VERSION) { err = "unsupported version " + intToString((int)hdr.version); return false; }
+    for (int i = 0; i < PS_COUNT; i++) {
+        if (hdr.offset[i] % 8 || hdr.offset[i] > m->size ||
+            hdr.count[i] > (m->size - hdr.offset[i]) / PROJECT_REC_SIZE[i]) { err = "corrupt section table"; return false; }
+    }
+    auto sec = [&](ProjectSection s) { return m->data + hdr.offset[s]; };
+    auto blockRecs   = (const ProjBlockRec*)sec(PS_BLOCKS);
+    auto inputRecs   = (const ProjInputRec*)sec(PS_INPUTS);
+    auto slotRecs    = (const ProjSlotRec*)sec(PS_SLOTS);
+    auto spriteRecs  = (const ProjSpriteRec*)sec(PS_SPRITES);
+    auto costumeRecs = (const ProjCostumeRec*)sec(PS_COSTUMES);
+    auto stringRecs  = (const ProjStringRec*)sec(PS_STRINGS);
+    auto stringBytes = (const char*)sec(PS_STRING_BYTES);
+    auto assetRecs   = (const ProjAssetRec*)sec(PS_ASSETS);
+    const Uint8* assetBytes = sec(PS_ASSET_BYTES);
+
+    bool ok = true;
+    auto S = [&](Sint32 i) -> string {
+        if (i < 0) return string();
+        if ((Uint64)i >= hdr.count[PS_STRINGS]) { ok = false; return string(); }
+        const ProjStringRec& r = stringRecs[i];
+        if ((Uint64)r.offset + r.length > hdr.count[PS_STRING_BYTES]) { ok = false; return string(); }
+        return string(stringBytes + r.offset, r.length);
+    };
+    auto A = [&](Sint32 i, const Uint8*& data, Uint32& size) {
+        data = nullptr; size = 0;
+        if (i < 0) return;
+        const ProjAssetRec* r = (Uint64)i < hdr.count[PS_ASSETS] ? &assetRecs[i] : nullptr;
+        if (!r || r->offset > hdr.count[PS_ASSET_BYTES] || r->size > hdr.count[PS_ASSET_BYTES] - r->offset ||
+            r->size > 0x7fffffff) { ok = false; return; }
+        data = assetBytes + r->offset; size = (Uint32)r->size;
+    };
+
+    vector<Block> nb;
+    nb.reserve(hdr.count[PS_BLOCKS]);
+    for (Uint64 i = 0; i < hdr.count[PS_BLOCKS] && ok; i++) {
+        const ProjBlockRec& r = blockRecs[i];
+        if ((Uint64)r.firstInput + r.numInputs > hdr.count[PS_INPUTS] ||
+            (Uint64)r.firstSlot + r.numSlots > hdr.count[PS_SLOTS] ||
+            r.numInputs > MAX_BLOCK_INPUTS || r.numSlots > MAX_BLOCK_SLOTS ||
+            r.cat >= NUM_CATEGORIES || r.shape > (Uint8)BlockShape::BOOLEAN) { ok = false; break; }
+        Block b;
+        b.id = r.id; b.cat = (Category)r.cat; b.shape = (BlockShape)r.shape; b.text = internLabel(S(r.text));
+        b.x = r.x; b.y = r.y; b.w = r.w; b.h = r.h;
+        b.inPalette = false;
+        b.nextBlockId = r.nextBlockId; b.parentBlockId = r.parentBlockId; b.childHeadId = r.childHeadId;
+        b.inputs.resize(r.numInputs);
+        for (Uint32 k = 0; k < r.numInputs; k++) {
+            const ProjInputRec& f = inputRecs[r.firstInput + k];
+            InputField& in = b.inputs[k];
+            in.value = S(f.value); in.defaultVal = internLabel(S(f.defaultVal));
+            in.relX = f.relX; in.relY = f.relY; in.width = f.width; in.height = f.height;
+            in.editing = false;
+        }
+        b.opSlots.resize(r.numSlots);
+        for (Uint32 k = 0; k < r.numSlots; k++) {
+            const ProjSlotRec& sr = slotRecs[r.firstSlot + k];
+            b.opSlots[k] = {sr.relX, sr.relY, sr.width, sr.height, sr.embeddedBlockId};
+        }
+        nb.push_back(move(b));
+    }
+
+    vector<Sprite> ns;
+    ns.reserve(hdr.count[PS_SPRITES]);
+    for (Uint64 i = 0; i < hdr.count[PS_SPRITES] && ok; i++) {
+        const ProjSpriteRec& r = spriteRecs[i];
+        if ((Uint64)r.firstCostume + r.numCostumes > hdr.count[PS_COSTUMES]) { ok = false; break; }
+        Sprite sp = createDefaultSprite("", r.x, r.y, {r.color[0], r.color[1], r.color[2], r.color[3]});
+        sp.name = S(r.name);
+        sp.direction = r.direction; sp.size = r.size; sp.visible = r.visible != 0;
+        sp.ghostEffect = r.ghostEffect; sp.colorEffect = r.colorEffect;
+        sp.currentCostume = r.currentCostume;
+        A(r.uploadedAsset, sp.uploadedAsset, sp.uploadedAssetSize);
+        sp.uploadedFile = S(r.uploadedFile);
+        sp.costumes.clear();
+        sp.costumes.reserve(r.numCostumes);
+        for (Uint32 k = 0; k < r.numCostumes; k++) {
+            const ProjCostumeRec& cr = costumeRecs[r.firstCostume + k];
+            if (cr.type > (Uint8)CostumeType::ARROW) { ok = false; break; }
+            Costume c;
+            c.name = S(cr.name); c.file = S(cr.file);
+            c.type = (CostumeType)cr.type; c.flippedH = cr.flippedH; c.flippedV = cr.flippedV;
+            c.primaryColor = {cr.primary[0], cr.primary[1], cr.primary[2], cr.primary[3]};
+            c.secondaryColor = {cr.secondary[0], cr.secondary[1], cr.secondary[2], cr.secondary[3]};
+            c.width = cr.width; c.height = cr.height;
+            A(cr.asset, c.assetData, c.assetSize);
+            sp.costumes.push_back(move(c));
+        }
+        ns.push_back(move(sp));
+    }
+    if (!ok) { err = "corrupt project data"; return false; }
+    if (!checkBlockLinks(nb, hdr.nextBlockId, err)) return false;
+    if (ns.empty()) ns.push_back(createDefaultSprite("Sprite1", 0, 0, {255,140,0,255}));
+
+    for (auto& sp : sprites) {
+        for (auto& c : sp.costumes) if (c.texture) SDL_DestroyTexture(c.texture);
+        if (sp.uploadedTexture) SDL_DestroyTexture(sp.uploadedTexture);
+    }
+    blocks = move(nb);
+    sprites = move(ns);
+    gProjectMap = m;
+    gProjectPath = path;
+    gNextBlockId = hdr.nextBlockId; gNextSpriteNum = hdr.nextSpriteNum;
+    gBgColor = (hdr.bgColor >= 0 && hdr.bgColor < NUM_BG_COLORS) ? hdr.bgColor : 0;
+    stopAllScripts(); resetBlockProfile(); gTimer = 0; gMyVariable = 0;
+    gEdit = {-1,-1,-1,false,"",0};
+    gAutosaveSnapshotWanted = true;
+    if (autosaveGen) *autosaveGen = hdr.autosaveGen;
+    float ms = chrono::duration<float, milli>(chrono::steady_clock::now() - t0).count();
+    cout << "Loaded " << path << " (" << hdr.count[PS_BLOCKS] << " blocks, " << sprites.size()
+         << " sprites, " << hdr.count[PS_ASSETS] << " images) in " << ms << " ms" << endl;
+    return true;
+}
+
+// Save + load round trip on a synthetic workspace (--bench-project [blocks]).
+static int runProjectBenchmark(int numBlocks) {
+    if (numBlocks < 1) numBlocks = 1;
+    L.update(BASE_WIDTH, BASE_HEIGHT);
+    ensurePaletteCatalog();
+    vector<Block> blocks;
+    for (int i = 0; i < numBlocks; i++) {
+        const Block& src = gPalette[i % gPalette.size()];
+        Block b = cloneBlock(src, (float)(i % 40) * 10, (float)(i / 40) * 30);
+        if (i % 20) { b.parentBlockId = blocks.back().id; blocks.back().nextBlockId = b.id; }
+        blocks.push_back(b);
+    }
+
+    resetCanvasMirror(0xFFFFFFFFu);
+    beginCanvasEdit();
+    vector<Sprite> sprites;
+    filesystem::create_directories("bench_project");
+    for (int i = 0; i < 24; i++) {
+        Sprite sp = createDefaultSprite(("Sprite" + intToString(i + 1)).c_str(), (float)i, 0, {255,140,0,255});
+        fillCanvasSpan(i * 10 % canvasH, 0, canvasW - 1, 0xFF000000u | (Uint32)(i * 0x1010100));
+        vector<Uint8> png;
+        encodePng(gCanvasPixels, canvasW, canvasH, png);
+        Costume c;
+        c.name = "painted";
+        c.file = "bench_project/costume" + intToString(i) + ".png";
+        writeFileAtomic(c.file, png);
+        sp.costumes.push_back(c);
+        sprites.push_back(sp);
+    }
+    gCanvasEdit.tiles.clear();
+
+    const string path = "bench_project/bench.sbp";
+    auto t0 = chrono::steady_clock::now();
+    if (!saveProject(path, blocks, sprites)) { printf("save failed\n"); return 1; }
+    double saveMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    vector<Block> lb;
+    vector<Sprite> ls;
+    string err;
+    t0 = chrono::steady_clock::now();
+    if (!loadProject(path, lb, ls, err)) { printf("load failed: %s\n", err.c_str()); return 1; }
+    double loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    size_t ws = lb.size();
+    printf("project %d blocks, %zu sprites: save %.2f ms, load %.2f ms, %zu bytes, %zu blocks back\n",
+           numBlocks, sprites.size(), saveMs, loadMs, (size_t)filesystem::file_size(path), ws);
+    return ws == (size_t)numBlocks ? 0 : 1;
+}
+
+// ════════════════════════════════════════════
+//  Autosave: edit journal + snapshots
+// ════════════════════════════════════════════
+// Edits mark blocks/sprites dirty or queue a clone/delete op. Once per frame,
+// when no drag is in progress, the dirty state is serialized into small
+// journal records and handed to a writer thread that appends them to
+// autosave/journal.bin, so the cost follows the edit, not the project size.
+// Records are [len][crc32][op][payload]; a torn tail after a crash fails its
+// check and is dropped. Structural changes (sprites added/removed/reordered,
+// costumes, reset, open) and a journal past AUTOSAVE_COMPACT_BYTES write a
+// fresh snapshot (project format, images by path) and restart the journal
+// under the next generation number. The UI thread only copies the project
+// for a snapshot; the writer thread builds the image. Startup loads the
+// snapshot and replays the journal when both carry the same generation.
+static const char*  AUTOSAVE_DIR = "autosave";
+static const size_t AUTOSAVE_COMPACT_BYTES = 256 * 1024;
+static const Uint32 JOURNAL_MAGIC = 0x4C4E524A;    // "JRNL"
+
+enum JournalOp : Uint8 { JOP_CLONE = 1, JOP_DELETE, JOP_BLOCK, JOP_SPRITE, JOP_STAGE };
+
+struct JournalJob {
+    bool snapshot;          // replace the snapshot and start a new journal
+    Sint32 gen;
+    vector<Uint8> bytes;
+    // snapshot: the project as it was, imaged on the writer thread
+    vector<Block> blocks;
+    vector<Sprite> sprites;
+    Sint32 nextBlockId = 0, nextSpriteNum = 0, bgColor = 0;
+    shared_ptr<ProjectMapping> map;     // keeps assetData pointers alive
+};
+
+static mutex gJournalMutex;
+static condition_variable gJournalCv;
+static deque<JournalJob> gJournalQueue;
+static thread gJournalThread;
+static bool gJournalQuit = false;
+static Sint32 gAutosaveGen = 0;
+static size_t gJournalBytes = 0;        // appended since the last snapshot
+static vector<Uint8> gJournalOps;       // clone/delete ops not yet flushed
+
+static void jPut(vector<Uint8>& out, const void* p, size_t n) {
+    out.insert(out.end(), (const Uint8*)p, (const Uint8*)p + n);
+}
+template <class T>
+static void jPutVal(vector<Uint8>& out, T v) { jPut(out, &v, sizeof(v)); }
+static void jPutStr(vector<Uint8>& out, const string& s) {
+    jPutVal(out, (Uint32)s.size());
+    jPut(out, s.data(), s.size());
+}
+
+static size_t journalBegin(vector<Uint8>& out, JournalOp op) {
+    size_t at = out.size();
+    out.resize(at + 8);
+    out.push_back(op);
+    return at;
+}
+static void journalEnd(vector<Uint8>& out, size_t at) {
+    Uint32 len = (Uint32)(out.size() - at - 8);
+    Uint32 crc = pngCrc32(out.data() + at + 8, len);
+    memcpy(&out[at], &len, 4);
+    memcpy(&out[at + 4], &crc, 4);
+}
+
+struct JournalReader {
+    const Uint8* p;
+    const Uint8* end;
+    bool ok = true;
+    template <class T> T get() {
+        T v{};
+        if (end - p < (ptrdiff_t)sizeof(T)) { ok = false; return v; }
+        memcpy(&v, p, sizeof(T)); p += sizeof(T);
+        return v;
+    }
+    string str() {
+        Uint32 n = get<Uint32>();
+        if (!ok || (size_t)(end - p) < n) { ok = false; return string(); }
+        string s((const char*)p, n); p += n;
+        return s;
+    }
+};
+
+static void journalClone(int srcId, int newId) {
+    size_t at = journalBegin(gJournalOps, JOP_CLONE);
+    jPutVal(gJournalOps, (Sint32)srcId);
+    jPutVal(gJournalOps, (Sint32)newId);
+    journalEnd(gJournalOps, at);
+    gDirtyBlocks.insert(newId);
+}
+
+static void journalDelete(int id) {
+    size_t at = journalBegin(gJournalOps, JOP_DELETE);
+    jPutVal(gJournalOps, (Sint32)id);
+    journalEnd(gJournalOps, at);
+    gDirtyBlocks.erase(id);
+}
+
+static void journalBlockState(vector<Uint8>& out, const Block& b) {
+    size_t at = journalBegin(out, JOP_BLOCK);
+    jPutVal(out, (Sint32)b.id);
+    jPutVal(out, b.x); jPutVal(out, b.y); jPutVal(out, b.w); jPutVal(out, b.h);
+    jPutVal(out, (Sint32)b.nextBlockId); jPutVal(out, (Sint32)b.parentBlockId); jPutVal(out, (Sint32)b.childHeadId);
+    jPutVal(out, (Uint32)b.inputs.size());
+    for (auto& f : b.inputs) jPutStr(out, f.value);
+    jPutVal(out, (Uint32)b.opSlots.size());
+    for (auto& sl : b.opSlots) jPutVal(out, (Sint32)sl.embeddedBlockId);
+    journalEnd(out, at);
+}
+
+static void journalSpriteState(vector<Uint8>& out, int idx, const Sprite& sp) {
+    size_t at = journalBegin(out, JOP_SPRITE);
+    jPutVal(out, (Uint32)idx);
+    jPutStr(out, sp.name);
+    jPutVal(out, sp.x); jPutVal(out, sp.y); jPutVal(out, sp.direction); jPutVal(out, sp.size);
+    jPutVal(out, sp.ghostEffect); jPutVal(out, sp.colorEffect);
+    jPutVal(out, (Uint8)sp.visible);
+    jPutVal(out, (Sint32)sp.currentCostume);
+    jPutStr(out, sp.uploadedFile);
+    journalEnd(out, at);
+}
+
+static void journalStage() {
+    size_t at = journalBegin(gJournalOps, JOP_STAGE);
+    jPutVal(gJournalOps, (Sint32)gBgColor);
+    journalEnd(gJournalOps, at);
+}
+
+static void autosaveWorker() {
+    FILE* journal = nullptr;
+    string snapPath = string(AUTOSAVE_DIR) + "/snapshot.sbp", jrnlPath = string(AUTOSAVE_DIR) + "/journal.bin";
+    for (;;) {
+        JournalJob job;
+        {
+            unique_lock<mutex> lk(gJournalMutex);
+            gJournalCv.wait(lk, []{ return gJournalQuit || !gJournalQueue.empty(); });
+            if (gJournalQueue.empty()) break;
+            job = move(gJournalQueue.front());
+            gJournalQueue.pop_front();
+        }
+        if (job.snapshot) {
+            if (journal) { fclose(journal); journal = nullptr; }
+            error_code ec;
+            filesystem::create_directories(AUTOSAVE_DIR, ec);
+            // Snapshot first: if we die before the new journal exists, the old
+            // journal's generation no longer matches and is ignored.
+            buildProjectImage(job.blocks, job.sprites, false, job.gen, job.nextBlockId,
+                              job.nextSpriteNum, job.bgColor, job.bytes);
+            vector<Uint8> hdr;
+            jPutVal(hdr, JOURNAL_MAGIC); jPutVal(hdr, job.gen);
+            if (!writeFileAtomic(snapPath, job.bytes) || !writeFileAtomic(jrnlPath, hdr)) {
+                cout << "Autosave: snapshot failed" << endl;
+                continue;
+            }
+            journal = fopen(jrnlPath.c_str(), "ab");
+        } else if (journal) {
+            fwrite(job.bytes.data(), 1, job.bytes.size(), journal);
+            fflush(journal);
+        }
+    }
+    if (journal) fclose(journal);
+}
+
+static void queueAutosaveJob(JournalJob job) {
+    {
+        lock_guard<mutex> lk(gJournalMutex);
+        if (!gJournalThread.joinable()) { gJournalQuit = false; gJournalThread = thread(autosaveWorker); }
+        gJournalQueue.push_back(move(job));
+    }
+    gJournalCv.notify_one();
+}
+
+// Called once per frame outside drags.
+static void flushAutosave(vector<Block>& blocks, const vector<Sprite>& sprites) {
+    if (gAutosaveSnapshotWanted || gJournalBytes > AUTOSAVE_COMPACT_BYTES) {
+        JournalJob job{true, ++gAutosaveGen, {}, blocks, sprites, gNextBlockId, gNextSpriteNum, gBgColor, gProjectMap};
+        queueAutosaveJob(move(job));
+        gAutosaveSnapshotWanted = false;
+        gJournalBytes = 0;
+        gJournalOps.clear(); gDirtyBlocks.clear(); gDirtySprites.clear();
+        return;
+    }
+    if (gJournalOps.empty() && gDirtyBlocks.empty() && gDirtySprites.empty()) return;
+    JournalJob job;
+    job.snapshot = false; job.gen = gAutosaveGen; job.bytes = move(gJournalOps);
+    gJournalOps.clear();
+    vector<int> ids(gDirtyBlocks.begin(), gDirtyBlocks.end());
+    sort(ids.begin(), ids.end());
+    for (int id : ids)
+        if (Block* b = findBlock(blocks, id)) journalBlockState(job.bytes, *b);
+    for (int idx : gDirtySprites)
+        if (idx >= 0 && idx < (int)sprites.size()) journalSpriteState(job.bytes, idx, sprites[idx]);
+    gDirtyBlocks.clear(); gDirtySprites.clear();
+    gJournalBytes += job.bytes.size();
+    if (!job.bytes.empty()) queueAutosaveJob(move(job));
+}
+
+// Recording and replay sessions don't autosave; the frame's dirty state is
+// dropped instead, once undo and search have seen it.
+static void discardAutosaveChanges() {
+    gAutosaveSnapshotWanted = false;
+    gJournalOps.clear(); gDirtyBlocks.clear(); gDirtySprites.clear();
+}
+
+static void stopAutosaveWorker() {
+    {
+        lock_guard<mutex> lk(gJournalMutex);
+        gJournalQuit = true;
+    }
+    gJournalCv.notify_one();
+    if (gJournalThread.joinable()) gJournalThread.join();
+}
+
+static bool applyJournalRecord(JournalOp op, JournalReader& r, vector<Block>& blocks, vector<Sprite>& sprites) {
+    if (op == JOP_CLONE) {
+        int srcId = r.get<Sint32>(), newId = r.get<Sint32>();
+        const Block* src = paletteBlock(srcId);
+        if (!r.ok || !src) return false;
+        if (findBlock(blocks, newId)) return true;
+        int saved = gNextBlockId;
+        gNextBlockId = newId;
+        Block nb = cloneBlock(*src, 0, 0);
+        gNextBlockId = max(saved, newId + 1);
+        blocks.push_back(nb);
+    } else if (op == JOP_DELETE) {
+        int id = r.get<Sint32>();
+        if (!r.ok) return false;
+        blocks.erase(remove_if(blocks.begin(), blocks.end(), [&](const Block& b){ return b.id == id; }), blocks.end());
+    } else if (op == JOP_BLOCK) {
+        int id = r.get<Sint32>();
+        float x = r.get<float>(), y = r.get<float>(), w = r.get<float>(), h = r.get<float>();
+        int next = r.get<Sint32>(), parent = r.get<Sint32>(), child = r.get<Sint32>();
+        vector<string> values(r.get<Uint32>() & 0xFFFF);
+        for (auto& v : values) v = r.str();
+        vector<int> embedded(r.get<Uint32>() & 0xFFFF);
+        for (auto& e : embedded) e = r.get<Sint32>();
+        if (!r.ok) return false;
+        Block* b = findBlock(blocks, id);
+        if (!b) return true;
+        b->x = x; b->y = y; b->w = w; b->h = h;
+        b->nextBlockId = next; b->parentBlockId = parent; b->childHeadId = child;
+        for (size_t i = 0; i < values.size() && i < b->inputs.size(); i++) b->inputs[i].value = values[i];
+        for (size_t i = 0; i < embedded.size() && i < b->opSlots.size(); i++) b->opSlots[i].embeddedBlockId = embedded[i];
+    } else if (op == JOP_SPRITE) {
+        Uint32 idx = r.get<Uint32>();
+        string name = r.str();
+        float x = r.get<float>(), y = r.get<float>(), dir = r.get<float>(), size = r.get<float>();
+        float ghost = r.get<float>(), colorEff = r.get<float>();
+        bool visible = r.get<Uint8>() != 0;
+        int costume = r.get<Sint32>();
+        string uploaded = r.str();
+        if (!r.ok) return false;
+        if (idx >= sprites.size()) return true;
+        Sprite& sp = sprites[idx];
+        sp.name = name; sp.x = x; sp.y = y; sp.direction = dir; sp.size = size;
+        sp.ghostEffect = ghost; sp.colorEffect = colorEff; sp.visible = visible;
+        sp.currentCostume = costume;
+        if (sp.uploadedFile != uploaded) {
+            if (sp.uploadedTexture) { SDL_DestroyTexture(sp.uploadedTexture); sp.uploadedTexture = nullptr; }
+            sp.uploadedFile = uploaded;
+            sp.uploadedAsset = nullptr; sp.uploadedAssetSize = 0; sp.uploadedMissing = false;
+        }
+    } else if (op == JOP_STAGE) {
+        int bg = r.get<Sint32>();
+        if (!r.ok) return false;
+        if (bg >= 0 && bg < NUM_BG_COLORS) gBgColor = bg;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Restores the last session from autosave/; returns false if there is none.
+static bool restoreAutosave(vector<Block>& blocks, vector<Sprite>& sprites) {
+    string snapPath = string(AUTOSAVE_DIR) + "/snapshot.sbp", jrnlPath = string(AUTOSAVE_DIR) + "/journal.bin";
+    error_code ec;
+    if (!filesystem::exists(snapPath, ec)) return false;
+    string err;
+    Sint32 gen = 0;
+    if (!loadProject(snapPath, blocks, sprites, err, &gen)) { cout << "Autosave: " << err << endl; return false; }
+    gProjectPath.clear();
+    gAutosaveGen = gen;
+
+    ifstream in(jrnlPath, ios::binary);
+    vector<Uint8> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    int applied = 0;
+    Uint32 magic = 0; Sint32 jgen = -1;
+    if (data.size() >= 8) { memcpy(&magic, data.data(), 4); memcpy(&jgen, data.data() + 4, 4); }
+    if (magic == JOURNAL_MAGIC && jgen == gen) {
+        size_t pos = 8;
+        while (pos + 9 <= data.size()) {
+            Uint32 len, crc;
+            memcpy(&len, &data[pos], 4); memcpy(&crc, &data[pos + 4], 4);
+            if (len == 0 || len > data.size() - pos - 8) break;
+            if (pngCrc32(&data[pos + 8], len) != crc) break;
+            JournalReader r{&data[pos + 9], &data[pos + 8 + len]};
+            if (!applyJournalRecord((JournalOp)data[pos + 8], r, blocks, sprites)) break;
+            pos += 8 + len;
+            applied++;
+        }
+    }
+    cout << "Autosave: restored snapshot + " << applied << " journal edits" << endl;
+    gAutosaveSnapshotWanted = true;     // fold the journal into a new snapshot
+    return true;
+}
+
+// --check-autosave: opens a project whose images exist only inside the
+// .sbp, writes an autosave snapshot of it plus a journaled stage colour and
+// restores both. Fails unless every image comes back byte for byte. Runs
+// headless in a scratch directory under the system temp dir.
+static int runAutosaveRestoreCheck() {
+    error_code ec;
+    filesystem::path dir = filesystem::temp_directory_path(ec) / "scratch_autosave_check";
+    filesystem::remove_all(dir, ec);
+    filesystem::create_directories(dir, ec);
+    if (!ec) filesystem::current_path(dir, ec);
+    if (ec) { printf("autosave check: cannot use %s\n", dir.string().c_str()); return 1; }
+    L.update(BASE_WIDTH, BASE_HEIGHT);
+
+    // save with the images on disk, then delete them: the project is all that's left
+    vector<vector<Uint8>> images(3);
+    vector<Sprite> sprites;
+    for (int i = 0; i < 2; i++) {
+        Sprite sp = createDefaultSprite(("Sprite" + intToString(i + 1)).c_str(), (float)i * 20, 0, {255,140,0,255});
+        vector<Uint32> px(16 * 16, 0xFF0000FFu ^ (Uint32)(i * 0x00FF0000));
+        encodePng(px, 16, 16, images[i]);
+        Costume c;
+        c.name = "embedded";
+        c.file = "costume" + intToString(i) + ".png";
+        writeFileAtomic(c.file, images[i]);
+        sp.costumes.push_back(c);
+        sprites.push_back(sp);
+    }
+    encodePng(vector<Uint32>(8 * 8, 0x00FF00FFu), 8, 8, images[2]);
+    sprites[0].uploadedFile = "upload.png";
+    writeFileAtomic(sprites[0].uploadedFile, images[2]);
+    vector<Block> blocks;
+    if (!saveProject("check.sbp", blocks, sprites)) { printf("autosave check: save failed\n"); return 1; }
+    for (const char* f : {"costume0.png", "costume1.png", "upload.png"}) filesystem::remove(f, ec);
+
+    string err;
+    sprites.clear();
+    if (!loadProject("check.sbp", blocks, sprites, err)) { printf("autosave check: %s\n", err.c_str()); return 1; }
+    gAutosaveSnapshotWanted = true;
+    flushAutosave(blocks, sprites);
+    gBgColor = 3;                       // journaled on top of the snapshot
+    journalStage();
+    flushAutosave(blocks, sprites);
+    stopAutosaveWorker();
+    gBgColor = 0;
+
+    vector<Block> rb;
+    vector<Sprite> rs;
+    if (!restoreAutosave(rb, rs)) { printf("autosave check: no snapshot to restore\n"); return 1; }
+    auto same = [](const Uint8* data, Uint32 size, const vector<Uint8>& want) {
+        return data && size == want.size() && memcmp(data, want.data(), size) == 0;
+    };
+    int bad = 0;
+    if (rs.size() != 2) bad++;
+    for (int i = 0; i < (int)rs.size() && i < 2; i++) {
+        const Costume& c = rs[i].costumes.back();
+        if (!same(c.assetData, c.assetSize, images[i])) { printf("autosave check: costume of %s lost\n", rs[i].name.c_str()); bad++; }
+    }
+    if (rs.empty() || !same(rs[0].uploadedAsset, rs[0].uploadedAssetSize, images[2])) { printf("autosave check: uploaded image lost\n"); bad++; }
+    if (gBgColor != 3) { printf("autosave check: stage colour lost\n"); bad++; }
+    printf("autosave check: %s\n", bad ? "FAILED" : "3 embedded images restored");
+    return bad ? 1 : 0;
+}
+
+// --check-load: saves a small linked script, checks it loads, then saves
+// broken copies (duplicate id, dangling links, a next cycle, a stale next
+// block id) and checks that each one is refused with an error.
+static int runLoadRejectCheck() {
+    error_code ec;
+    filesystem::path dir = filesystem::temp_directory_path(ec) / "scratch_load_check";
+    filesystem::remove_all(dir, ec);
+    filesystem::create_directories(dir, ec);
+    if (!ec) filesystem::current_path(dir, ec);
+    if (ec) { printf("load check: cannot use %s\n", dir.string().c_str()); return 1; }
+    L.update(BASE_WIDTH, BASE_HEIGHT);
+    ensurePaletteCatalog();
+
+    vector<Block> good;
+    gNextBlockId = 1000;
+    for (int i = 0; i < 4; i++) good.push_back(cloneBlock(gPalette[i % gPalette.size()], 0, (float)i * 40));
+    for (int i = 0; i + 1 < 4; i++) { good[i].nextBlockId = good[i + 1].id; good[i + 1].parentBlockId = good[i].id; }
+    vector<Sprite> sprites(1, createDefaultSprite("Sprite1", 0, 0, {255,140,0,255}));
+    int nextId = gNextBlockId;
+
+    auto loads = [&](const vector<Block>& blocks, int nextBlockId, string& err) {
+        gNextBlockId = nextBlockId;
+        if (!saveProject("check.sbp", blocks, sprites)) { err = "save failed"; return true; }
+        vector<Block> lb;
+        vector<Sprite> ls;
+        return loadProject("check.sbp", lb, ls, err);
+    };
+    int bad = 0;
+    string err;
+    if (!loads(good, nextId, err)) { printf("load check: valid project refused: %s\n", err.c_str()); bad++; }
+
+    struct Case { const char* name; function<void(vector<Block>&, int&)> breakIt; };
+    const Case cases[] = {
+        {"duplicate id",     [](vector<Block>& b, int&) { b[3].id = b[2].id; b[2].nextBlockId = -1; }},
+        {"dangling next",    [](vector<Block>& b, int&) { b[3].nextBlockId = 999999; }},
+        {"dangling parent",  [](vector<Block>& b, int&) { b[0].parentBlockId = 999999; }},
+        {"dangling child",   [](vector<Block>& b, int&) { b[1].childHeadId = 999999; }},
+        {"next cycle",       [](vector<Block>& b, int&) { b[3].nextBlockId = b[1].id; }},
+        {"self link",        [](vector<Block>& b, int&) { b[2].childHeadId = b[2].id; }},
+        {"stale next id",    [](vector<Block>& b, int& n) { n = b[3].id; }},
+    };
+    for (auto& c : cases) {
+        vector<Block> blocks = good;
+        int n = nextId;
+        c.breakIt(blocks, n);
+        err.clear();
+        if (loads(blocks, n, err)) { printf("load check: %s accepted\n", c.name); bad++; }
+        else printf("load check: %s refused (%s)\n", c.name, err.c_str());
+    }
+    printf("load check: %s\n", bad ? "FAILED" : "all broken files refused");
+    return bad ? 1 : 0;
+}
+
+// ════════════════════════════════════════════
+//  Undo / redo
+// ════════════════════════════════════════════
+// History keeps one shadow copy of the project, as of the last step, plus a
+// list of steps. A step holds the before/after state of only the blocks and
+// sprites an edit changed, so memory follows the edits rather than the
+// project size times the history depth. Steps are cut once per frame, at
+// the same point autosave flushes. The ids to compare come from the dirty
+// set and the queued clone/delete records. Reset, open and other changes
+// that only ask for a snapshot are diffed in full. Undo and redo apply one
+// step's records, journal them like any other edit and move the shadow
+// along, so the next diff finds nothing new. Typing into one input field
+// folds into a single step. Whatever a script tick changes on a sprite goes
+// straight into the shadow: running a project is not an edit. A texture an
+// edit replaces belongs to that edit's step and is freed with it.
+static const size_t UNDO_MAX_STEPS = 500;
+
+struct BlockChange {
+    int id;
+    bool hadBefore, hasAfter;    // false: the block didn't exist
+    Block before, after;
+};
+struct SpriteChange {
+    int idx;
+    Sprite before, after;
+};
+struct UndoStep {
+    vector<BlockChange> blocks;
+    vector<SpriteChange> sprites;            // by index, list length unchanged
+    bool spriteList = false;                 // sprites added/removed: whole lists
+    vector<Sprite> spritesBefore, spritesAfter;
+    int bgBefore = 0, bgAfter = 0;
+    int typing = -1;                         // block whose input was being typed into
+    vector<SDL_Texture*> retired;            // replaced by this step; its before-state shows them
+};
+struct UndoHistory {
+    deque<UndoStep> steps;
+    size_t cursor = 0;                       // steps[0, cursor) are applied
+    bool primed = false;
+    vector<Block> blocks;                    // shadow, sorted by id
+    vector<Sprite> sprites;
+    int bg = 0;
+    vector<SDL_Texture*> retired;            // replaced since the last step was cut
+};
+static UndoHistory gUndo;
+
+static void spriteTextures(const Sprite& sp, vector<SDL_Texture*>& out) {
+    if (sp.uploadedTexture) out.push_back(sp.uploadedTexture);
+    for (auto& c : sp.costumes) if (c.texture) out.push_back(c.texture);
+}
+
+static void stepTextures(const UndoStep& st, bool after, vector<SDL_Texture*>& out) {
+    for (auto& sp : after ? st.spritesAfter : st.spritesBefore) spriteTextures(sp, out);
+    for (auto& c : st.sprites) spriteTextures(after ? c.after : c.before, out);
+}
+
+// Frees what only the dropped step can still show: for an applied step the
+// textures it replaced, for an undone one the textures it brought in.
+static void dropUndoStep(const UndoStep& st, bool applied) {
+    if (applied) { for (SDL_Texture* t : st.retired) SDL_DestroyTexture(t); return; }
+    vector<SDL_Texture*> before, after;
+    stepTextures(st, false, before);
+    stepTextures(st, true, after);
+    sort(before.begin(), before.end());
+    sort(after.begin(), after.end());
+    after.erase(unique(after.begin(), after.end()), after.end());
+    for (SDL_Texture* t : after) if (!binary_search(before.begin(), before.end(), t)) SDL_DestroyTexture(t);
+}
+
+static void clearUndoHistory() {
+    for (size_t i = 0; i < gUndo.steps.size(); i++) dropUndoStep(gUndo.steps[i], i < gUndo.cursor);
+    for (SDL_Texture* t : gUndo.retired) SDL_DestroyTexture(t);
+    gUndo = UndoHistory{};
+}
+
+// Textures replaced by an edit stay alive while history can bring them back.
+static void retireTexture(SDL_Texture* t) {
+    if (!t) return;
+    if (!gUndo.primed) SDL_DestroyTexture(t);
+    else gUndo.retired.push_back(t);
+}
+
+// Sprite fields the script engine writes, compared around one tick.
+struct SpriteMotion {
+    float x, y, direction, size, ghost, color;
+    bool visible;
+    int costume;
+    bool operator!=(const SpriteMotion& o) const {
+        return x != o.x || y != o.y || direction != o.direction || size != o.size || ghost != o.ghost ||
+               color != o.color || visible != o.visible || costume != o.costume;
+    }
+};
+static vector<SpriteMotion> gTickMotion;
+
+static SpriteMotion spriteMotion(const Sprite& sp) {
+    return {sp.x, sp.y, sp.direction, sp.size, sp.ghostEffect, sp.colorEffect, sp.visible, sp.currentCostume};
+}
+
+static void beginScriptTickUndo(const vector<Sprite>& sprites) {
+    gTickMotion.clear();
+    for (auto& sp : sprites) gTickMotion.push_back(spriteMotion(sp));
+}
+
+// Copies what the tick changed into the shadow, so the next step doesn't record it.
+// Only fields the tick changed, and only where the shadow still matches the
+// value before the tick: a user edit not yet recorded (info panel, a sprite
+// drag in progress) stays in the shadow's diff and becomes its own step.
+static void endScriptTickUndo(const vector<Sprite>& sprites) {
+    UndoHistory& H = gUndo;
+    if (!H.primed || sprites.size() != H.sprites.size() || sprites.size() != gTickMotion.size()) return;
+    for (size_t i = 0; i < sprites.size(); i++) {
+        const Sprite& sp = sprites[i];
+        const SpriteMotion& was = gTickMotion[i];
+        if (!(spriteMotion(sp) != was)) continue;
+        Sprite& sh = H.sprites[i];
+        auto take = [](auto& shadow, auto before, auto after) { if (after != before && shadow == before) shadow = after; };
+        take(sh.x, was.x, sp.x); take(sh.y, was.y, sp.y);
+        take(sh.direction, was.direction, sp.direction); take(sh.size, was.size, sp.size);
+        take(sh.ghostEffect, was.ghost, sp.ghostEffect); take(sh.colorEffect, was.color, sp.colorEffect);
+        take(sh.visible, was.visible, sp.visible); take(sh.currentCostume, was.costume, sp.currentCostume);
+    }
+}
+
+static bool sameBlockState(const Block& a, const Block& b) {
+    if (a.text != b.text || a.x != b.x || a.y != b.y || a.w != b.w || a.h != b.h ||
+        a.nextBlockId != b.nextBlockId || a.parentBlockId != b.parentBlockId || a.childHeadId != b.childHeadId ||
+        a.inputs.size() != b.inputs.size() || a.opSlots.size() != b.opSlots.size()) return false;
+    for (size_t i = 0; i < a.inputs.size(); i++) if (a.inputs[i].value != b.inputs[i].value) return false;
+    for (size_t i = 0; i < a.opSlots.size(); i++) if (a.opSlots[i].embeddedBlockId != b.opSlots[i].embeddedBlockId) return false;
+    return true;
+}
+
+// The fields a project saves; runtime state (speech, pen, selection) is not history.
+static bool sameSpriteState(const Sprite& a, const Sprite& b) {
+    return a.name == b.name && a.x == b.x && a.y == b.y && a.direction == b.direction && a.size == b.size &&
+           a.ghostEffect == b.ghostEffect && a.colorEffect == b.colorEffect && a.visible == b.visible &&
+           a.currentCostume == b.currentCostume && a.uploadedTexture == b.uploadedTexture &&
+           a.uploadedFile == b.uploadedFile && a.costumes.size() == b.costumes.size();
+}
+
+static Block* shadowBlock(int id) {
+    auto& v = gUndo.blocks;
+    auto it = lower_bound(v.begin(), v.end(), id, [](const Block& b, int v) { return b.id < v; });
+    return it != v.end() && it->id == id ? &*it : nullptr;
+}
+
+// Sets block `id` in v to *b (inserting in id order) or removes it if b is null.
+static void putBlock(vector<Block>& v, int id, const Block* b) {
+    Block* cur = findBlock(v, id);
+    if (cur && b) { *cur = *b; return; }
+    if (cur) { v.erase(v.begin() + (cur - v.data())); return; }
+    if (!b) return;
+    auto it = lower_bound(v.begin(), v.end(), id, [](const Block& x, int v) { return x.id < v; });
+    v.insert(it, *b);
+}
+
+static void addBlockChange(UndoStep& st, int id, const Block* was, const Block* now) {
+    if (!was && !now) return;
+    if (was && now && sameBlockState(*was, *now)) return;
+    BlockChange c{id, was != nullptr, now != nullptr, {}, {}};
+    if (was) c.before = *was;
+    if (now) c.after = *now;
+    st.blocks.push_back(move(c));
+}
+
+// Block ids named by the queued clone/delete records.
+static void journalOpIds(const vector<Uint8>& ops, vector<int>& out) {
+    for (size_t pos = 0; pos + 9 <= ops.size();) {
+        Uint32 len;
+        memcpy(&len, &ops[pos], 4);
+        JournalReader r{&ops[pos + 9], &ops[pos + 8 + len]};
+        if (ops[pos + 8] == JOP_CLONE) { r.get<Sint32>(); out.push_back(r.get<Sint32>()); }
+        else if (ops[pos + 8] == JOP_DELETE) out.push_back(r.get<Sint32>());
+        pos += 8 + len;
+    }
+}
+
+// Blocks edited since the last flush (dirty set plus clone/delete records), sorted.
+static vector<int> touchedBlockIds() {
+    vector<int> ids(gDirtyBlocks.begin(), gDirtyBlocks.end());
+    journalOpIds(gJournalOps, ids);
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+// Turns whatever changed since the last call into a history step. Called
+// once per frame outside drags, before flushAutosave clears the dirty state.
+static void recordUndoStep(vector<Block>& blocks, const vector<Sprite>& sprites, int typing) {
+    UndoHistory& H = gUndo;
+    if (!H.primed) {
+        H.blocks = blocks;
+        sort(H.blocks.begin(), H.blocks.end(), [](const Block& a, const Block& b) { return a.id < b.id; });
+        H.sprites = sprites; H.bg = gBgColor; H.primed = true;
+        return;
+    }
+    UndoStep st;
+    if (gAutosaveSnapshotWanted) {
+        vector<const Block*> cur;
+        cur.reserve(blocks.size());
+        for (auto& b : blocks) cur.push_back(&b);
+        sort(cur.begin(), cur.end(), [](const Block* a, const Block* b) { return a->id < b->id; });
+        size_t i = 0, j = 0;
+        while (i < H.blocks.size() || j < cur.size()) {
+            if (j == cur.size() || (i < H.blocks.size() && H.blocks[i].id < cur[j]->id)) { addBlockChange(st, H.blocks[i].id, &H.blocks[i], nullptr); i++; }
+            else if (i == H.blocks.size() || cur[j]->id < H.blocks[i].id) { addBlockChange(st, cur[j]->id, nullptr, cur[j]); j++; }
+            else { addBlockChange(st, cur[j]->id, &H.blocks[i], cur[j]); i++; j++; }
+        }
+    } else {
+        for (int id : touchedBlockIds()) addBlockChange(st, id, shadowBlock(id), findBlock(blocks, id));
+    }
+    if (sprites.size() != H.sprites.size()) {
+        st.spriteList = true;
+        st.spritesBefore = H.sprites; st.spritesAfter = sprites;
+    } else {
+        auto check = [&](int i) {
+            if (i >= 0 && i < (int)sprites.size() && !sameSpriteState(H.sprites[i], sprites[i]))
+                st.sprites.push_back({i, H.sprites[i], sprites[i]});
+        };
+        if (gAutosaveSnapshotWanted) for (int i = 0; i < (int)sprites.size(); i++) check(i);
+        else for (int i : gDirtySprites) check(i);
+    }
+    st.bgBefore = H.bg; st.bgAfter = gBgColor;
+    if (st.blocks.empty() && st.sprites.empty() && !st.spriteList && st.bgBefore == st.bgAfter) {
+        for (SDL_Texture* t : H.retired) SDL_DestroyTexture(t);
+        H.retired.clear();
+        return;
+    }
+    st.retired.swap(H.retired);
+
+    for (auto& c : st.blocks) putBlock(H.blocks, c.id, c.hasAfter ? &c.after : nullptr);
+    if (st.spriteList) H.sprites = sprites;
+    else for (auto& c : st.sprites) H.sprites[c.idx] = c.after;
+    H.bg = gBgColor;
+
+    for (size_t i = H.cursor; i < H.steps.size(); i++) dropUndoStep(H.steps[i], false);
+    H.steps.resize(H.cursor);
+    UndoStep* top = H.steps.empty() ? nullptr : &H.steps.back();
+    bool fold = typing >= 0 && top && top->typing == typing && !st.spriteList && st.sprites.empty() &&
+                st.bgBefore == st.bgAfter && st.blocks.size() == 1 && st.blocks[0].id == typing &&
+                top->blocks.size() == 1 && top->blocks[0].id == typing;
+    if (fold) {
+        top->blocks[0].after = st.blocks[0].after;
+        top->retired.insert(top->retired.end(), st.retired.begin(), st.retired.end());
+        return;
+    }
+    st.typing = typing;
+    H.steps.push_back(move(st));
+    if (H.steps.size() > UNDO_MAX_STEPS) { dropUndoStep(H.steps.front(), true); H.steps.pop_front(); }
+    H.cursor = H.steps.size();
+}
+
+static void applyUndoStep(vector<Block>& blocks, vector<Sprite>& sprites, const UndoStep& st, bool redo) {
+    UndoHistory& H = gUndo;
+    for (auto& c : st.blocks) {
+        const Block* target = redo ? (c.hasAfter ? &c.after : nullptr) : (c.hadBefore ? &c.before : nullptr);
+        bool existed = findBlock(blocks, c.id) != nullptr;
+        putBlock(blocks, c.id, target);
+        putBlock(H.blocks, c.id, target);
+        if (!target) { if (existed) journalDelete(c.id); continue; }
+        if (!existed) {
+            int proto = paletteSourceId(*target);
+            if (proto >= 0) journalClone(proto, c.id);
+            else gAutosaveSnapshotWanted = true;
+            gNextBlockId = max(gNextBlockId, c.id + 1);
+        }
+        gDirtyBlocks.insert(c.id);
+    }
+    if (st.spriteList) {
+        sprites = redo ? st.spritesAfter : st.spritesBefore;
+        remapTweenSprites({});
+        gAutosaveSnapshotWanted = true;
+    } else {
+        for (auto& c : st.sprites) {
+            if (c.idx >= (int)sprites.size()) continue;
+            const Sprite& target = redo ? c.after : c.before;
+            if (target.costumes.size() != sprites[c.idx].costumes.size()) gAutosaveSnapshotWanted = true;
+            sprites[c.idx] = target;
+            gDirtySprites.insert(c.idx);
+        }
+    }
+    int bg = redo ? st.bgAfter : st.bgBefore;
+    if (bg != gBgColor) { gBgColor = bg; journalStage(); }
+    H.sprites = sprites;
+    H.bg = gBgColor;
+}
+
+// Both return false when there is nothing to undo/redo.
+static bool undoEdit(vector<Block>& blocks, vector<Sprite>& sprites) {
+    recordUndoStep(blocks, sprites, -1);     // an edit from this frame is its own step
+    if (gUndo.cursor == 0) return false;
+    applyUndoStep(blocks, sprites, gUndo.steps[--gUndo.cursor], false);
+    return true;
+}
+
+static bool redoEdit(vector<Block>& blocks, vector<Sprite>& sprites) {
+    recordUndoStep(blocks, sprites, -1);
+    if (gUndo.cursor >= gUndo.steps.size()) return false;
+    applyUndoStep(blocks, sprites, gUndo.steps[gUndo.cursor++], true);
+    return true;
+}
+
+// ════════════════════════════════════════════
+//  Workspace search
+// ════════════════════════════════════════════
+// A block's search text is its label with the input values put where the
+// block shows them, so "go to x: 0 y: 0" finds what it says. The text is
+// lowercased and its whitespace collapsed. A trigram index maps every
+// 3-byte window to the sorted ids of the blocks that contain it. A query
+// takes the posting list of its rarest trigram and checks only those
+// blocks, so its cost follows the matches rather than the workspace.
+// Queries shorter than three bytes scan the texts. The index is built by
+// the first search. After that it is kept current once per frame from the
+// dirty state undo and autosave use, and a change that only asks for a
+// snapshot rebuilds it.
+struct SearchIndex {
+    bool built = false;
+    unordered_map<int, string> text;             // block id -> search text
+    unordered_map<Uint32, vector<int>> grams;    // trigram -> sorted ids
+};
+static SearchIndex gSearch;
+
+// The search box over the workspace (Ctrl+F).
+struct FindBox {
+    bool open = false;
+    string query;
+    vector<int> hits;                            // sorted ids
+    int cur = -1;                                // hit the camera was sent to
+};
+static FindBox gFind;
+
+static void normalizeSearchText(const string& s, string& out) {
+    bool space = true;
+    for (char ch : s) {
+        unsigned char c = (unsigned char)ch;
+        if (isspace(c)) { space = true; continue; }
+        if (space && !out.empty()) out += ' ';
+        space = false;
+        out += c < 128 ? (char)tolower(c) : ch;
+    }
+}
+
+// A label leaves a double space for each input ("go to x:  y: "); inputs
+// left over after those sit at the end ("say ").
+static string blockSearchText(const Block& b) {
+    const string& label = *b.text;
+    string shown;
+    size_t in = 0;
+    for (size_t i = 0; i < label.size(); i++) {
+        shown += label[i];
+        if (label[i] == ' ' && i + 1 < label.size() && label[i + 1] == ' ' && in < b.inputs.size())
+            shown += b.inputs[in++].value;
+    }
+    for (; in < b.inputs.size(); in++) { shown += ' '; shown += b.inputs[in].value; }
+    string t;
+    normalizeSearchText(shown, t);
+    // the variable blocks all act on the one project variable
+    if (b.cat == Category::VARIABLES && t != "my variable") t += " my variable";
+    return t;
+}
+
+static Uint32 trigramKey(const char* p) { return (Uint32)(Uint8)p[0] | (Uint32)(Uint8)p[1] << 8 | (Uint32)(Uint8)p[2] << 16; }
+
+static void searchIndexRemove(int id) {
+    auto it = gSearch.text.find(id);
+    if (it == gSearch.text.end()) return;
+    const string& t = it->second;
+    for (size_t i = 0; i + 3 <= t.size(); i++) {
+        auto g = gSearch.grams.find(trigramKey(&t[i]));
+        if (g == gSearch.grams.end()) continue;
+        auto& ids = g->second;
+        auto at = lower_bound(ids.begin(), ids.end(), id);
+        if (at != ids.end() && *at == id) ids.erase(at);
+        if (ids.empty()) gSearch.grams.erase(g);
+    }
+    gSearch.text.erase(it);
+}
+
+static void searchIndexAdd(int id, string t) {
+    for (size_t i = 0; i + 3 <= t.size(); i++) {
+        auto& ids = gSearch.grams[trigramKey(&t[i])];
+        if (ids.empty() || ids.back() < id) { ids.push_back(id); continue; }
+        auto at = lower_bound(ids.begin(), ids.end(), id);
+        if (*at != id) ids.insert(at, id);
+    }
+    gSearch.text[id] = move(t);
+}
+
+static void buildSearchIndex(const vector<Block>& blocks) {
+    gSearch = SearchIndex{};
+    vector<const Block*> order;
+    order.reserve(blocks.size());
+    for (auto& b : blocks) order.push_back(&b);
+    sort(order.begin(), order.end(), [](const Block* a, const Block* b) { return a->id < b->id; });
+    gSearch.text.reserve(blocks.size());
+    for (const Block* b : order) searchIndexAdd(b->id, blockSearchText(*b));
+    gSearch.built = true;
+}
+
+// Called once per frame before flushAutosave clears the dirty state.
+static void updateSearchIndex(vector<Block>& blocks) {
+    if (!gSearch.built) return;
+    if (gAutosaveSnapshotWanted) { buildSearchIndex(blocks); return; }
+    for (int id : touchedBlockIds()) {
+        Block* b = findBlock(blocks, id);
+        auto it = gSearch.text.find(id);
+        if (!b) { searchIndexRemove(id); continue; }
+        string t = blockSearchText(*b);
+        if (it != gSearch.text.end() && it->second == t) continue;   // moved, not edited
+        searchIndexRemove(id);
+        searchIndexAdd(id, move(t));
+    }
+}
+
+// Ids of blocks matching query, sorted.
+static void searchBlocks(const string& query, vector<int>& out) {
+    out.clear();
+    string q;
+    normalizeSearchText(query, q);
+    if (q.empty()) return;
+    if (q.size() < 3) {
+        for (auto& kv : gSearch.text) if (kv.second.find(q) != string::npos) out.push_back(kv.first);
+        sort(out.begin(), out.end());
+        return;
+    }
+    const vector<int>* best = nullptr;
+    for (size_t i = 0; i + 3 <= q.size(); i++) {
+        auto g = gSearch.grams.find(trigramKey(&q[i]));
+        if (g == gSearch.grams.end()) return;
+        if (!best || g->second.size() < best->size()) best = &g->second;
+    }
+    for (int id : *best) {
+        auto it = gSearch.text.find(id);
+        if (it != gSearch.text.end() && it->second.find(q) != string::npos) out.push_back(id);
+    }
+}
+
+// Scrolls the workspace so the block sits in the middle of the view.
+static void centerCameraOn(const Block& b) {
+    float viewW = (L.winW - L.WS_X) / L.s, viewH = (L.winH - L.TOOLBAR_HEIGHT) / L.s;
+    L.camX = b.x + b.w * 0.5f - BASE_WS_X - viewW * 0.5f;
+    L.camY = b.y + b.h * 0.5f - BASE_TOOLBAR_HEIGHT - viewH * 0.5f;
+}
+
+static void openFind(const vector<Block>& blocks) {
+    if (!gSearch.built) buildSearchIndex(blocks);
+    gFind.open = true;
+}
+
+static void closeFind() { gFind = FindBox{}; }
+
+// Re-runs the query (the index may have changed this frame) and, when the
+// query itself changed, jumps to its first hit.
+static void refreshFind(vector<Block>& blocks, bool queryChanged) {
+    if (!gFind.open) return;
+    searchBlocks(gFind.query, gFind.hits);
+    if (queryChanged) gFind.cur = -1;
+    if (gFind.cur >= (int)gFind.hits.size()) gFind.cur = (int)gFind.hits.size() - 1;
+    if (queryChanged && !gFind.hits.empty()) {
+        gFind.cur = 0;
+        if (Block* b = findBlock(blocks, gFind.hits[0])) centerCameraOn(*b);
+    }
+}
+
+static void stepFind(vector<Block>& blocks, int dir) {
+    int n = (int)gFind.hits.size();
+    if (n == 0) return;
+    gFind.cur = ((gFind.cur < 0 ? (dir > 0 ? -1 : 0) : gFind.cur) + dir + n) % n;
+    if (Block* b = findBlock(blocks, gFind.hits[gFind.cur])) centerCameraOn(*b);
+}
+
+// ════════════════════════════════════════════
+//  Headless benchmark suite
+// ════════════════════════════════════════════
+// --bench [blocks] [depth] [sprites] [clones] [out.json] builds a synthetic
+// workspace and times the editor/engine hot paths against SDL's software
+// renderer on an offscreen surface (dummy video driver, no window). Every
+// case runs BENCH_REPS times; best and median go to stdout and to a JSON
+// file so two runs can be diffed for regressions.
+static const int BENCH_REPS = 5;
+
+struct BenchResult {
+    string name;
+    int iters;
+    double bestMs, medianMs;
+};
+
+template <class F>
+static BenchResult benchCase(const char* name, int iters, F&& body) {
+    vector<double> ms;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        auto t0 = chrono::steady_clock::now();
+        for (int i = 0; i < iters; i++) body(i);
+        ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count());
+    }
+    sort(ms.begin(), ms.end());
+    BenchResult res{name, iters, ms.front(), ms[BENCH_REPS / 2]};
+    printf("%-20s x%-7d best %9.3f ms  median %9.3f ms  %9.3f us/op\n",
+           name, iters, res.bestMs, res.medianMs, res.bestMs * 1000.0 / iters);
+    return res;
+}
+
+// Flag scripts of commands around nested `repeat 2`s, depth levels deep,
+// until numBlocks workspace blocks exist. Returns the ids of the hats.
+static vector<int> buildBenchWorkspace(vector<Block>& blocks, int numBlocks, int depth) {
+    blocks.clear();
+    ensurePaletteCatalog();
+    auto proto = [&](const char* text) {
+        for (int i = 0; i < (int)gPalette.size(); i++) if (*gPalette[i].text == text) return i;
+        return 0;
+    };
+    const int hatP = proto("when flag clicked"), repeatP = proto("repeat ");
+    const int cmdP[] = {proto("move  steps"), proto("turn R  deg"), proto("change x by "),
+                        proto("change y by "), proto("set size to %")};
+    int made = 0;
+    auto add = [&](int p) { blocks.push_back(cloneBlock(gPalette[p], 0, 0)); made++; return (int)blocks.size() - 1; };
+    auto link = [&](int prev, int idx) { blocks[prev].nextBlockId = blocks[idx].id; blocks[idx].parentBlockId = blocks[prev].id; };
+
+    // two commands, a repeat holding the next level, one more command
+    function<int(int)> chain = [&](int level) {
+        int head = -1, prev = -1;
+        for (int k = 0; k < 4 && made < numBlocks; k++) {
+            int idx;
+            if (k == 2 && level < depth) {
+                idx = add(repeatP);
+                blocks[idx].inputs[0].value = "2";
+                int body = chain(level + 1);
+                if (body >= 0) { blocks[idx].childHeadId = blocks[body].id; blocks[body].parentBlockId = blocks[idx].id; }
+            } else idx = add(cmdP[made % 5]);
+            if (prev >= 0) link(prev, idx); else head = idx;
+            prev = idx;
+        }
+        return head;
+    };
+
+    vector<int> hats;
+    float colW = BASE_BLOCK_WIDTH + 40;
+    while (made < numBlocks) {
+        int hat = add(hatP);
+        Block& h = blocks[hat];
+        h.x = BASE_WS_X + (float)(hats.size() % 8) * colW;
+        h.y = BASE_TOOLBAR_HEIGHT + (float)(hats.size() / 8) * 40;
+        hats.push_back(h.id);
+        int body = made < numBlocks ? chain(0) : -1;
+        if (body >= 0) link(hat, body);
+    }
+    // lay every chain out the way snapping would
+    for (int id : hats) {
+        Block* hat = findBlock(blocks, id);
+        float cy = hat->y + hat->h;
+        for (int cid = hat->nextBlockId; cid >= 0;) {
+            Block* b = findBlock(blocks, cid);
+            b->x = hat->x; b->y = cy;
+            if (b->shape == BlockShape::C_BLOCK) updateCBlockChildren(blocks, *b);
+            cy += b->h;
+            cid = b->nextBlockId;
+        }
+    }
+    gDirtyBlocks.clear();
+    return hats;
+}
+
+// A frame without the interactive panels: palette column, stage with its
+// sprites, then every workspace script, in the main loop's draw order.
+static void benchDrawFrame(SDL_Renderer* rnd, vector<Block>& blocks, vector<Sprite>& sprites) {
+    SDL_SetRenderDrawColor(rnd, 240, 240, 240, 255);
+    renderClear(rnd);
+    drawPaletteColumn(rnd, Category::MOTION, L.CAT_PANEL_WIDTH, L.TOOLBAR_HEIGHT, L.winH - L.TOOLBAR_HEIGHT, 0);
+    presentStage(rnd, stageViewRect(L.winW, L.winH), sprites, 0, 0, true);
+    for (auto& b : blocks) drawBlock(rnd, b, blocks);
+    for (auto& b : blocks) {
+        for (auto& sl : b.opSlots) if (sl.embeddedBlockId >= 0) { Block* emb = findBlock(blocks, sl.embeddedBlockId); if (emb) drawBlock(rnd, *emb, blocks); }
+    }
+    SDL_RenderPresent(rnd);
+}
+
+static bool writeBenchJson(const string& path, const vector<BenchResult>& results,
+                           int numBlocks, int depth, int numSprites, int clones, size_t threads, int ticks) {
+    string out;
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\n  \"config\": {\"blocks\": %d, \"depth\": %d, \"sprites\": %d, \"clones\": %d, "
+             "\"threads\": %zu, \"scriptTicks\": %d, \"reps\": %d},\n  \"results\": [\n",
+             numBlocks, depth, numSprites, clones, threads, ticks, BENCH_REPS);
+    out += buf;
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        snprintf(buf, sizeof(buf),
+                 "    {\"name\": \"%s\", \"iters\": %d, \"bestMs\": %.4f, \"medianMs\": %.4f, \"usPerOp\": %.4f}%s\n",
+                 r.name.c_str(), r.iters, r.bestMs, r.medianMs, r.bestMs * 1000.0 / r.iters,
+                 i + 1 < results.size() ? "," : "");
+        out += buf;
+    }
+    out += "  ]\n}\n";
+    return writeFileAtomic(path, vector<Uint8>(out.begin(), out.end()));
+}
+
+static int runBenchmarkSuite(int numBlocks, int depth, int numSprites, int clones, const string& jsonPath) {
+    numBlocks = max(numBlocks, 1); depth = max(depth, 0); numSprites = max(numSprites, 1); clones = max(clones, 0);
+    SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) { printf("SDL_Init failed: %s\n", SDL_GetError()); return 1; }
+    L.update(BASE_WIDTH, BASE_HEIGHT);
+    SDL_Surface* target = SDL_CreateRGBSurfaceWithFormat(0, BASE_WIDTH, BASE_HEIGHT, 32, SDL_PIXELFORMAT_RGBA8888);
+    SDL_Renderer* rnd = target ? SDL_CreateSoftwareRenderer(target) : nullptr;
+    if (!rnd) { printf("software renderer failed: %s\n", SDL_GetError()); SDL_FreeSurface(target); SDL_Quit(); return 1; }
+    SDL_SetRenderDrawBlendMode(rnd, SDL_BLENDMODE_BLEND);
+
+    vector<Block> blocks;
+    vector<int> hats = buildBenchWorkspace(blocks, numBlocks, depth);
+    vector<Sprite> sprites;
+    for (int i = 0; i < numSprites; i++) {
+        SDL_Color col = catColor((Category)(i % NUM_CATEGORIES));
+        float x = (float)(i % 8) * 50 - 175, y = (float)(i / 8 % 6) * 50 - 125;
+        sprites.push_back(createDefaultSprite(("Sprite" + intToString(i + 1)).c_str(), x, y, col));
+        for (int k = 1; k <= clones; k++) {
+            Sprite c = sprites[sprites.size() - k];
+            c.x += 10 * k; c.y -= 10 * k;
+            sprites.push_back(c);
+        }
+    }
+    printf("bench: %d blocks (%zu scripts, depth %d), %d sprites x %d clones\n",
+           numBlocks, hats.size(), depth, numSprites, clones);
+
+    vector<BenchResult> results;
+    volatile int sink = 0;
+    Uint32 seed = 12345;
+    auto rnd32 = [&]() { seed = seed * 1664525u + 1013904223u; return seed >> 8; };
+
+    int idLo = blocks.front().id, idSpan = blocks.back().id - idLo + 1;
+    results.push_back(benchCase("findBlock", 20000, [&](int) {
+        Block* b = findBlock(blocks, idLo + (int)(rnd32() % idSpan));
+        sink = sink + (b ? 1 : 0);
+    }));
+
+    // a 500-block stack off the palette into reserved storage
+    vector<Block> stack;
+    stack.reserve(500);
+    results.push_back(benchCase("cloneBlock.x500", 200, [&](int) {
+        stack.clear();
+        for (int k = 0; k < 500; k++) stack.push_back(cloneBlock(gPalette[k % gPalette.size()], 0, (float)k * 50));
+        sink = sink + (int)stack.size();
+    }));
+
+    // C-block layout on every script's outermost repeat
+    vector<int> roots;
+    for (auto& b : blocks) {
+        if (b.shape != BlockShape::C_BLOCK) continue;
+        Block* p = findBlock(blocks, b.parentBlockId);
+        if (!p || p->childHeadId != b.id) roots.push_back(b.id);
+    }
+    if (!roots.empty()) {
+        results.push_back(benchCase("calcCBlockHeight", (int)roots.size(), [&](int i) {
+            sink = sink + (int)calcCBlockHeight(blocks, *findBlock(blocks, roots[i]));
+        }));
+        results.push_back(benchCase("updateCBlockChildren", (int)roots.size(), [&](int i) {
+            updateCBlockChildren(blocks, *findBlock(blocks, roots[i]));
+        }));
+    }
+
+    // a loose block dropped far from everything scans the whole workspace;
+    // dropped under a script tail it attaches and is detached again
+    blocks.push_back(cloneBlock(gPalette[0], -10000, -10000));
+    int dragId = blocks.back().id;
+    int tailId = hats.back();
+    for (Block* t = findBlock(blocks, tailId); t && t->nextBlockId >= 0; t = findBlock(blocks, t->nextBlockId)) tailId = t->nextBlockId;
+    results.push_back(benchCase("trySnapBlocks.miss", 200, [&](int) {
+        Block* d = findBlock(blocks, dragId);
+        d->x = d->y = -10000;
+        trySnapBlocks(blocks, dragId);
+    }));
+    results.push_back(benchCase("trySnapBlocks.hit", 200, [&](int) {
+        Block* t = findBlock(blocks, tailId);
+        Block* d = findBlock(blocks, dragId);
+        d->x = t->x; d->y = t->y + t->h;
+        trySnapBlocks(blocks, dragId);
+        detachBlock(blocks, dragId);
+    }));
+    blocks.pop_back();
+    gDirtyBlocks.clear();
+
+    // a whole script moved as one stack (the drop at the end of a drag)
+    results.push_back(benchCase("moveBlockChain", 200, [&](int i) {
+        moveBlockChain(blocks, hats[0], i & 1 ? -1.0f : 1.0f, 0);
+    }));
+    gDirtyBlocks.clear();
+
+    // rubber band over a quarter of the workspace, then duplicate + delete everything
+    buildStackGrid(blocks);
+    results.push_back(benchCase("rubberBand.query", 2000, [&](int i) {
+        vector<int> hit;
+        queryStackGrid(SDL_FRect{(float)(BASE_WS_X + i % 400), (float)(i % 300), (BASE_WIDTH - BASE_WS_X) * 0.5f, BASE_HEIGHT * 0.5f}, hit);
+        sink = sink + (int)hit.size();
+    }));
+    selectAllStacks(blocks);
+    vector<Block> copied = copyStacks(blocks, gSelectedRoots);
+    results.push_back(benchCase("paste+delete", 20, [&](int) {
+        pasteBlocks(blocks, copied, 30, 30);
+        markSelection(blocks);
+        deleteMarkedBlocks(blocks, gSelectedMark);
+    }));
+    clearSelection();
+    gJournalOps.clear(); gDirtyBlocks.clear();
+
+    // one moved script undone and redone: the cost follows the step, not the project
+    gAutosaveSnapshotWanted = false;
+    recordUndoStep(blocks, sprites, -1);
+    moveBlockChain(blocks, hats[0], 40, 0);
+    recordUndoStep(blocks, sprites, -1);
+    gJournalOps.clear(); gDirtyBlocks.clear();
+    results.push_back(benchCase("undo+redo", 200, [&](int i) {
+        if (i & 1) redoEdit(blocks, sprites); else undoEdit(blocks, sprites);
+        gJournalOps.clear(); gDirtyBlocks.clear(); gDirtySprites.clear();
+    }));
+    clearUndoHistory();
+
+    // search: index build, queries, and one edited input reindexed
+    results.push_back(benchCase("search.build", 5, [&](int) { buildSearchIndex(blocks); }));
+    const char* queries[] = {"broadcast msg1", "go to x: 0 y: 0", "repeat 2", "my variable", "ste"};
+    vector<int> found;
+    results.push_back(benchCase("search.query", 5000, [&](int i) {
+        searchBlocks(queries[i % 5], found);
+        sink = sink + (int)found.size();
+    }));
+    Block* edited = nullptr;
+    for (auto& b : blocks) if (!b.inputs.empty()) { edited = &b; break; }
+    if (edited) {
+        string kept = edited->inputs[0].value;
+        results.push_back(benchCase("search.update", 5000, [&](int i) {
+            edited->inputs[0].value = intToString(i);
+            gDirtyBlocks.insert(edited->id);
+            updateSearchIndex(blocks);
+            gDirtyBlocks.clear();
+        }));
+        edited->inputs[0].value = kept;
+    }
+    gSearch = SearchIndex{};
+
+    results.push_back(benchCase("drawBlock", (int)blocks.size() * 4, [&](int i) {
+        drawBlock(rnd, blocks[i % blocks.size()], blocks);
+    }));
+    int paletteH = paletteColumnHeight(Category::MOTION);
+    results.push_back(benchCase("paletteHitTest", 20000, [&](int) {
+        sink = sink + (paletteHitTest(Category::MOTION, 20, (float)(rnd32() % paletteH)) ? 1 : 0);
+    }));
+    const char* labels[] = {"move  steps", "when flag clicked", "Sprite12", "T:12.5", "Hello!", "repeat "};
+    results.push_back(benchCase("drawText", 20000, [&](int i) {
+        drawText(rnd, (i * 37) % BASE_WIDTH, (i * 11) % BASE_HEIGHT, labels[i % 6], 255, 255, 255, 255);
+    }));
+    results.push_back(benchCase("frame", 20, [&](int) { benchDrawFrame(rnd, blocks, sprites); }));
+
+    // 5000 stage particles: the vectorized update and the one-batch draw
+    gParticlesInitialized = false;
+    initParticles(STAGE_LOGICAL_W, STAGE_LOGICAL_H, 5000);
+    results.push_back(benchCase("particles.update", 1000, [&](int) { updateParticles(STAGE_LOGICAL_W, STAGE_LOGICAL_H, 1.0f / 60.0f); }));
+    results.push_back(benchCase("particles.draw", 20, [&](int) { drawParticles(rnd, 0, 0); }));
+
+    // 1000 new pen strokes a frame; the layer itself is never redrawn
+    results.push_back(benchCase("pen.flush", 100, [&](int i) {
+        for (int k = 0; k < 1000; k++) {
+            float a0 = (i * 1000 + k) * 0.01f, a1 = a0 + 0.01f;
+            gPen.segs.push_back({cosf(a0) * 150, sinf(a0 * 1.3f) * 150, cosf(a1) * 150, sinf(a1 * 1.3f) * 150, 2, penColor(k * 0.1f)});
+        }
+        flushPen(rnd, sprites);
+    }));
+
+    // 5000 concurrent glides, none finishing during the run
+    clearTweens();
+    for (int i = 0; i < 5000; i++) {
+        int si = i % (int)sprites.size();
+        startTween(nullptr, si, sprites[si], i & 1 ? TweenProp::Y : TweenProp::X, (float)(i % 480) - 240, 1e6f);
+    }
+    results.push_back(benchCase("tweens.update", 1000, [&](int) { updateTweens(sprites, 1.0f / 60.0f); }));
+    clearTweens();
+
+    // every sprite (clones included) runs every flag script to completion
+    int ticks = 0;
+    size_t threads = 0;
+    results.push_back(benchCase("scriptRun", 1, [&](int) {
+        startGreenFlag(blocks, sprites);
+        threads = gActiveThreads.size();
+        ticks = 0;
+        while (gIsRunning && ticks < 100000) { executeAllThreads(blocks, sprites, 1.0f / 60.0f); ticks++; }
+    }));
+    stopAllScripts();
+    printf("script run: %zu threads, %d ticks\n", threads, ticks);
+
+    bool ok = writeBenchJson(jsonPath, results, numBlocks, depth, numSprites, clones, threads, ticks);
+    printf(ok ? "results written to %s\n" : "could not write %s\n", jsonPath.c_str());
+    SDL_DestroyRenderer(rnd);
+    SDL_FreeSurface(target);
+    SDL_Quit();
+    return ok ? 0 : 1;
+}
+
+// ════════════════════════════════════════════
+//  Headless script runner (batch grading)
+// ════════════════════════════════════════════
+// --run [-t seconds] [-j jobs] project... loads each project, clicks the
+// green flag and steps the engine at a fixed 60 Hz for the simulated time
+// as fast as the CPU allows; no window or renderer is created. One JSON
+// line per project (sprite state, say/think text, variables) goes to
+// stdout in argument order; diagnostics go to stderr. The engine state is
+// global, so parallelism is per process: -j workers are forked and each
+// takes every j-th project.
+static const float RUN_DT = 1.0f / 60.0f;
+
+static string jsonQuote(const string& s) {
+    string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') { out += '\\'; out += (char)c; }
+        else if (c < 0x20) { char buf[8]; snprintf(buf, sizeof(buf), "\\u%04x", c); out += buf; }
+        else out += (char)c;
+    }
+    return out + "\"";
+}
+
+// JSON has no NaN/Infinity; scripts can produce them (division by zero), so
+// they become null.
+static string jsonNumber(double v) {
+    if (!isfinite(v)) return "null";
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%g", v);
+    return buf;
+}
+
+static string runProjectHeadless(const string& path, float seconds) {
+    vector<Block> blocks;
+    vector<Sprite> sprites;
+    string err;
+    if (!loadProject(path, blocks, sprites, err))
+        return "{\"project\":" + jsonQuote(path) + ",\"ok\":false,\"error\":" + jsonQuote(err) + "}";
+
+    startGreenFlag(blocks, sprites);
+    int ticks = max(0, (int)lround(seconds / RUN_DT)), t = 0;
+    for (; t < ticks && gIsRunning; t++) {
+        gTimer += RUN_DT;
+        executeAllThreads(blocks, sprites, RUN_DT);
+        updateSpriteTimers(sprites, RUN_DT);
+    }
+    bool finished = !gIsRunning;
+    stopAllScripts();
+    clearPen();     // no stage to draw on
+
+    string out = "{\"project\":" + jsonQuote(path) + ",\"ok\":true";
+    char buf[256];
+    snprintf(buf, sizeof(buf), ",\"simSeconds\":%.3f,\"ticks\":%d,\"finished\":%s,\"timer\":%.3f,\"variables\":{\"my variable\":%s},\"sprites\":[",
+             t * RUN_DT, t, finished ? "true" : "false", gTimer, jsonNumber(gMyVariable).c_str());
+    out += buf;
+    for (size_t i = 0; i < sprites.size(); i++) {
+        const Sprite& sp = sprites[i];
+        snprintf(buf, sizeof(buf), "%s{\"name\":%s,\"x\":%s,\"y\":%s,\"direction\":%s,\"size\":%s,\"visible\":%s,\"costume\":%d,",
+                 i ? "," : "", jsonQuote(sp.name).c_str(), jsonNumber(sp.x).c_str(), jsonNumber(sp.y).c_str(),
+                 jsonNumber(sp.direction).c_str(), jsonNumber(sp.size).c_str(),
+                 sp.visible ? "true" : "false", sp.currentCostume);
+        out += buf;
+        out += "\"say\":" + jsonQuote(sp.sayText) + ",\"think\":" + jsonQuote(sp.thinkText) + "}";
+    }
+    return out + "]}";
+}
+
+static int runProjectsHeadless(int argc, char* argv[]) {
+    float seconds = 10;
+    int jobs = max(1u, thread::hardware_concurrency());
+    vector<string> paths;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) seconds = (float)atof(argv[++i]);
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc) jobs = max(1, atoi(argv[++i]));
+        else paths.push_back(argv[i]);
+    }
+    if (paths.empty()) { fprintf(stderr, "usage: --run [-t seconds] [-j jobs] project...\n"); return 2; }
+    jobs = min(jobs, (int)paths.size());
+    auto t0 = chrono::steady_clock::now();
+    vector<string> reports(paths.size());
+
+#ifndef _WIN32
+    if (jobs > 1) {
+        // worker w runs projects w, w+jobs, ... and writes NUL-separated
+        // reports to its pipe; projects of a worker that failed to start or
+        // died are rerun below
+        fflush(stdout);
+        vector<pid_t> pids;
+        vector<int> fds;
+        for (int w = 0; w < jobs; w++) {
+            int fd[2];
+            if (pipe(fd) != 0) break;
+            pid_t pid = fork();
+            if (pid < 0) { close(fd[0]); close(fd[1]); break; }
+            if (pid == 0) {
+                close(fd[0]);
+                dup2(STDERR_FILENO, STDOUT_FILENO);     // loader chatter stays off the report stream
+                for (size_t p = w; p < paths.size(); p += jobs) {
+                    string r = runProjectHeadless(paths[p], seconds);
+                    r += '\0';
+                    for (size_t off = 0; off < r.size();) {
+                        ssize_t n = write(fd[1], r.data() + off, r.size() - off);
+                        if (n <= 0) _exit(1);
+                        off += (size_t)n;
+                    }
+                }
+                _exit(0);
+            }
+            close(fd[1]);
+            pids.push_back(pid);
+            fds.push_back(fd[0]);
+        }
+        // drain all pipes together so no worker blocks on a full pipe while
+        // we wait on another
+        vector<string> data(fds.size());
+        vector<pollfd> pfds;
+        for (int fd : fds) pfds.push_back({fd, POLLIN, 0});
+        for (size_t live = pfds.size(); live > 0;) {
+            if (poll(pfds.data(), (nfds_t)pfds.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            for (size_t w = 0; w < pfds.size(); w++) {
+                if (pfds[w].fd < 0 || !pfds[w].revents) continue;
+                char buf[65536];
+                ssize_t n = read(pfds[w].fd, buf, sizeof(buf));
+                if (n > 0) { data[w].append(buf, (size_t)n); continue; }
+                if (n < 0 && errno == EINTR) continue;
+                close(pfds[w].fd);
+                pfds[w].fd = -1;
+                live--;
+            }
+        }
+        for (int w = 0; w < (int)fds.size(); w++) {
+            if (pfds[w].fd >= 0) close(pfds[w].fd);
+            waitpid(pids[w], nullptr, 0);
+            size_t p = w, start = 0, end;
+            while ((end = data[w].find('\0', start)) != string::npos && p < paths.size()) {
+                reports[p] = data[w].substr(start, end - start);
+                start = end + 1;
+                p += jobs;
+            }
+        }
+    }
+#endif
+    int failed = 0;
+    for (size_t p = 0; p < paths.size(); p++) {
+        if (reports[p].empty()) {
+            streambuf* old = cout.rdbuf(cerr.rdbuf());
+            reports[p] = runProjectHeadless(paths[p], seconds);
+            cout.rdbuf(old);
+        }
+        if (reports[p].find("\"ok\":false") != string::npos) failed++;
+        printf("%s\n", reports[p].c_str());
+    }
+    fprintf(stderr, "ran %zu projects (%.1f s simulated each) on %d workers in %.2f s, %d failed\n",
+            paths.size(), seconds, jobs, chrono::duration<double>(chrono::steady_clock::now() - t0).count(), failed);
+    return failed ? 1 : 0;
+}
+
+// ════════════════════════════════════════════
+//  Offscreen stage recorder
+// ════════════════════════════════════════════
+// --record project [-n ticks] [-o dir] [-s WxH] [--yuv] runs the green-flag
+// scripts for a fixed number of 60 Hz ticks and renders only the stage
+// (drawStage, at the 480x360 logical stage size) scaled onto a WxH target
+// texture of a hidden window. There are two targets: frame N is drawn into
+// one while frame N-1 is read back from the other, so the readback never
+// waits on the frame just submitted. Pixels go to encoder threads that write
+// numbered PNGs or one raw I420 .yuv file
+// (ffmpeg -f rawvideo -pix_fmt yuv420p -s WxH -r 60 -i stage_WxH.yuv).
+static const int REC_MAX_INFLIGHT = 8;        // frames queued for encoding
+
+struct RecordFrame {
+    int index;
+    vector<Uint32> px;                        // RGBA8888
+};
+
+struct RecordEncoder {
+    int w = 0, h = 0;
+    bool yuv = false;
+    string dir;
+    FILE* yuvFile = nullptr;
+    mutex fileMutex;
+    mutex m;
+    condition_variable cv;
+    deque<RecordFrame> queue;
+    int busy = 0;
+    bool quit = false;
+    atomic<int> written{0}, failed{0};
+    vector<thread> workers;
+};
+
+// BT.601 limited range, 2x2 chroma averaging.
+static void rgbaToI420(const vector<Uint32>& px, int w, int h, vector<Uint8>& out) {
+    out.resize((size_t)w * h * 3 / 2);
+    Uint8* yp = out.data();
+    Uint8* up = yp + (size_t)w * h;
+    Uint8* vp = up + (size_t)(w / 2) * (h / 2);
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++) {
+            Uint32 p = px[(size_t)y * w + x];
+            int r = p >> 24, g = (p >> 16) & 255, b = (p >> 8) & 255;
+            yp[(size_t)y * w + x] = (Uint8)((66 * r + 129 * g + 25 * b + 128) / 256 + 16);
+        }
+    for (int y = 0; y < h / 2; y++)
+        for (int x = 0; x < w / 2; x++) {
+            int r = 0, g = 0, b = 0;
+            for (int k = 0; k < 4; k++) {
+                Uint32 p = px[(size_t)(2 * y + k / 2) * w + 2 * x + k % 2];
+                r += p >> 24; g += (p >> 16) & 255; b += (p >> 8) & 255;
+            }
+            r /= 4; g /= 4; b /= 4;
+            up[(size_t)y * (w / 2) + x] = (Uint8)((-38 * r - 74 * g + 112 * b + 128) / 256 + 128);
+            vp[(size_t)y * (w / 2) + x] = (Uint8)((112 * r - 94 * g - 18 * b + 128) / 256 + 128);
+        }
+}
+
+static void recordEncodeFrame(RecordEncoder& enc, RecordFrame& f) {
+    vector<Uint8> out;
+    bool ok;
+    if (enc.yuv) {
+        rgbaToI420(f.px, enc.w, enc.h, out);
+        lock_guard<mutex> lk(enc.fileMutex);    // frames land at their own offset, in any order
+        ok = fseek(enc.yuvFile, (long)((size_t)f.index * out.size()), SEEK_SET) == 0 &&
+             fwrite(out.data(), 1, out.size(), enc.yuvFile) == out.size();
+    } else {
+        encodePng(f.px, enc.w, enc.h, out);
+        char name[32];
+        snprintf(name, sizeof(name), "/frame_%05d.png", f.index + 1);
+        ok = writeFileAtomic(enc.dir + name, out);
+    }
+    (ok ? enc.written : enc.failed)++;
+}
+
+static void recordEncoderWorker(RecordEncoder* enc) {
+    while (true) {
+        RecordFrame f;
+        {
+            unique_lock<mutex> lk(enc->m);
+            enc->cv.wait(lk, [&]{ return enc->quit || !enc->queue.empty(); });
+            if (enc->queue.empty()) return;
+            f = move(enc->queue.front());
+            enc->queue.pop_front();
+            enc->busy++;
+        }
+        recordEncodeFrame(*enc, f);
+        {
+            lock_guard<mutex> lk(enc->m);
+            enc->busy--;
+        }
+        enc->cv.notify_all();
+    }
+}
+
+// Blocks only when REC_MAX_INFLIGHT frames are already waiting.
+static void recordSubmit(RecordEncoder& enc, RecordFrame&& f) {
+    unique_lock<mutex> lk(enc.m);
+    enc.cv.wait(lk, [&]{ return (int)enc.queue.size() + enc.busy < REC_MAX_INFLIGHT; });
+    enc.queue.push_back(move(f));
+    lk.unlock();
+    enc.cv.notify_all();
+}
+
+static int runStageRecorder(int argc, char* argv[]) {
+    string path, dir = "record";
+    int ticks = 600, w = STAGE_LOGICAL_W, h = STAGE_LOGICAL_H;
+    bool yuv = false;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) ticks = max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) dir = argv[++i];
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc) sscanf(argv[++i], "%dx%d", &w, &h);
+        else if (!strcmp(argv[i], "--yuv")) yuv = true;
+        else path = argv[i];
+    }
+    if (path.empty() || w < 2 || h < 2 || (yuv && (w % 2 || h % 2))) {
+        printf("usage: --record project [-n ticks] [-o dir] [-s WxH] [--yuv]  (even W and H for --yuv)\n");
+        return 2;
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");    // no display: software only
+        if (SDL_Init(SDL_INIT_VIDEO) != 0) { printf("SDL_Init failed: %s\n", SDL_GetError()); return 1; }
+    }
+    IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG);
+    SDL_Window* window = SDL_CreateWindow("stage recorder", 0, 0, 64, 64, SDL_WINDOW_HIDDEN);
+    SDL_Renderer* rnd = window ? SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE) : nullptr;
+    if (window && !rnd) rnd = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE | SDL_RENDERER_TARGETTEXTURE);
+    SDL_Texture* target[2] = {nullptr, nullptr};
+    for (auto& t : target) if (rnd) t = SDL_CreateTexture(rnd, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, w, h);
+    if (!target[0] || !target[1]) { printf("offscreen target failed: %s\n", SDL_GetError()); SDL_Quit(); return 1; }
+    SDL_SetRenderDrawBlendMode(rnd, SDL_BLENDMODE_BLEND);
+
+    L.update(BASE_WIDTH, BASE_HEIGHT);
+    vector<Block> blocks;
+    vector<Sprite> sprites;
+    string err;
+    if (!loadProject(path, blocks, sprites, err)) { printf("%s: %s\n", path.c_str(), err.c_str()); SDL_Quit(); return 1; }
+
+    error_code ec;
+    filesystem::create_directories(dir, ec);
+    RecordEncoder enc;
+    enc.w = w; enc.h = h; enc.yuv = yuv; enc.dir = dir;
+    string yuvPath = dir + "/stage_" + intToString(w) + "x" + intToString(h) + ".yuv";
+    if (yuv && !(enc.yuvFile = fopen(yuvPath.c_str(), "wb"))) { printf("cannot write %s\n", yuvPath.c_str()); SDL_Quit(); return 1; }
+    int numWorkers = max(1, (int)thread::hardware_concurrency() - 1);
+    for (int i = 0; i < numWorkers; i++) enc.workers.emplace_back(recordEncoderWorker, &enc);
+
+    auto t0 = chrono::steady_clock::now();
+    gParticlesInitialized = false;
+    startGreenFlag(blocks, sprites);
+    auto readBack = [&](int idx) {
+        RecordFrame f;
+        f.index = idx;
+        f.px.resize((size_t)w * h);
+        SDL_SetRenderTarget(rnd, target[idx & 1]);
+        SDL_RenderReadPixels(rnd, nullptr, SDL_PIXELFORMAT_RGBA8888, f.px.data(), w * 4);
+        recordSubmit(enc, move(f));
+    };
+    for (int t = 0; t < ticks; t++) {
+        if (gIsRunning) gTimer += RUN_DT;
+        executeAllThreads(blocks, sprites, RUN_DT);
+        updateSpriteTimers(sprites, RUN_DT);
+        trackPen(sprites);
+        SDL_SetRenderTarget(rnd, target[t & 1]);
+        SDL_RenderSetScale(rnd, (float)w / STAGE_LOGICAL_W, (float)h / STAGE_LOGICAL_H);
+        drawStage(rnd, sprites, RUN_DT, -1, false);
+        SDL_RenderFlush(rnd);
+        if (t > 0) readBack(t - 1);
+    }
+    readBack(ticks - 1);
+    stopAllScripts();
+
+    {
+        lock_guard<mutex> lk(enc.m);
+        enc.quit = true;
+    }
+    enc.cv.notify_all();
+    for (auto& th : enc.workers) th.join();
+    if (enc.yuvFile) fclose(enc.yuvFile);
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    printf("recorded %d frames (%.1f s of stage time) at %dx%d in %.2f s (%.1fx real time) -> %s%s\n",
+           enc.written.load(), ticks * RUN_DT, w, h, sec, ticks * RUN_DT / max(sec, 1e-6),
+           yuv ? yuvPath.c_str() : dir.c_str(), enc.failed ? " (some frames failed)" : "");
+
+    for (auto& t : target) SDL_DestroyTexture(t);
+    SDL_DestroyRenderer(rnd);
+    SDL_DestroyWindow(window);
+    IMG_Quit();
+    SDL_Quit();
+    return enc.failed ? 1 : 0;
+}
+
+// ════════════════════════════════════════════
+//  Frame profiler: HUD + Chrome trace
+// ════════════════════════════════════════════
+#if SCRATCH_PROFILER
+// Chrome trace JSON (chrome://tracing, Perfetto): one complete event per
+// phase scope plus one per frame, with draw-call counts as args.
+static void profWriteTrace(const string& path) {
+    string out = "{\"traceEvents\":[\n";
+    char buf[256];
+    for (size_t i = 0; i < gProf.trace.size(); i++) {
+        const ProfTraceEvent& ev = gProf.trace[i];
+        snprintf(buf, sizeof(buf),
+                 "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"drawCalls\":%d}}",
+                 i ? ",\n" : "", ev.phase < 0 ? "frame" : PROF_PHASE_NAMES[ev.phase],
+                 ev.phase < 0 ? "frame" : "phase", ev.tsUs, ev.durUs, ev.draws);
+        out += buf;
+    }
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    bool ok = writeFileAtomic(path, vector<Uint8>(out.begin(), out.end()));
+    gSaveStatusText = ok ? "Trace: " + path + " (" + intToString(gProf.traceFrames) + " frames)"
+                         : "Trace write failed: " + path;
+    gSaveStatusTimer = 3.0f;
+}
+
+static void profToggleCapture() {
+    if (gProf.capturing) {
+        gProf.capturing = false;
+        profWriteTrace("profile_trace.json");
+        gProf.trace.clear();
+        return;
+    }
+    gProf.capturing = true;
+    gProf.traceFrames = 0;
+    gProf.trace.clear();
+    gProf.trace.reserve(PROF_TRACE_MAX_FRAMES * (PP_COUNT + 1));
+    gProf.traceStart = SDL_GetPerformanceCounter();
+    gSaveStatusText = "Recording trace (F4 to stop)";
+    gSaveStatusTimer = 0;
+}
+
+static void profFrameEnd() {
+    if (!gProf.frameSampled) return;
+    Uint64 t1 = SDL_GetPerformanceCounter();
+    gProf.cur.frameMs = (float)((double)(t1 - gProf.frameStart) * 1000.0 / (double)gProf.freq);
+    gProf.cur.frameDraws = gProf.drawCalls - gProf.frameDraws0;
+    gProf.history[gProf.head] = gProf.cur;
+    gProf.head = (gProf.head + 1) % PROF_HISTORY;
+    if (gProf.filled < PROF_HISTORY) gProf.filled++;
+    if (gProf.capturing) {
+        gProf.trace.push_back({-1, gProf.us(gProf.frameStart), gProf.us(t1) - gProf.us(gProf.frameStart), gProf.cur.frameDraws});
+        if (++gProf.traceFrames >= PROF_TRACE_MAX_FRAMES) profToggleCapture();
+    }
+}
+
+// Per-phase averages over the last second and a frame-time graph
+// (green under 16.7 ms, yellow under 33.3 ms, red above).
+static void drawProfilerHud(SDL_Renderer* rnd, int winW) {
+    if (!gProf.hud || gProf.filled == 0) return;
+    int n = min(gProf.filled, 60);
+    float avgMs[PP_COUNT] = {}, avgDraws[PP_COUNT] = {}, avgFrame = 0, worst = 0, frameDraws = 0;
+    for (int i = 0; i < n; i++) {
+        const ProfFrame& f = gProf.history[(gProf.head - 1 - i + PROF_HISTORY) % PROF_HISTORY];
+        for (int p = 0; p < PP_COUNT; p++) { avgMs[p] += f.ms[p] / n; avgDraws[p] += (float)f.draws[p] / n; }
+        avgFrame += f.frameMs / n;
+        frameDraws += (float)f.frameDraws / n;
+        worst = max(worst, f.frameMs);
+    }
+
+    int pad = (int)(8 * L.s), lineH = textHeight("A") + (int)(3 * L.s), graphH = (int)(60 * L.s);
+    int w = textWidth("drag preview   00.00 ms  00000") + 2 * pad;
+    int h = lineH * (PP_COUNT + 1) + graphH + 3 * pad;
+    int x = winW - w - 10, y = L.TOOLBAR_HEIGHT + 10;
+    fillRoundedRect(rnd, x, y, w, h, 6, 20, 20, 30, 225);
+
+    char buf[96];
+    snprintf(buf, sizeof(buf), "frame %.1f/%.1f ms %d dc", avgFrame, worst, (int)(frameDraws + 0.5f));
+    drawText(rnd, x + pad, y + pad, buf, 255, 255, 255, 255);
+    for (int p = 0; p < PP_COUNT; p++) {
+        bool nested = (p == PP_PARTICLES || p == PP_PEN || p == PP_DRAG_PREVIEW);
+        snprintf(buf, sizeof(buf), "%s%-*s %5.2f ms %5d", nested ? " " : "", nested ? 13 : 14,
+                 PROF_PHASE_NAMES[p], avgMs[p], (int)(avgDraws[p] + 0.5f));
+        Uint8 c = avgMs[p] > 4.0f ? 120 : 255;
+        drawText(rnd, x + pad, y + pad + lineH * (p + 1), buf, 255, c, c, 255);
+    }
+
+    int gx = x + pad, gy = y + h - pad - graphH, gw = w - 2 * pad;
+    SDL_SetRenderDrawColor(rnd, 40, 40, 55, 255);
+    SDL_Rect bg = {gx, gy, gw, graphH};
+    renderFillRect(rnd, &bg);
+    int barW = max(1, gw / PROF_HISTORY), bars = min(gProf.filled, gw / barW);
+    for (int i = 0; i < bars; i++) {
+        const ProfFrame& f = gProf.history[(gProf.head - 1 - i + PROF_HISTORY) % PROF_HISTORY];
+        int bh = (int)(min(f.frameMs / 33.3f, 1.0f) * graphH);
+        if (f.frameMs < 16.7f) SDL_SetRenderDrawColor(rnd, 80, 200, 80, 255);
+        else if (f.frameMs < 33.3f) SDL_SetRenderDrawColor(rnd, 230, 200, 50, 255);
+        else SDL_SetRenderDrawColor(rnd, 230, 70, 60, 255);
+        SDL_Rect bar = {gx + gw - (i + 1) * barW, gy + graphH - bh, barW, bh};
+        renderFillRect(rnd, &bar);
+    }
+    SDL_SetRenderDrawColor(rnd, 255, 255, 255, 120);
+    renderDrawLine(rnd, gx, gy + graphH / 2, gx + gw, gy + graphH / 2);
+}
+#else
+static void profFrameEnd() {}
+static void drawProfilerHud(SDL_Renderer*, int) {}
+#endif
+
+// ════════════════════════════════════════════
+//  Input record / replay
+// ════════════════════════════════════════════
+// --record-input log [project] appends every polled SDL event to a binary
+// log: header (magic, version, rand seed, start project), then per event a
+// varint frame delta, a size byte and the event struct truncated to its
+// type. --replay log [--dt ms] starts from the same project and seed,
+// feeds each event back on the frame it was polled and advances the clock
+// by a fixed dt, without vsync or frame delay. Both modes skip the autosave
+// so the start state is the same every time. At the end of a replay the
+// frame-time distribution is printed. File dialogs are logged as a record
+// of size 0 followed by the chosen path, and replay returns that path
+// instead of opening a dialog.
+enum class InputMode { LIVE, RECORD, REPLAY };
+
+static const char   INPUT_LOG_MAGIC[4] = {'S','C','E','V'};
+static const Uint32 INPUT_LOG_VERSION  = 2;     // 2: dialog records
+
+static InputMode gInputMode = InputMode::LIVE;
+static Uint32 gInputFrame = 0;
+static FILE* gInputLogFile = nullptr;          // RECORD
+static Uint32 gInputLastFrame = 0;
+static vector<Uint8> gReplayData;              // REPLAY
+static size_t gReplayPos = 0;
+static Uint32 gReplayNextFrame = 0;
+static float gReplayDt = 1.0f / 60.0f;
+static int gReplayMouseX = 0, gReplayMouseY = 0;
+static Uint16 gInputMods = KMOD_NONE;          // modifiers as of the last key event
+static vector<float> gReplayFrameMs;
+
+// Bytes of the event union that matter for a type; 0 = not recorded.
+static size_t inputEventSize(Uint32 type) {
+    switch (type) {
+    case SDL_QUIT:            return sizeof(SDL_CommonEvent);
+    case SDL_WINDOWEVENT:     return sizeof(SDL_WindowEvent);
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:           return sizeof(SDL_KeyboardEvent);
+    case SDL_TEXTINPUT:       return sizeof(SDL_TextInputEvent);
+    case SDL_MOUSEMOTION:     return sizeof(SDL_MouseMotionEvent);
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:   return sizeof(SDL_MouseButtonEvent);
+    case SDL_MOUSEWHEEL:      return sizeof(SDL_MouseWheelEvent);
+    default:                  return 0;
+    }
+}
+
+static void putVarint(FILE* f, Uint32 v) {
+    while (v >= 0x80) { fputc((int)(v & 0x7F) | 0x80, f); v >>= 7; }
+    fputc((int)v, f);
+}
+
+static bool getVarint(Uint32& v) {
+    v = 0;
+    for (int shift = 0; shift < 35 && gReplayPos < gReplayData.size(); shift += 7) {
+        Uint8 b = gReplayData[gReplayPos++];
+        v |= (Uint32)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool startInputRecording(const string& path, Uint32 seed, const string& project) {
+    gInputLogFile = fopen(path.c_str(), "wb");
+    if (!gInputLogFile) return false;
+    Uint32 len = (Uint32)project.size();
+    fwrite(INPUT_LOG_MAGIC, 1, 4, gInputLogFile);
+    fwrite(&INPUT_LOG_VERSION, 4, 1, gInputLogFile);
+    fwrite(&seed, 4, 1, gInputLogFile);
+    fwrite(&len, 4, 1, gInputLogFile);
+    fwrite(project.data(), 1, len, gInputLogFile);
+    gInputMode = InputMode::RECORD;
+    srand(seed);
+    return true;
+}
+
+static bool startInputReplay(const string& path, string& project, string& err) {
+    ifstream in(path, ios::binary);
+    if (!in) { err = "cannot open " + path; return false; }
+    gReplayData.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    Uint32 version, seed, len;
+    if (gReplayData.size() < 16 || memcmp(gReplayData.data(), INPUT_LOG_MAGIC, 4) != 0) { err = "not an input log"; return false; }
+    memcpy(&version, &gReplayData[4], 4); memcpy(&seed, &gReplayData[8], 4); memcpy(&len, &gReplayData[12], 4);
+    if (version < 1 || version > INPUT_LOG_VERSION) { err = "unsupported log version"; return false; }
+    if (len > gReplayData.size() - 16) { err = "truncated header"; return false; }
+    project.assign((const char*)&gReplayData[16], len);
+    gReplayPos = 16 + len;
+    Uint32 delta = 0;
+    gReplayNextFrame = getVarint(delta) ? delta : UINT32_MAX;
+    gInputMode = InputMode::REPLAY;
+    srand(seed);
+    return true;
+}
+
+// Consumes a dialog record if one is next on this frame; its path goes to out.
+static bool readReplayDialog(string* out) {
+    if (gReplayNextFrame != gInputFrame || gReplayPos >= gReplayData.size() || gReplayData[gReplayPos] != 0)
+        return false;
+    gReplayPos++;
+    Uint32 len = 0, delta = 0;
+    if (!getVarint(len) || len > gReplayData.size() - gReplayPos) {
+        gReplayPos = gReplayData.size(); gReplayNextFrame = UINT32_MAX;
+        return false;
+    }
+    if (out) out->assign((const char*)&gReplayData[gReplayPos], len);
+    gReplayPos += len;
+    gReplayNextFrame = getVarint(delta) ? gInputFrame + delta : UINT32_MAX;
+    return true;
+}
+
+static bool pollRawInputEvent(SDL_Event& e) {
+    if (gInputMode == InputMode::LIVE) return SDL_PollEvent(&e);
+    if (gInputMode == InputMode::RECORD) {
+        if (!SDL_PollEvent(&e)) return false;
+        size_t n = inputEventSize(e.type);
+        if (n) {
+            putVarint(gInputLogFile, gInputFrame - gInputLastFrame);
+            fputc((int)n, gInputLogFile);
+            fwrite(&e, 1, n, gInputLogFile);
+            gInputLastFrame = gInputFrame;
+        }
+        return true;
+    }
+    // live input is ignored while replaying, except for closing the window
+    SDL_Event os;
+    while (SDL_PollEvent(&os)) if (os.type == SDL_QUIT) { e = os; return true; }
+    if (gReplayNextFrame != gInputFrame || gReplayPos >= gReplayData.size()) return false;
+    // a dialog record is read right after the event that opened the dialog;
+    // one still here nobody asked for (the replay diverged) is skipped
+    while (readReplayDialog(nullptr)) {
+        if (gReplayNextFrame != gInputFrame || gReplayPos >= gReplayData.size()) return false;
+    }
+    size_t n = gReplayData[gReplayPos++];
+    if (n > sizeof(SDL_Event) || n > gReplayData.size() - gReplayPos) { gReplayNextFrame = UINT32_MAX; return false; }
+    memset(&e, 0, sizeof(e));
+    memcpy(&e, &gReplayData[gReplayPos], n);
+    gReplayPos += n;
+    if (e.type == SDL_MOUSEMOTION) { gReplayMouseX = e.motion.x; gReplayMouseY = e.motion.y; }
+    if (e.type == SDL_MOUSEBUTTONDOWN || e.type == SDL_MOUSEBUTTONUP) { gReplayMouseX = e.button.x; gReplayMouseY = e.button.y; }
+    Uint32 delta = 0;
+    gReplayNextFrame = getVarint(delta) ? gInputFrame + delta : UINT32_MAX;
+    return true;
+}
+
+// SDL_PollEvent for the main loop: records, or replays the log for this frame.
+// Key events also keep gInputMods, so modifier checks follow the event stream.
+static bool pollInputEvent(SDL_Event& e) {
+    if (!pollRawInputEvent(e)) return false;
+    if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) gInputMods = e.key.keysym.mod;
+    return true;
+}
+
+// Runs a file dialog (show returns its path or null). Recording logs the
+// result; replay hands back the logged one without opening anything, and
+// null if the log has no dialog record here (e.g. a version 1 log).
+static const char* inputDialog(const function<const char*()>& show) {
+    static string result;
+    if (gInputMode == InputMode::REPLAY)
+        return readReplayDialog(&result) && !result.empty() ? result.c_str() : nullptr;
+    const char* f = show();
+    result = f ? f : "";
+    if (gInputMode == InputMode::RECORD) {
+        putVarint(gInputLogFile, gInputFrame - gInputLastFrame);
+        fputc(0, gInputLogFile);
+        putVarint(gInputLogFile, (Uint32)result.size());
+        fwrite(result.data(), 1, result.size(), gInputLogFile);
+        gInputLastFrame = gInputFrame;
+    }
+    return f ? result.c_str() : nullptr;
+}
+
+static void inputMouseState(int* x, int* y) {
+    if (gInputMode == InputMode::REPLAY) { *x = gReplayMouseX; *y = gReplayMouseY; }
+    else SDL_GetMouseState(x, y);
+}
+
+// Called once per frame; returns false once the replay has run out of events.
+static bool inputFrameEnd(float frameMs) {
+    gInputFrame++;
+    if (gInputMode != InputMode::REPLAY) return true;
+    gReplayFrameMs.push_back(frameMs);
+    return gReplayNextFrame != UINT32_MAX;
+}
+
+static void finishInput() {
+    if (gInputLogFile) { fclose(gInputLogFile); gInputLogFile = nullptr; }
+    if (gInputMode != InputMode::REPLAY || gReplayFrameMs.empty()) return;
+    vector<float> ms = gReplayFrameMs;
+    sort(ms.begin(), ms.end());
+    double sum = 0;
+    for (float v : ms) sum += v;
+    auto pct = [&](double p) { return ms[min(ms.size() - 1, (size_t)(p * ms.size()))]; };
+    printf("replay: %zu frames, mean %.3f ms, p50 %.3f, p95 %.3f, p99 %.3f, max %.3f ms\n",
+           ms.size(), sum / ms.size(), pct(0.50), pct(0.95), pct(0.99), ms.back());
+}
+
+// ════════════════════════════════════════════
+//  MAIN
+// ════════════════════════════════════════════
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--bench-png") == 0)
+        return runPngBenchmark(argc > 2 ? atoi(argv[2]) : 20);
+    if (argc > 1 && strcmp(argv[1], "--bench-project") == 0)
+        return runProjectBenchmark(argc > 2 ? atoi(argv[2]) : 5000);
+    if (argc > 1 && strcmp(argv[1], "--check-autosave") == 0)
+        return runAutosaveRestoreCheck();
+    if (argc > 1 && strcmp(argv[1], "--check-load") == 0)
+        return runLoadRejectCheck();
+    if (argc > 1 && strcmp(argv[1], "--run") == 0)
+        return runProjectsHeadless(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--record") == 0)
+        return runStageRecorder(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return runBenchmarkSuite(argc > 2 ? atoi(argv[2]) : 2000, argc > 3 ? atoi(argv[3]) : 4,
+                                 argc > 4 ? atoi(argv[4]) : 8, argc > 5 ? atoi(argv[5]) : 4,
+                                 argc > 6 ? argv[6] : "bench_results.json");
+
+    string startProject = argc > 1 && argv[1][0] != '-' ? argv[1] : "";
+    if (argc > 2 && strcmp(argv[1], "--record-input") == 0) {
+        if (argc > 3) startProject = argv[3];
+        if (!startInputRecording(argv[2], (Uint32)time(nullptr), startProject)) { cout << "cannot write " << argv[2] << endl; return 1; }
+    } else if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        string err;
+        if (!startInputReplay(argv[2], startProject, err)) { cout << "Replay failed: " << err << endl; return 1; }
+        if (argc > 4 && strcmp(argv[3], "--dt") == 0) gReplayDt = max(0.1f, (float)atof(argv[4])) / 1000.0f;
+    }
+
+    if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG)) {
+        cout << "SDL_image Error: " << IMG_GetError() << endl;
+    }
+
+    SDL_Init(SDL_INIT_VIDEO);
+    IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG);
+    SDL_Window* window=SDL_CreateWindow("Scratch IDE - SDL2 (Enhanced)",SDL_WINDOWPOS_CENTERED,SDL_WINDOWPOS_CENTERED,BASE_WIDTH,BASE_HEIGHT,SDL_WINDOW_SHOWN|SDL_WINDOW_RESIZABLE);
+    SDL_Renderer* rnd=SDL_CreateRenderer(window,-1,SDL_RENDERER_ACCELERATED|(gInputMode==InputMode::REPLAY?0:SDL_RENDERER_PRESENTVSYNC));
+    SDL_SetRenderDrawBlendMode(rnd, SDL_BLENDMODE_BLEND);
+    int winW=BASE_WIDTH, winH=BASE_HEIGHT;
+    L.update(winW,winH);
+    SDL_StartTextInput();
+    SDL_SetRenderDrawBlendMode(rnd, SDL_BLENDMODE_BLEND);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
+
+    vector<Sprite> sprites;
+    sprites.push_back(createDefaultSprite("Sprite1",0,0,{255,140,0,255}));
+    vector<Block> blocks;
+    if (!startProject.empty()) {
+        string err;
+        if (!loadProject(startProject, blocks, sprites, err)) cout << "Open failed: " << err << endl;
+    } else if (gInputMode == InputMode::LIVE && !restoreAutosave(blocks, sprites)) {
+        gAutosaveSnapshotWanted = true;
+    }
+
+    Category selectedCategory=Category::MOTION;
+    int dragBlockId=-1;
+    float dragOffX=0, dragOffY=0;
+    int paletteScrollY=0;
+    bool draggingSprite=false;
+    int dragSpriteIdx=-1;
     float spDragOffX=0, spDragOffY=0;
     bool resetHovered=false;
     int selectedSpriteIdx=0;
@@ -923,46 +5629,150 @@ int main(int argc, char* argv[]) {
     bool running=true;
 
     while (running) {
+        profFrameBegin();
+        auto frameStart=chrono::steady_clock::now();
         Uint32 now=SDL_GetTicks();
-        float dt=(now-lastTick)/1000.0f;
+        float dt=gInputMode==InputMode::REPLAY?gReplayDt:(now-lastTick)/1000.0f;
         lastTick=now;
-        if (gIsRunning) gTimer+=dt;
+        {
+            PROF_SCOPE(PP_SCRIPTS);
+            if (gIsRunning) {
+                gTimer+=dt;
+                beginScriptTickUndo(sprites);
+                executeAllThreads(blocks, sprites, dt);
+                endScriptTickUndo(sprites);
+            }
+        }
+
+        {
+            lock_guard<mutex> lk(gSaveMutex);
+            for (auto& res : gSaveDone) {
+                for (auto& sp : sprites) for (auto& c : sp.costumes) if (c.saveJobId == res.id) c.saveJobId = -1;
+                char buf[256];
+                if (res.project && res.ok) gProjectPath = res.path;
+                if (res.ok) snprintf(buf, sizeof(buf), "Saved %s%s (%zu KB, %.0f ms)", res.project ? "project " : "", res.path.c_str(), (res.bytes + 1023) / 1024, res.ms);
+                else snprintf(buf, sizeof(buf), "%s failed: %s", res.project ? "Project save" : "Save", res.path.c_str());
+                gSaveStatusText = buf;
+                gSaveStatusTimer = 3.0f;
+                cout << buf << endl;
+            }
+            gSaveDone.clear();
+        }
+        if (gSaveStatusTimer > 0) { gSaveStatusTimer -= dt; if (gSaveStatusTimer <= 0) { gSaveStatusTimer = 0; gSaveStatusText.clear(); } }
 
-        for (auto& sp:sprites) {
-            if(sp.sayTimer>0){sp.sayTimer-=dt;if(sp.sayTimer<=0){sp.sayTimer=0;sp.sayText.clear();}}
-            if(sp.thinkTimer>0){sp.thinkTimer-=dt;if(sp.thinkTimer<=0){sp.thinkTimer=0;sp.thinkText.clear();}}
+        {
+            PROF_SCOPE(PP_SPRITE_TIMERS);
+            updateSpriteTimers(sprites, dt);
+            trackPen(sprites);
         }
 
         // ════════════════════════════════════════════
         //  EVENT LOOP
         // ════════════════════════════════════════════
+        PROF_BEGIN(profEvents, PP_EVENTS);
         SDL_Event e;
-        while (SDL_PollEvent(&e)) {
+        while (pollInputEvent(e)) {
             if (e.type==SDL_QUIT) running=false;
 
             if (e.type==SDL_WINDOWEVENT&&e.window.event==SDL_WINDOWEVENT_RESIZED) {
                 winW=e.window.data1; winH=e.window.data2; L.update(winW,winH);
-                vector<Block> kept; for(auto& b:blocks) if(!b.inPalette) kept.push_back(b);
-                blocks=buildPaletteBlocks(); for(auto& b:kept) blocks.push_back(b);
             }
+            if (e.type==SDL_RENDER_TARGETS_RESET) { releasePaletteTextures(); gPen.clearPending=true; }
 
             if (e.type==SDL_MOUSEWHEEL) {
-                int mx,my; SDL_GetMouseState(&mx,&my);
-                if(mx<L.PALETTE_WIDTH&&my>L.TOOLBAR_HEIGHT){paletteScrollY+=e.wheel.y*20;if(paletteScrollY>0)paletteScrollY=0;}
+                int mx,my; inputMouseState(&mx,&my);
+                if(inRect(uiRect(UiId::THUMB,-1),mx,my)){gThumbScroll+=(e.wheel.x-e.wheel.y)*gUiThumbStride/2;clampThumbScroll((int)sprites.size());}
+                else if(mx<L.PALETTE_WIDTH&&my>L.TOOLBAR_HEIGHT){paletteScrollY=max(min(0,paletteScrollY+e.wheel.y*20),min(0,winH-L.TOOLBAR_HEIGHT-paletteColumnHeight(selectedCategory)));}
+                else if(mx>=L.WS_X&&my>L.TOOLBAR_HEIGHT&&!costumeEditMode){L.camX-=e.wheel.x*40;L.camY-=e.wheel.y*40;}
             }
 
             // TEXT INPUT
             if (e.type==SDL_TEXTINPUT) {
-                if(gEdit.active&&gEdit.blockId>=0&&gEdit.fieldIndex>=0){Block* eb=findBlock(blocks,gEdit.blockId);if(eb&&gEdit.fieldIndex<(int)eb->inputs.size())eb->inputs[gEdit.fieldIndex].value+=e.text.text;}
+                if(gFind.open&&!costumeEditMode&&!gEdit.active&&sprInfoEdit.field<0){gFind.query+=e.text.text;refreshFind(blocks,true);}
+                if(gEdit.active&&gEdit.blockId>=0&&gEdit.fieldIndex>=0){Block* eb=findBlock(blocks,gEdit.blockId);if(eb&&gEdit.fieldIndex<(int)eb->inputs.size()){eb->inputs[gEdit.fieldIndex].value+=e.text.text;gDirtyBlocks.insert(eb->id);}}
                 if(sprInfoEdit.field>=0&&selectedSpriteIdx<(int)sprites.size())sprInfoEdit.buffer+=e.text.text;
             }
 
             if (e.type==SDL_KEYDOWN) {
+#if SCRATCH_PROFILER
+                if(e.key.keysym.sym==SDLK_F3) gProf.hud=!gProf.hud;
+                if(e.key.keysym.sym==SDLK_F4) profToggleCapture();
+#endif
+                if(e.key.keysym.sym==SDLK_F5) gBlockProfView=!gBlockProfView;
+                if(e.key.keysym.sym==SDLK_F11||(gPresentMode&&e.key.keysym.sym==SDLK_ESCAPE)){
+                    gPresentMode=!gPresentMode;
+                    SDL_SetWindowFullscreen(window,gPresentMode?SDL_WINDOW_FULLSCREEN_DESKTOP:0);
+                    continue;
+                }
+                if(costumeEditMode&&(e.key.keysym.mod&KMOD_CTRL)){
+                    if(e.key.keysym.sym==SDLK_z) canvasUndo(rnd);
+                    else if(e.key.keysym.sym==SDLK_y) canvasRedo(rnd);
+                }
+                if((e.key.keysym.mod&KMOD_CTRL)&&!gEdit.active&&sprInfoEdit.field<0&&
+                   (e.key.keysym.sym==SDLK_s||e.key.keysym.sym==SDLK_o)){
+                    const char* filters[1] = { "*.sbp" };
+                    if(e.key.keysym.sym==SDLK_s){
+                        string path = gProjectPath;
+                        if(path.empty()||(e.key.keysym.mod&KMOD_SHIFT)){
+                            const char* f = inputDialog([&]{ return tinyfd_saveFileDialog("Save Project", "project.sbp", 1, filters, "Scratch project"); });
+                            path = f ? f : "";
+                        }
+                        if(!path.empty()){
+                            queueProjectSave(path, blocks, sprites);
+                            gSaveStatusText = "Saving project " + path;
+                            gSaveStatusTimer = 3.0f;
+                        }
+                    } else {
+                        const char* f = inputDialog([&]{ return tinyfd_openFileDialog("Open Project", "", 1, filters, "Scratch project", 0); });
+                        if(f){
+                            string err;
+                            if(loadProject(f, blocks, sprites, err)){
+                                selectedSpriteIdx = 0; dragBlockId = -1; draggingSprite = false;
+                                cancelStackDrag();
+                                clearSelection();
+                                clearUndoHistory();
+                                L.camX=L.camY=0;
+                                clearPen();
+                                gSaveStatusText = string("Opened ") + f;
+                            } else gSaveStatusText = "Open failed: " + err;
+                            gSaveStatusTimer = 3.0f;
+                        }
+                    }
+                }
+                if(!costumeEditMode&&!gEdit.active&&sprInfoEdit.field<0&&dragBlockId<0){
+                    SDL_Keycode k=e.key.keysym.sym;
+                    if((e.key.keysym.mod&KMOD_CTRL)&&k==SDLK_f){if(gFind.open)closeFind();else openFind(blocks);continue;}
+                    // Delete هم اینجا بلعیده می‌شود تا با باز بودن جستجو انتخاب پاک نشود
+                    if(gFind.open&&(k==SDLK_ESCAPE||k==SDLK_BACKSPACE||k==SDLK_RETURN||k==SDLK_DELETE)){
+                        if(k==SDLK_ESCAPE) closeFind();
+                        else if(k==SDLK_RETURN) stepFind(blocks,(e.key.keysym.mod&KMOD_SHIFT)?-1:1);
+                        else if(k==SDLK_BACKSPACE&&!gFind.query.empty()){
+                            // یک کاراکتر کامل UTF-8 پاک می‌شود
+                            do gFind.query.pop_back(); while(!gFind.query.empty()&&((Uint8)gFind.query.back()&0xC0)==0x80);
+                            refreshFind(blocks,true);
+                        }
+                        continue;
+                    }
+                    bool ctrl=(e.key.keysym.mod&KMOD_CTRL)!=0, shift=(e.key.keysym.mod&KMOD_SHIFT)!=0;
+                    if(ctrl&&!draggingSprite&&(k==SDLK_z||k==SDLK_y)){
+                        bool redo=k==SDLK_y||shift;
+                        if(redo?redoEdit(blocks,sprites):undoEdit(blocks,sprites)){
+                            if(selectedSpriteIdx>=(int)sprites.size()) selectedSpriteIdx=(int)sprites.size()-1;
+                            for(int j=0;j<(int)sprites.size();j++) sprites[j].selected=(j==selectedSpriteIdx);
+                        }
+                    }
+                    else if(ctrl&&k==SDLK_a) selectAllStacks(blocks);
+                    else if(ctrl&&k==SDLK_c) copySelection(blocks);
+                    else if(ctrl&&k==SDLK_v) pasteClipboard(blocks);
+                    else if(ctrl&&k==SDLK_d) duplicateSelection(blocks);
+                    else if(k==SDLK_DELETE||k==SDLK_BACKSPACE) deleteSelection(blocks);
+                    else if(k==SDLK_ESCAPE) clearSelection();
+                }
                 if(gEdit.active&&gEdit.blockId>=0&&gEdit.fieldIndex>=0){
                     Block* eb=findBlock(blocks,gEdit.blockId);
                     if(eb&&gEdit.fieldIndex<(int)eb->inputs.size()){
                         auto& inp=eb->inputs[gEdit.fieldIndex];
-                        if(e.key.keysym.sym==SDLK_BACKSPACE&&!inp.value.empty()) inp.value.pop_back();
+                        if(e.key.keysym.sym==SDLK_BACKSPACE&&!inp.value.empty()){inp.value.pop_back();gDirtyBlocks.insert(eb->id);}
                         else if(e.key.keysym.sym==SDLK_RETURN||e.key.keysym.sym==SDLK_ESCAPE){inp.editing=false;gEdit.active=false;gEdit.blockId=-1;gEdit.fieldIndex=-1;}
                     }
                 } else if(sprInfoEdit.field>=0&&selectedSpriteIdx<(int)sprites.size()){
@@ -970,6 +5780,7 @@ int main(int argc, char* argv[]) {
                     if(e.key.keysym.sym==SDLK_BACKSPACE&&!sprInfoEdit.buffer.empty()) sprInfoEdit.buffer.pop_back();
                     else if(e.key.keysym.sym==SDLK_RETURN||e.key.keysym.sym==SDLK_ESCAPE){
                         switch(sprInfoEdit.field){case 0:sp.name=sprInfoEdit.buffer;break;case 1:sp.x=atof(sprInfoEdit.buffer.c_str());break;case 2:sp.y=atof(sprInfoEdit.buffer.c_str());break;case 3:sp.size=atof(sprInfoEdit.buffer.c_str());break;case 4:sp.direction=atof(sprInfoEdit.buffer.c_str());break;case 5: sp.ghostEffect = atof(sprInfoEdit.buffer.c_str()); break;}
+                        gDirtySprites.insert(selectedSpriteIdx);
                         sprInfoEdit.field=-1; sprInfoEdit.buffer.clear();
                     }
                 }
@@ -979,55 +5790,50 @@ int main(int argc, char* argv[]) {
             if (e.type==SDL_MOUSEBUTTONDOWN&&e.button.button==SDL_BUTTON_LEFT) {
                 int mx=e.button.x, my=e.button.y;
                 bool clickedOnField=false;
+                if(blockProfTableClick(mx,my,winW,winH)) continue;
+                if(gPresentMode){
+                    SDL_FPoint p=windowToStage(stageViewRect(winW,winH),mx,my);
+                    int si=stageSpriteAt(sprites,p);
+                    if(si>=0){draggingSprite=true;dragSpriteIdx=si;spDragOffX=p.x-sprites[si].x;spDragOffY=p.y-sprites[si].y;}
+                    continue;
+                }
 
-                46545;
-                {
-                    int spriteAreaY = L.TOOLBAR_HEIGHT + L.STAGE_HEIGHT + 5;
-                    int thumbSz = L.SPRITE_THUMB;
-                    int infoY = spriteAreaY + thumbSz + 10;
-                    int infoX = L.PALETTE_WIDTH + 5;
-                    int fieldW2 = (int)(L.STAGE_WIDTH * 0.35f);
-                    int fieldH2 = (int)(22 * L.s);
-
-                    int layerBtnW = (int)(40 * L.s), layerBtnH = fieldH2;
-                    int row3Y = infoY + 2 * (fieldH2 + 8);
-                    int layerBtnY = row3Y;
-
-                    // چک کلیک Front
-                    int frontBtnX = infoX + fieldW2 * 2 - layerBtnW - 5;
-                    if (mx >= frontBtnX && mx <= frontBtnX + layerBtnW &&
-                        my >= layerBtnY && my <= layerBtnY + layerBtnH) {
-                        if (selectedSpriteIdx < (int)sprites.size() && sprites.size() > 1) {
-                            // انتقال به آخرین ایندکس (جلو)
-                            std::swap(sprites[selectedSpriteIdx], sprites.back());
-                            selectedSpriteIdx = (int)sprites.size() - 1;
-                        }
-                        continue;
-                        }
-                    if(costumeEditMode && costumeCanvas) {
-                        int editorX = L.PALETTE_WIDTH + L.STAGE_WIDTH + 20;
-                        int editorY = L.TOOLBAR_HEIGHT + 20;
+                UiHit hit=uiHitTest(mx,my,(int)sprites.size());
+                if (hit.id==UiId::LAYER_FRONT||hit.id==UiId::LAYER_BACK) {
+                    if (selectedSpriteIdx < (int)sprites.size() && sprites.size() > 1) {
+                        // جلو: آخرین ایندکس، عقب: اولین
+                        int to = hit.id==UiId::LAYER_FRONT ? (int)sprites.size() - 1 : 0;
+                        std::swap(sprites[selectedSpriteIdx], sprites[to]);
+                        vector<int> moved(sprites.size());
+                        for (int j = 0; j < (int)moved.size(); j++) moved[j] = j;
+                        std::swap(moved[selectedSpriteIdx], moved[to]);
+                        remapTweenSprites(moved);
+                        gAutosaveSnapshotWanted = true;
+                        selectedSpriteIdx = to;
+                    }
+                    continue;
+                }
+                if(costumeEditMode && costumeCanvas) {
+                    int editorX = L.PALETTE_WIDTH + L.STAGE_WIDTH + 20;
+                    int editorY = L.TOOLBAR_HEIGHT + 20;
 
-                        int drawX = mx - editorX - 20;
-                        int drawY = my - editorY - 20;
+                    int drawX = mx - editorX - 20;
+                    int drawY = my - editorY - 20;
 
-                        if(drawX >= 0 && drawX < canvasW && drawY >= 0 && drawY < canvasH) {
+                    if(drawX >= 0 && drawX < canvasW && drawY >= 0 && drawY < canvasH) {
+                        if(gPaintTool == PaintTool::PEN) {
                             isDrawing = true;
-                            lastDrawX = drawX;
-                            lastDrawY = drawY;
+                            beginCanvasStroke(drawX, drawY);
+                        } else if(gPaintTool == PaintTool::FILL) {
+                            canvasBucketFill(rnd, drawX, drawY);
+                        } else {
+                            gShapeDragging = true;
+                            gShapeX0 = gShapeX1 = drawX;
+                            gShapeY0 = gShapeY1 = drawY;
                         }
                     }
-
-                    int backBtnX = frontBtnX - layerBtnW - 5;
-                    if (mx >= backBtnX && mx <= backBtnX + layerBtnW &&
-                        my >= layerBtnY && my <= layerBtnY + layerBtnH) {
-                        if (selectedSpriteIdx < (int)sprites.size() && sprites.size() > 1) {
-                            std::swap(sprites[selectedSpriteIdx], sprites.front());
-                            selectedSpriteIdx = 0;
-                        }
-                        continue;
-                        }
                 }
+
                 if(costumeEditMode && costumeCanvas) {
                     int editorX = L.PALETTE_WIDTH + L.STAGE_WIDTH + 20;
                     int editorY = L.TOOLBAR_HEIGHT + 20;
@@ -1035,145 +5841,116 @@ int main(int argc, char* argv[]) {
 
                     if(mx >= editorX+20 && mx <= editorX+80 && my >= toolbarY && my <= toolbarY+30) {
                         penColorR = 0; penColorG = 0; penColorB = 0;
+                        gPaintTool = PaintTool::PEN;
                     }
                     if(mx >= editorX+90 && mx <= editorX+150 && my >= toolbarY && my <= toolbarY+30) {
                         penColorR = 255; penColorG = 255; penColorB = 255;
+                        gPaintTool = PaintTool::PEN;
+                    }
+                    int toolRowY = toolbarY + 35;
+                    if(my >= toolRowY && my <= toolRowY+30) {
+                        if(mx >= editorX+20 && mx <= editorX+80)   gPaintTool = PaintTool::FILL;
+                        if(mx >= editorX+90 && mx <= editorX+150)  gPaintTool = PaintTool::RECT;
+                        if(mx >= editorX+160 && mx <= editorX+220) gPaintTool = PaintTool::ELLIPSE;
+                        if(mx >= editorX+230 && mx <= editorX+290) gPaintTool = PaintTool::LINE;
                     }
                     if(mx >= editorX+160 && mx <= editorX+220 && my >= toolbarY && my <= toolbarY+30) {
                         if(selectedCostumeSpriteIdx >= 0 && selectedCostumeSpriteIdx < (int)sprites.size()) {
-                            if(sprites[selectedCostumeSpriteIdx].uploadedTexture)
-                                SDL_DestroyTexture(sprites[selectedCostumeSpriteIdx].uploadedTexture);
-                            sprites[selectedCostumeSpriteIdx].uploadedTexture = costumeCanvas;
+                            Sprite& csp = sprites[selectedCostumeSpriteIdx];
+                            syncCanvasMirror(rnd);
+                            Costume c;
+                            c.name = "costume" + intToString((int)csp.costumes.size() + 1);
+                            c.primaryColor = csp.color;
+                            c.texture = costumeCanvas;
+                            c.width = canvasW; c.height = canvasH;
+                            c.file = "costumes/" + csp.name + "_" + c.name + ".png";
+                            c.saveJobId = queueCostumeSave(c.file, gCanvasPixels, canvasW, canvasH);
+                            gSaveStatusText = "Saving " + c.file;
+                            gSaveStatusTimer = 0;
+                            csp.costumes.push_back(c);
+                            csp.currentCostume = (int)csp.costumes.size() - 1;
+                            gAutosaveSnapshotWanted = true;
                             costumeCanvas = nullptr;
                         }
                         costumeEditMode = false;
+                        clearCanvasHistory();
                     }
                     if(mx >= editorX+230 && mx <= editorX+290 && my >= toolbarY && my <= toolbarY+30) {
                         if(costumeCanvas) SDL_DestroyTexture(costumeCanvas);
                         costumeCanvas = nullptr;
                         costumeEditMode = false;
+                        clearCanvasHistory();
                     }
+                    if(mx >= editorX+300 && mx <= editorX+360 && my >= toolbarY && my <= toolbarY+30) canvasUndo(rnd);
+                    if(mx >= editorX+370 && mx <= editorX+430 && my >= toolbarY && my <= toolbarY+30) canvasRedo(rnd);
                 }
-                int panelX=L.PALETTE_WIDTH, stageW=L.STAGE_WIDTH;
-                int spriteAreaY=L.TOOLBAR_HEIGHT+L.STAGE_HEIGHT+5;
-                int thumbSize=L.SPRITE_THUMB;
-                int infoY=spriteAreaY+thumbSize+10, infoX=panelX+5;
-                int fieldW2=(int)(stageW*0.35f), fieldH2=(int)(22*L.s);
-                                    infoY=spriteAreaY+thumbSize+10, infoX=panelX+5;
-
                 // کلیک روی دکمه Upload
-                {
-
-                    int spriteAreaY = L.TOOLBAR_HEIGHT + L.STAGE_HEIGHT + 5;
-                    int thumbSz = L.SPRITE_THUMB;
-                    int infoY = spriteAreaY + thumbSz + 10;
-                    int infoX = L.PALETTE_WIDTH + 5;
-                    int fieldW2 = (int)(L.STAGE_WIDTH * 0.35f);
-                    int fieldH2 = (int)(22 * L.s);
-
-                    int uploadBtnW = (int)(60 * L.s), uploadBtnH = fieldH2;
-                    int uploadBtnX = infoX + fieldW2 * 2 - uploadBtnW - 10;
-                    int uploadBtnY = infoY;
-
-
-                    if(mx >= uploadBtnX && mx <= uploadBtnX + uploadBtnW &&
-                       my >= uploadBtnY && my <= uploadBtnY + uploadBtnH) {
-
-                        if(selectedSpriteIdx < (int)sprites.size()) {
-                            // باز کردن پنجره انتخاب فایل
-                            const char* filters[3] = { "*.png", "*.jpg", "*.jpeg" };
-                            const char* fileName = tinyfd_openFileDialog(
-                                "Select Image",           // عنوان پنجره
-                                "",                        // پوشه پیش‌فرض
-                                3,                         // تعداد فیلترها
-                                filters,                   // فیلترها
-                                "Image files",             // توضیح فیلتر
-                                0                          // چند انتخابی نباشد
-                            );
-
-                            if(fileName != NULL) {
-                                SDL_Surface* surf = IMG_Load(fileName);
-                                if(surf) {
-                                    if(sprites[selectedSpriteIdx].uploadedTexture)
-                                        SDL_DestroyTexture(sprites[selectedSpriteIdx].uploadedTexture);
-                                    sprites[selectedSpriteIdx].uploadedTexture = SDL_CreateTextureFromSurface(rnd, surf);
-                                    SDL_FreeSurface(surf);
-                                    cout << "Image loaded: " << fileName << endl;
-                                } else {
-                                    cout << "Failed to load: " << IMG_GetError() << endl;
-                                }
+                if (hit.id==UiId::UPLOAD) {
+                    if(selectedSpriteIdx < (int)sprites.size()) {
+                        // باز کردن پنجره انتخاب فایل
+                        const char* filters[3] = { "*.png", "*.jpg", "*.jpeg" };
+                        const char* fileName = inputDialog([&]{ return tinyfd_openFileDialog(
+                            "Select Image",           // عنوان پنجره
+                            "",                        // پوشه پیش‌فرض
+                            3,                         // تعداد فیلترها
+                            filters,                   // فیلترها
+                            "Image files",             // توضیح فیلتر
+                            0                          // چند انتخابی نباشد
+                        ); });
+
+                        if(fileName != NULL) {
+                            SDL_Surface* surf = IMG_Load(fileName);
+                            if(surf) {
+                                retireTexture(sprites[selectedSpriteIdx].uploadedTexture);
+                                sprites[selectedSpriteIdx].uploadedTexture = SDL_CreateTextureFromSurface(rnd, surf);
+                                sprites[selectedSpriteIdx].uploadedFile = fileName;
+                                sprites[selectedSpriteIdx].uploadedAsset = nullptr;
+                                sprites[selectedSpriteIdx].uploadedAssetSize = 0;
+                                gDirtySprites.insert(selectedSpriteIdx);
+                                sprites[selectedSpriteIdx].currentCostume = 0;
+                                SDL_FreeSurface(surf);
+                                cout << "Image loaded: " << fileName << endl;
+                            } else {
+                                cout << "Failed to load: " << IMG_GetError() << endl;
                             }
                         }
-                       }
+                    }
                 }
 
-                {
-                    int spriteAreaY = L.TOOLBAR_HEIGHT + L.STAGE_HEIGHT + 5;
-                    int thumbSz = L.SPRITE_THUMB;
-                    int infoY = spriteAreaY + thumbSz + 10;
-                    int infoX = L.PALETTE_WIDTH + 5;
-                    int fieldW2 = (int)(L.STAGE_WIDTH * 0.35f);
-                    int fieldH2 = (int)(22 * L.s);
-
-                    int editBtnW = (int)(60*L.s), editBtnH = fieldH2;
-                    int uploadBtnW = (int)(60*L.s);
-                    int editBtnX = infoX + fieldW2*2 - uploadBtnW - editBtnW - 15;
-                    int editBtnY = infoY;
-
-
-                    if(mx >= editBtnX && mx <= editBtnX + editBtnW &&
-                       my >= editBtnY && my <= editBtnY + editBtnH) {
-                        costumeEditMode = !costumeEditMode;
-                        if(costumeEditMode) {
-                            selectedCostumeSpriteIdx = selectedSpriteIdx;
-                            if(costumeCanvas) SDL_DestroyTexture(costumeCanvas);
-                            costumeCanvas = SDL_CreateTexture(rnd, SDL_PIXELFORMAT_RGBA8888,
-                                                              SDL_TEXTUREACCESS_TARGET, canvasW, canvasH);
-                            SDL_SetRenderTarget(rnd, costumeCanvas);
-                            SDL_SetRenderDrawColor(rnd, 255, 255, 255, 255);
-                            SDL_RenderClear(rnd);
-                            SDL_SetRenderTarget(rnd, nullptr);
-                        }
-                       }
-                }
-                // ── Check sprite info panel fields ──
-                {
-                    int panelX=L.PALETTE_WIDTH, stageW=L.STAGE_WIDTH;
-                    int spriteAreaY=L.TOOLBAR_HEIGHT+L.STAGE_HEIGHT+5;
-                    int thumbSize=L.SPRITE_THUMB;
-                    int infoY=spriteAreaY+thumbSize+10, infoX=panelX+5;
-                    int fieldW2=(int)(stageW*0.35f), fieldH2=(int)(22*L.s);
-                    struct FieldRect{int x,y,w,h,idx;};
-                    vector<FieldRect> fields;
-                    fields.push_back({infoX+(int)(40*L.s),infoY,fieldW2*2,fieldH2,0});
-                    fields.push_back({infoX+(int)(15*L.s),infoY+fieldH2+8,fieldW2-(int)(20*L.s),fieldH2,1});
-                    fields.push_back({infoX+fieldW2+(int)(15*L.s),infoY+fieldH2+8,fieldW2-(int)(20*L.s),fieldH2,2});
-                    fields.push_back({infoX+(int)(30*L.s),infoY+2*(fieldH2+8),fieldW2-(int)(20*L.s),fieldH2,3});
-
-                    fields.push_back({infoX+fieldW2+(int)(25*L.s),infoY+2*(fieldH2+8),fieldW2-(int)(20*L.s),fieldH2,4});
-                    fields.push_back({infoX+(int)(30*L.s), infoY+3*(fieldH2+8), fieldW2-(int)(20*L.s), fieldH2, 5});
-                    for (auto& fr:fields) {
-                        if(mx>=fr.x&&mx<=fr.x+fr.w&&my>=fr.y&&my<=fr.y+fr.h){
-                            if(selectedSpriteIdx<(int)sprites.size()){
-                                Sprite& sp=sprites[selectedSpriteIdx];
-                                sprInfoEdit.field=fr.idx;
-                                switch(fr.idx){case 0:sprInfoEdit.buffer=sp.name;break;case 1:sprInfoEdit.buffer=floatToString(sp.x);break;case 2:sprInfoEdit.buffer=floatToString(sp.y);break;case 3:sprInfoEdit.buffer=floatToString(sp.size);break;case 4:sprInfoEdit.buffer=floatToString(sp.direction);break;    case 5: sprInfoEdit.buffer=floatToString(sp.ghostEffect); break;}
-                                clickedOnField=true;
-                                if(gEdit.active&&gEdit.blockId>=0){Block* eb=findBlock(blocks,gEdit.blockId);if(eb&&gEdit.fieldIndex>=0&&gEdit.fieldIndex<(int)eb->inputs.size())eb->inputs[gEdit.fieldIndex].editing=false;gEdit.active=false;}
-                            }
-                            break;
-                        }
+                if (hit.id==UiId::EDIT_COSTUME) {
+                    costumeEditMode = !costumeEditMode;
+                    if(costumeEditMode) {
+                        selectedCostumeSpriteIdx = selectedSpriteIdx;
+                        if(costumeCanvas) SDL_DestroyTexture(costumeCanvas);
+                        costumeCanvas = SDL_CreateTexture(rnd, SDL_PIXELFORMAT_RGBA8888,
+                                                          SDL_TEXTUREACCESS_TARGET, canvasW, canvasH);
+                        SDL_SetRenderTarget(rnd, costumeCanvas);
+                        SDL_SetRenderDrawColor(rnd, 255, 255, 255, 255);
+                        renderClear(rnd);
+                        SDL_SetRenderTarget(rnd, nullptr);
+                        clearCanvasHistory();
+                        resetCanvasMirror(0xFFFFFFFFu);
                     }
                 }
 
+                // ── Sprite info panel fields ──
+                if (hit.id==UiId::SPRITE_FIELD&&selectedSpriteIdx<(int)sprites.size()) {
+                    Sprite& sp=sprites[selectedSpriteIdx];
+                    sprInfoEdit.field=hit.index;
+                    switch(hit.index){case 0:sprInfoEdit.buffer=sp.name;break;case 1:sprInfoEdit.buffer=floatToString(sp.x);break;case 2:sprInfoEdit.buffer=floatToString(sp.y);break;case 3:sprInfoEdit.buffer=floatToString(sp.size);break;case 4:sprInfoEdit.buffer=floatToString(sp.direction);break;    case 5: sprInfoEdit.buffer=floatToString(sp.ghostEffect); break;}
+                    clickedOnField=true;
+                    if(gEdit.active&&gEdit.blockId>=0){Block* eb=findBlock(blocks,gEdit.blockId);if(eb&&gEdit.fieldIndex>=0&&gEdit.fieldIndex<(int)eb->inputs.size())eb->inputs[gEdit.fieldIndex].editing=false;gEdit.active=false;}
+                }
+
                 // ── Check block input fields ──
-                if (!clickedOnField) {
+                float dmx=L.designX((float)mx), dmy=L.designY((float)my);
+                bool inWs=mx>=L.WS_X&&my>L.TOOLBAR_HEIGHT;
+                if (!clickedOnField&&inWs) {
                     for (auto& b:blocks) {
-                        if(b.inPalette) continue;
                         for(int fi=0;fi<(int)b.inputs.size();fi++){
                             auto& inp=b.inputs[fi];
-                            int fx=(int)b.x+(int)inp.relX,fy=(int)b.y+(int)inp.relY,fw=(int)inp.width,fh=(int)inp.height;
-                            if(mx>=fx&&mx<=fx+fw&&my>=fy&&my<=fy+fh){
+                            float fx=b.x+inp.relX,fy=b.y+inp.relY;
+                            if(dmx>=fx&&dmx<=fx+inp.width&&dmy>=fy&&dmy<=fy+inp.height){
                                 if(gEdit.active&&gEdit.blockId>=0){Block* prevB=findBlock(blocks,gEdit.blockId);if(prevB&&gEdit.fieldIndex>=0&&gEdit.fieldIndex<(int)prevB->inputs.size())prevB->inputs[gEdit.fieldIndex].editing=false;}
                                 sprInfoEdit.field=-1;
                                 inp.editing=true;gEdit.active=true;gEdit.blockId=b.id;gEdit.fieldIndex=fi;clickedOnField=true;break;
@@ -1190,158 +5967,123 @@ int main(int argc, char* argv[]) {
                     if(sprInfoEdit.field>=0&&selectedSpriteIdx<(int)sprites.size()){
                         Sprite& sp=sprites[selectedSpriteIdx];
                         switch(sprInfoEdit.field){case 0:sp.name=sprInfoEdit.buffer;break;case 1:sp.x=atof(sprInfoEdit.buffer.c_str());break;case 2:sp.y=atof(sprInfoEdit.buffer.c_str());break;case 3:sp.size=atof(sprInfoEdit.buffer.c_str());break;case 4:sp.direction=atof(sprInfoEdit.buffer.c_str());break;case 5: sp.ghostEffect = atof(sprInfoEdit.buffer.c_str()); break;}
+                        gDirtySprites.insert(selectedSpriteIdx);
                     }
                     sprInfoEdit.field=-1; sprInfoEdit.buffer.clear();
                 }
 
                 // ── Toolbar buttons ──
                 // کلیک روی دکمه BG
-                {
-                    int bgBtnX = L.PALETTE_WIDTH + L.STAGE_WIDTH - (int)(35*L.s);
-                    int bgBtnY = L.TOOLBAR_HEIGHT + 3;
-                    int bgBtnW = (int)(32*L.s);
-                    int bgBtnH = (int)(18*L.s);
-                    if(mx>=bgBtnX && mx<=bgBtnX+bgBtnW && my>=bgBtnY && my<=bgBtnY+bgBtnH){
-                        gBgColor = (gBgColor + 1) % NUM_BG_COLORS;
-                        continue;
-                    }
-                    //////////////
-                    ///
-                    ///
+                if (hit.id==UiId::STAGE_BG) {
+                    gBgColor = (gBgColor + 1) % NUM_BG_COLORS;
+                    journalStage();
+                    continue;
                 }
-               ////////////////
-               ///
                 if (my<L.TOOLBAR_HEIGHT) {
-                    int flagX=(int)(winW*0.4f),flagY=5,flagSz=L.TOOLBAR_HEIGHT-10;
-                    if(mx>=flagX&&mx<=flagX+flagSz&&my>=flagY&&my<=flagY+flagSz) {
-                        gIsRunning=true;
-                        gHighlightBlockId=-1;
-                    }                    int stopX=flagX+flagSz+10;
-                    if(mx>=stopX&&mx<=stopX+flagSz&&my>=flagY&&my<=flagY+flagSz) gIsRunning=false;
-                    int resetX=stopX+flagSz+10;
-                    if(mx>=resetX&&mx<=resetX+(int)(60*L.s)&&my>=flagY&&my<=flagY+flagSz){resetProject(blocks,sprites);selectedSpriteIdx=0;}
+                    if(hit.id==UiId::FLAG) startGreenFlag(blocks,sprites);
+                    if(hit.id==UiId::STOP) stopAllScripts();
+                    if(hit.id==UiId::RESET){resetProject(blocks,sprites);selectedSpriteIdx=0;}
                     continue;
                 }
 
                 // ── Category buttons ──
                 if (mx<L.CAT_PANEL_WIDTH&&my>L.TOOLBAR_HEIGHT) {
-                    int catY=L.TOOLBAR_HEIGHT+5;
-                    for(int i=0;i<NUM_CATEGORIES;i++){int btnY=catY+i*(L.CAT_BTN_HEIGHT+3);if(my>=btnY&&my<=btnY+L.CAT_BTN_HEIGHT){selectedCategory=(Category)i;paletteScrollY=0;break;}}
+                    if(hit.id==UiId::CATEGORY){selectedCategory=(Category)hit.index;paletteScrollY=0;}
                     continue;
                 }
 
                 // ── Add sprite button ──
-                {
-                    int stageRight=L.PALETTE_WIDTH+L.STAGE_WIDTH;
-                    int spriteAreaY=L.TOOLBAR_HEIGHT+L.STAGE_HEIGHT+5;
-                    int addBtnX=stageRight-(int)(40*L.s),addBtnY=spriteAreaY,addBtnSz=(int)(30*L.s);
-                    if(mx>=addBtnX&&mx<=addBtnX+addBtnSz&&my>=addBtnY&&my<=addBtnY+addBtnSz){
-                        string newName="Sprite"+intToString(gNextSpriteNum++);
-                        SDL_Color colors[]={{66,133,244,255},{255,100,100,255},{100,200,100,255},{200,100,200,255},{100,200,200,255},{255,200,0,255}};
-                        SDL_Color newCol=colors[(sprites.size())%6];
-                        float nx=(float)((rand()%200)-100),ny=(float)((rand()%200)-100);
-                        sprites.push_back(createDefaultSprite(newName.c_str(),nx,ny,newCol));
-                        selectedSpriteIdx=(int)sprites.size()-1;
-                        for(int si=0;si<(int)sprites.size();si++) sprites[si].selected=(si==selectedSpriteIdx);
-                        continue;
-                    }
+                if (hit.id==UiId::ADD_SPRITE) {
+                    string newName="Sprite"+intToString(gNextSpriteNum++);
+                    SDL_Color colors[]={{66,133,244,255},{255,100,100,255},{100,200,100,255},{200,100,200,255},{100,200,200,255},{255,200,0,255}};
+                    SDL_Color newCol=colors[(sprites.size())%6];
+                    float nx=(float)((rand()%200)-100),ny=(float)((rand()%200)-100);
+                    sprites.push_back(createDefaultSprite(newName.c_str(),nx,ny,newCol));
+                    gAutosaveSnapshotWanted=true;
+                    selectedSpriteIdx=(int)sprites.size()-1;
+                    for(int si=0;si<(int)sprites.size();si++) sprites[si].selected=(si==selectedSpriteIdx);
+                    scrollThumbIntoView(selectedSpriteIdx,(int)sprites.size());
+                    continue;
                 }
 
                 // ── Sprite thumbnails click ──
-                {
-                    int spriteAreaY=L.TOOLBAR_HEIGHT+L.STAGE_HEIGHT+5;
-                    int thumbSz=L.SPRITE_THUMB, startX=L.PALETTE_WIDTH+5;
-                    int delBtnSize=(int)(16*L.s);
-                    int eyeBtnSize=(int)(16*L.s);
-                    bool handledSprite=false;
-
-                    for(int si=0;si<(int)sprites.size();si++){
-                        int tx=startX+si*(thumbSz+8), ty=spriteAreaY;
-
-                        // چک کلیک روی دکمه چشم (show/hide)
-                        int eyeBtnX=tx+thumbSz-delBtnSize-eyeBtnSize-6, eyeBtnY=ty+2;
-                        if(mx>=eyeBtnX&&mx<=eyeBtnX+eyeBtnSize&&my>=eyeBtnY&&my<=eyeBtnY+eyeBtnSize){
-                            sprites[si].visible=!sprites[si].visible;
-                            handledSprite=true; break;
-                        }
-
-                        // چک کلیک روی دکمه X (حذف)
-                        int delBtnX=tx+thumbSz-delBtnSize-2, delBtnY=ty+2;
-                        if(mx>=delBtnX&&mx<=delBtnX+delBtnSize&&my>=delBtnY&&my<=delBtnY+delBtnSize){
-                            if(sprites.size()>1){
-                                sprites.erase(sprites.begin()+si);
-                                if(selectedSpriteIdx>=(int)sprites.size()) selectedSpriteIdx=(int)sprites.size()-1;
-                                for(int j=0;j<(int)sprites.size();j++) sprites[j].selected=(j==selectedSpriteIdx);
-                            }
-                            handledSprite=true; break;
+                if ((hit.id==UiId::THUMB||hit.id==UiId::THUMB_EYE||hit.id==UiId::THUMB_DELETE)&&hit.index<(int)sprites.size()) {
+                    int si=hit.index;
+                    if (hit.id==UiId::THUMB_EYE) {
+                        // دکمه چشم (show/hide)
+                        sprites[si].visible=!sprites[si].visible;
+                        gDirtySprites.insert(si);
+                    } else if (hit.id==UiId::THUMB_DELETE) {
+                        // دکمه X (حذف)
+                        if(sprites.size()>1){
+                            retireTexture(sprites[si].uploadedTexture);
+                            for(auto& c:sprites[si].costumes) retireTexture(c.texture);
+                            sprites.erase(sprites.begin()+si);
+                            vector<int> to((int)sprites.size()+1);
+                            for(int j=0;j<(int)to.size();j++) to[j]=j<si?j:j==si?-1:j-1;
+                            remapTweenSprites(to);
+                            gAutosaveSnapshotWanted=true;
+                            if(selectedSpriteIdx>=(int)sprites.size()) selectedSpriteIdx=(int)sprites.size()-1;
+                            for(int j=0;j<(int)sprites.size();j++) sprites[j].selected=(j==selectedSpriteIdx);
                         }
-
+                    } else if (hit.id==UiId::THUMB) {
                         // کلیک عادی برای انتخاب
-                        if(mx>=tx&&mx<=tx+thumbSz&&my>=ty&&my<=ty+thumbSz){
-                            selectedSpriteIdx=si;
-                            for(int j=0;j<(int)sprites.size();j++) sprites[j].selected=(j==si);
-                            handledSprite=true; break;
-                        }
+                        selectedSpriteIdx=si;
+                        for(int j=0;j<(int)sprites.size();j++) sprites[j].selected=(j==si);
+                        scrollThumbIntoView(si,(int)sprites.size());
                     }
                 }
 
                 // ── Stage sprite drag ──
                 if (!clickedOnField) {
-                    int stageX=L.PALETTE_WIDTH,stageY=L.TOOLBAR_HEIGHT,stageW=L.STAGE_WIDTH,stageH=L.STAGE_HEIGHT;
-                    int stageCX=stageX+stageW/2, stageCY=stageY+stageH/2;
-                    if(mx>=stageX&&mx<=stageX+stageW&&my>=stageY&&my<=stageY+stageH){
-                        for(int si=(int)sprites.size()-1;si>=0;si--){
-                            Sprite& sp=sprites[si];
-                            if(!sp.visible) continue;
-                            int sx=stageCX+(int)sp.x, sy=stageCY-(int)sp.y;
-                            int spSz=(int)(30*L.s*sp.size/100.0f);
-                            if(abs(mx-sx)<spSz&&abs(my-sy)<spSz){
-                                draggingSprite=true; dragSpriteIdx=si;
-                                spDragOffX=mx-sx; spDragOffY=my-sy;
-                                selectedSpriteIdx=si;
-                                for(int j=0;j<(int)sprites.size();j++) sprites[j].selected=(j==si);
-                                break;
-                            }
-                        }
+                    SDL_Rect view=stageViewRect(winW,winH);
+                    SDL_FPoint p=windowToStage(view,mx,my);
+                    int si=inRect(view,mx,my)?stageSpriteAt(sprites,p):-1;
+                    if(si>=0){
+                        draggingSprite=true; dragSpriteIdx=si;
+                        spDragOffX=p.x-sprites[si].x; spDragOffY=p.y-sprites[si].y;
+                        selectedSpriteIdx=si;
+                        for(int j=0;j<(int)sprites.size();j++) sprites[j].selected=(j==si);
                     }
                 }
 
                 // ── Block drag ──
                 if (!clickedOnField&&!draggingSprite) {
-                    for(int i=(int)blocks.size()-1;i>=0;i--){
+                    for(int i=inWs?(int)blocks.size()-1:-1;i>=0;i--){
                         Block& b=blocks[i];
-                        if(b.inPalette) continue;
-                        int bx=(int)b.x,by=(int)b.y,bw2=(int)b.w,bh2=(int)b.h;
-                        if(mx>=bx&&mx<=bx+bw2&&my>=by&&my<=by+bh2){detachBlock(blocks,b.id);dragBlockId=b.id;dragOffX=mx-b.x;dragOffY=my-b.y;break;}
-                    }
-                    if(dragBlockId<0){
-                        int palX=L.CAT_PANEL_WIDTH;
-                        float yy=(float)(L.TOOLBAR_HEIGHT+5+paletteScrollY);
-                        for(auto& b:blocks){
-                            if(!b.inPalette||b.cat!=selectedCategory) continue;
-                            float drawX=(float)palX+5,drawY=yy;
-                            if(mx>=drawX&&mx<=drawX+b.w&&my>=drawY&&my<=drawY+b.h&&my>L.TOOLBAR_HEIGHT){
-                                Block nb=cloneBlock(b,(float)mx-b.w/2,(float)my-b.h/2);
-                                blocks.push_back(nb);dragBlockId=nb.id;dragOffX=b.w/2;dragOffY=b.h/2;break;
-                            }
-                            yy+=b.h+8*L.s;
+                        if(dmx>=b.x&&dmx<=b.x+b.w&&dmy>=b.y&&dmy<=b.y+b.h){
+                            dragBlockId=b.id;dragOffX=dmx-b.x;dragOffY=dmy-b.y;
+                            markSelection(blocks);
+                            // بلوک عضو انتخاب چندتایی: همه پشته‌های انتخاب‌شده با هم کشیده می‌شوند
+                            if(gSelectedRoots.size()>1&&isSelected(i)) beginSelectionDrag(blocks);
+                            else{clearSelection();detachBlock(blocks,b.id);beginStackDrag(blocks,b.id);}
+                            break;
                         }
                     }
+                    const Block* pb=dragBlockId<0&&my>L.TOOLBAR_HEIGHT?paletteHitTest(selectedCategory,(float)(mx-L.CAT_PANEL_WIDTH),(float)(my-L.TOOLBAR_HEIGHT-paletteScrollY)):nullptr;
+                    if(pb){
+                        Block nb=cloneBlock(*pb,dmx-pb->w/2,dmy-pb->h/2);
+                        blocks.push_back(nb);journalClone(pb->id,nb.id);dragBlockId=nb.id;dragOffX=pb->w/2;dragOffY=pb->h/2;beginStackDrag(blocks,nb.id);
+                    }
+                    // ── Rubber band ──
+                    if(dragBlockId<0&&hit.id==UiId::NONE&&!costumeEditMode&&inWs)
+                        beginRubberBand(blocks,dmx,dmy,(gInputMods&KMOD_SHIFT)!=0);
                 }
             } // end MOUSE DOWN
 
             // MOUSE MOTION
             if (e.type==SDL_MOUSEMOTION) {
                 int mx=e.motion.x, my=e.motion.y;
-                if(dragBlockId>=0){Block* db=findBlock(blocks,dragBlockId);if(db){float newX=mx-dragOffX,newY=my-dragOffY;moveBlockChain(blocks,dragBlockId,newX-db->x,newY-db->y);}}
+                if(dragBlockId>=0){Block* db=findBlock(blocks,dragBlockId);if(db){gStackDrag.dx=L.designX((float)mx)-dragOffX-db->x;gStackDrag.dy=L.designY((float)my)-dragOffY-db->y;}}
+                if(gBand.active) updateRubberBand(L.designX((float)mx),L.designY((float)my));
                 if(draggingSprite&&dragSpriteIdx>=0&&dragSpriteIdx<(int)sprites.size()){
-                    int stageX=L.PALETTE_WIDTH,stageY=L.TOOLBAR_HEIGHT,stageW=L.STAGE_WIDTH,stageH=L.STAGE_HEIGHT;
-                    int stageCX=stageX+stageW/2, stageCY=stageY+stageH/2;
-                    sprites[dragSpriteIdx].x=(float)(mx-spDragOffX-stageCX);
-                    sprites[dragSpriteIdx].y=(float)(stageCY-(my-spDragOffY));
+                    SDL_FPoint p=windowToStage(stageViewRect(winW,winH),mx,my);
+                    sprites[dragSpriteIdx].x=p.x-spDragOffX;
+                    sprites[dragSpriteIdx].y=p.y-spDragOffY;
+                    gDirtySprites.insert(dragSpriteIdx);
                 }
 
-                { int flagX=(int)(winW*0.4f),flagSz=L.TOOLBAR_HEIGHT-10,resetX=flagX+2*(flagSz+10); resetHovered=(mx>=resetX&&mx<=resetX+(int)(60*L.s)&&my>=5&&my<=5+flagSz); }
+                resetHovered=inRect(uiRect(UiId::RESET),mx,my);
                 if(costumeEditMode && costumeCanvas && isDrawing) {
                     int editorX = L.PALETTE_WIDTH + L.STAGE_WIDTH + 20;
                     int editorY = L.TOOLBAR_HEIGHT + 20;
@@ -1350,80 +6092,114 @@ int main(int argc, char* argv[]) {
                     int drawY = my - editorY - 20;
 
                     if(drawX >= 0 && drawX < canvasW && drawY >= 0 && drawY < canvasH) {
-                        SDL_SetRenderTarget(rnd, costumeCanvas);
-                        SDL_SetRenderDrawColor(rnd, penColorR, penColorG, penColorB, 255);
-
-                        if(lastDrawX >= 0 && lastDrawY >= 0) {
-                            SDL_RenderDrawLine(rnd, lastDrawX, lastDrawY, drawX, drawY);
-                        }
-
-                        SDL_SetRenderTarget(rnd, nullptr);
-                        lastDrawX = drawX;
-                        lastDrawY = drawY;
+                        addCanvasStrokePoint(drawX, drawY);
                     }
                 }
+                if(costumeEditMode && costumeCanvas && gShapeDragging) {
+                    int editorX = L.PALETTE_WIDTH + L.STAGE_WIDTH + 20;
+                    int editorY = L.TOOLBAR_HEIGHT + 20;
+                    gShapeX1 = max(0, min(canvasW - 1, mx - editorX - 20));
+                    gShapeY1 = max(0, min(canvasH - 1, my - editorY - 20));
+                }
             }
 
             // MOUSE UP
             if (e.type==SDL_MOUSEBUTTONUP&&e.button.button==SDL_BUTTON_LEFT) {
-                if(costumeEditMode) {
+                if(costumeEditMode && isDrawing) {
+                    endCanvasStroke(rnd);
                     isDrawing = false;
-                    lastDrawX = -1;
-                    lastDrawY = -1;
                 }
+                if(costumeEditMode && costumeCanvas && gShapeDragging) commitCanvasShape(rnd);
+                gBand.active=false;
                 if(dragBlockId>=0){
+                    bool group=gSelectedRoots.size()>1;
+                    vector<Uint8> members=gStackDrag.member;
+                    endStackDrag(blocks);
                     Block* db=findBlock(blocks,dragBlockId);
                     if(db){
-                        if(db->x<L.PALETTE_WIDTH) blocks.erase(remove_if(blocks.begin(),blocks.end(),[&](const Block& b){return b.id==dragBlockId;}),blocks.end());
-                        else{trySnapBlocks(blocks,dragBlockId);for(auto& b:blocks){if(!b.inPalette&&b.shape==BlockShape::C_BLOCK){b.h=calcCBlockHeight(blocks,b);updateCBlockChildren(blocks,b);}}}
+                        if(L.blockPxX(db->x)<L.PALETTE_WIDTH){
+                            // رها شدن روی پالت: هر چه کشیده شده (پشته یا انتخاب) حذف می‌شود
+                            deleteMarkedBlocks(blocks,members);
+                            if(group) clearSelection();
+                        }
+                        else if(!group){trySnapBlocks(blocks,dragBlockId);for(auto& b:blocks){if(b.shape==BlockShape::C_BLOCK)updateCBlockChildren(blocks,b);}}
                     }
                     dragBlockId=-1;
                 }
                 draggingSprite=false; dragSpriteIdx=-1;
             }
         } // end event loop
+        PROF_END(profEvents);
+
+        if (dragBlockId<0&&!draggingSprite) {
+            recordUndoStep(blocks, sprites, gEdit.active ? gEdit.blockId : -1);
+            updateSearchIndex(blocks);
+            if (gInputMode==InputMode::LIVE) flushAutosave(blocks, sprites);
+            else discardAutosaveChanges();
+            refreshFind(blocks, false);
+        }
 
         // ════════════════════════════════════════════
         //  RENDER
         // ════════════════════════════════════════════
+        auto finishFrame=[&](){
+            {
+                PROF_SCOPE(PP_PRESENT);
+                SDL_RenderPresent(rnd);
+            }
+            if (gInputMode != InputMode::REPLAY) SDL_Delay(16);
+            profFrameEnd();
+            if (!inputFrameEnd(chrono::duration<float, milli>(chrono::steady_clock::now() - frameStart).count())) running = false;
+        };
+        if (gPresentMode) {
+            {
+                PROF_SCOPE(PP_STAGE);
+                SDL_SetRenderDrawColor(rnd,0,0,0,255);
+                renderClear(rnd);
+                presentStage(rnd, stageViewRect(winW,winH), sprites, dt, -1, false);
+            }
+            drawProfilerHud(rnd, winW);
+            finishFrame();
+            continue;
+        }
+        if(costumeEditMode && isDrawing) flushCanvasStroke(rnd);
         SDL_SetRenderDrawColor(rnd,240,240,240,255);
-        SDL_RenderClear(rnd);
+        renderClear(rnd);
 
         // ── Toolbar ──
         {
+            PROF_SCOPE(PP_TOOLBAR);
             for (int i = 0; i < winW; i += 20) {
                 Uint8 r = (Uint8)(128 + 127 * sin((i + gToolbarAnimOffset) * 0.05));
                 Uint8 g = (Uint8)(128 + 127 * sin((i + gToolbarAnimOffset) * 0.05 + 2));
                 Uint8 b = (Uint8)(128 + 127 * sin((i + gToolbarAnimOffset) * 0.05 + 4));
                 SDL_SetRenderDrawColor(rnd, r, g, b, 255);
                 SDL_Rect bar = {i, 0, 20, 3};
-                SDL_RenderFillRect(rnd, &bar);
+                renderFillRect(rnd, &bar);
             }
             gToolbarAnimOffset += 0.5f;
             SDL_SetRenderDrawColor(rnd,55,55,70,255);
-            SDL_Rect toolbar={0,0,winW,L.TOOLBAR_HEIGHT}; SDL_RenderFillRect(rnd,&toolbar);
+            SDL_Rect toolbar={0,0,winW,L.TOOLBAR_HEIGHT}; renderFillRect(rnd,&toolbar);
             drawText(rnd,10,(L.TOOLBAR_HEIGHT-textHeight("Scratch IDE"))/2,"Scratch IDE",255,255,255,255);
-            int flagX=(int)(winW*0.4f),flagY=5,flagSz=L.TOOLBAR_HEIGHT-10;
-            fillRoundedRect(rnd,flagX,flagY,flagSz,flagSz,6,gIsRunning?0:30,gIsRunning?180:150,gIsRunning?0:30,255);
-            drawText(rnd,flagX+flagSz/4,flagY+flagSz/4,">",255,255,255,255);
-            int stopX=flagX+flagSz+10;
-            fillRoundedRect(rnd,stopX,flagY,flagSz,flagSz,6,200,50,50,255);
-            drawText(rnd,stopX+flagSz/4,flagY+flagSz/4,"#",255,255,255,255);
-            int resetX=stopX+flagSz+10, resetW=(int)(60*L.s);
-            fillRoundedRect(rnd,resetX,flagY,resetW,flagSz,6,resetHovered?100:80,resetHovered?100:80,resetHovered?120:100,255);
-            drawText(rnd,resetX+5,flagY+flagSz/4,"Reset",255,255,255,255);
+            SDL_Rect fr=uiRect(UiId::FLAG), sr=uiRect(UiId::STOP), rr=uiRect(UiId::RESET);
+            fillRoundedRect(rnd,fr.x,fr.y,fr.w,fr.h,6,gIsRunning?0:30,gIsRunning?180:150,gIsRunning?0:30,255);
+            drawText(rnd,fr.x+fr.w/4,fr.y+fr.h/4,">",255,255,255,255);
+            fillRoundedRect(rnd,sr.x,sr.y,sr.w,sr.h,6,200,50,50,255);
+            drawText(rnd,sr.x+sr.w/4,sr.y+sr.h/4,"#",255,255,255,255);
+            fillRoundedRect(rnd,rr.x,rr.y,rr.w,rr.h,6,resetHovered?100:80,resetHovered?100:80,resetHovered?120:100,255);
+            drawText(rnd,rr.x+5,rr.y+rr.h/4,"Reset",255,255,255,255);
             char timerBuf[32]; snprintf(timerBuf,sizeof(timerBuf),"T:%.1f",gTimer);
-            drawText(rnd,resetX+resetW+15,flagY+flagSz/4,timerBuf,200,200,200,255);
+            drawText(rnd,rr.x+rr.w+15,rr.y+rr.h/4,timerBuf,200,200,200,255);
         }
 
         // ── Category panel ──
         {
+            PROF_SCOPE(PP_CATEGORY);
             SDL_SetRenderDrawColor(rnd,45,45,60,255);
-            SDL_Rect catPanel={0,L.TOOLBAR_HEIGHT,L.CAT_PANEL_WIDTH,winH-L.TOOLBAR_HEIGHT}; SDL_RenderFillRect(rnd,&catPanel);
-            int catY=L.TOOLBAR_HEIGHT+5;
+            SDL_Rect catPanel={0,L.TOOLBAR_HEIGHT,L.CAT_PANEL_WIDTH,winH-L.TOOLBAR_HEIGHT}; renderFillRect(rnd,&catPanel);
             for(int i=0;i<NUM_CATEGORIES;i++){
                 Category c=(Category)i; SDL_Color cc=catColor(c);
-                int btnY=catY+i*(L.CAT_BTN_HEIGHT+3); bool sel=(c==selectedCategory);
+                int btnY=uiRect(UiId::CATEGORY,i).y; bool sel=(c==selectedCategory);
                 if(sel){fillRoundedRect(rnd,3,btnY,L.CAT_PANEL_WIDTH-6,L.CAT_BTN_HEIGHT,6,cc.r,cc.g,cc.b,255);drawText(rnd,10,btnY+(L.CAT_BTN_HEIGHT-textHeight("A"))/2,catName(c),255,255,255,255);}
                 else{fillRoundedRect(rnd,3,btnY,L.CAT_PANEL_WIDTH-6,L.CAT_BTN_HEIGHT,6,60,60,75,255);drawText(rnd,10,btnY+(L.CAT_BTN_HEIGHT-textHeight("A"))/2,catName(c),cc.r,cc.g,cc.b,255);}
             }
@@ -1431,96 +6207,48 @@ int main(int argc, char* argv[]) {
 
         // ── Palette ──
         {
+            PROF_SCOPE(PP_PALETTE);
             SDL_SetRenderDrawColor(rnd,50,50,65,255);
-            SDL_Rect palBg={L.CAT_PANEL_WIDTH,L.TOOLBAR_HEIGHT,L.PALETTE_WIDTH-L.CAT_PANEL_WIDTH,winH-L.TOOLBAR_HEIGHT}; SDL_RenderFillRect(rnd,&palBg);
+            SDL_Rect palBg={L.CAT_PANEL_WIDTH,L.TOOLBAR_HEIGHT,L.PALETTE_WIDTH-L.CAT_PANEL_WIDTH,winH-L.TOOLBAR_HEIGHT}; renderFillRect(rnd,&palBg);
             SDL_Rect clip={L.CAT_PANEL_WIDTH,L.TOOLBAR_HEIGHT,L.PALETTE_WIDTH-L.CAT_PANEL_WIDTH,winH-L.TOOLBAR_HEIGHT}; SDL_RenderSetClipRect(rnd,&clip);
-            float yy=(float)(L.TOOLBAR_HEIGHT+5+paletteScrollY);
-            for(auto& b:blocks){if(!b.inPalette||b.cat!=selectedCategory)continue;b.x=(float)(L.CAT_PANEL_WIDTH+5);b.y=yy;drawBlock(rnd,b,blocks);yy+=b.h+8*L.s;}
+            drawPaletteColumn(rnd,selectedCategory,L.CAT_PANEL_WIDTH,L.TOOLBAR_HEIGHT,winH-L.TOOLBAR_HEIGHT,paletteScrollY);
             SDL_RenderSetClipRect(rnd,nullptr);
         }
 
         // ── Stage ──
         {
-            int stageX=L.PALETTE_WIDTH,stageY=L.TOOLBAR_HEIGHT,stageW=L.STAGE_WIDTH,stageH=L.STAGE_HEIGHT;SDL_SetRenderDrawColor(rnd,255,255,255,255);
-            SDL_Color bgCol = BG_COLORS[gBgColor];
-            SDL_SetRenderDrawColor(rnd, bgCol.r, bgCol.g, bgCol.b, 255);
-            SDL_Rect stageRect={stageX,stageY,stageW,stageH}; SDL_RenderFillRect(rnd,&stageRect);initParticles(stageW, stageH);
-
-updateAndDrawParticles(rnd, stageX, stageY, stageW, stageH, dt);            int bgBtnX = stageX + stageW - (int)(35*L.s);
-            int bgBtnY = stageY + 3;
-            int bgBtnW = (int)(32*L.s);
-            int bgBtnH = (int)(18*L.s);
+            PROF_SCOPE(PP_STAGE);
+            presentStage(rnd, stageViewRect(winW,winH), sprites, dt, selectedSpriteIdx, true);
+            SDL_Rect bgBtn = uiRect(UiId::STAGE_BG);
+            int bgBtnX = bgBtn.x, bgBtnY = bgBtn.y, bgBtnW = bgBtn.w, bgBtnH = bgBtn.h;
             static float bgPulse = 0;
             bgPulse += 0.05f;
             Uint8 pulseVal = (Uint8)(100 + 30 * sin(bgPulse));
             fillRoundedRect(rnd, bgBtnX, bgBtnY, bgBtnW, bgBtnH, 4, pulseVal, pulseVal, pulseVal + 20, 255);            drawText(rnd, bgBtnX+3, bgBtnY+3, "BG", 255,255,255,255);
-            int stageCX=stageX+stageW/2, stageCY=stageY+stageH/2;
-            SDL_SetRenderDrawColor(rnd,235,235,235,255);
-            SDL_RenderDrawLine(rnd,stageCX,stageY,stageCX,stageY+stageH);
-            SDL_RenderDrawLine(rnd,stageX,stageCY,stageX+stageW,stageCY);
-
-            SDL_Rect stageClip={stageX,stageY,stageW,stageH}; SDL_RenderSetClipRect(rnd,&stageClip);
-            for(int si=0;si<(int)sprites.size();si++){
-                Sprite& sp=sprites[si];
-                if(!sp.visible) continue;
-                int sx=stageCX+(int)sp.x, sy=stageCY-(int)sp.y;
-                int sz=(int)(30*L.s*sp.size/100.0f);
-
-                // اعمال colorEffect
-                SDL_Color drawCol = sp.color;
-                if (sp.colorEffect == 1) { drawCol = {255,100,100,255}; }
-                else if (sp.colorEffect == 2) { drawCol = {100,255,100,255}; }
-                else if (sp.colorEffect == 3) { drawCol = {100,100,255,255}; }
-                else if (sp.colorEffect == 4) { drawCol = {255,255,100,255}; }
-                else if (sp.colorEffect == 5) { drawCol = {200,100,255,255}; }
-
-                // اعمال ghostEffect (شفافیت)
-                drawCol.a = (Uint8)(255 * (1.0f - sp.ghostEffect / 100.0f));
-
-                if (sp.uploadedTexture) {
-                    // رسم تصویر آپلود شده
-                    SDL_Rect srcRect = {0,0,0,0};
-                    SDL_QueryTexture(sp.uploadedTexture, NULL, NULL, &srcRect.w, &srcRect.h);
-                    SDL_Rect dstRect = {sx-sz/2, sy-sz/2, sz, sz};
-                    SDL_RenderCopy(rnd, sp.uploadedTexture, &srcRect, &dstRect);
-                } else {
-                    // رسم گربه پیش‌فرض
-                    drawCatSprite(rnd,sx,sy,sz,drawCol);
-                }                // نشانگر جهت
-                float angle=(sp.direction-90)*M_PI/180.0f;
-                int arrowX=sx+(int)((sz*0.8f)*cos(angle));
-                int arrowY=sy+(int)((sz*0.8f)*sin(angle));
-                SDL_SetRenderDrawColor(rnd,0,0,0,180);
-                SDL_RenderDrawLine(rnd,sx,sy,arrowX,arrowY);
-                fillEllipse(rnd,arrowX,arrowY,(int)(3*L.s),(int)(3*L.s),0,0,0,255);
-
-                // کادر انتخاب
-                if(si==selectedSpriteIdx){SDL_SetRenderDrawColor(rnd,50,150,255,255);SDL_Rect selR={sx-sz-3,sy-sz-3,2*sz+6,2*sz+6};SDL_RenderDrawRect(rnd,&selR);}
-
-                if(!sp.sayText.empty()) drawSpeechBubble(rnd,sx,sy-sz-5,sp.sayText.c_str(),false);
-                if(!sp.thinkText.empty()) drawSpeechBubble(rnd,sx,sy-sz-5,sp.thinkText.c_str(),true);
-            }
-            SDL_RenderSetClipRect(rnd,nullptr);
         }
 
         // ── Sprite panel (below stage) ──
         {
+            PROF_SCOPE(PP_SPRITE_PANEL);
             int stageX=L.PALETTE_WIDTH, stageW=L.STAGE_WIDTH;
             int spriteAreaY=L.TOOLBAR_HEIGHT+L.STAGE_HEIGHT+5;
             int spriteAreaH=winH-spriteAreaY;
             int thumbSz=L.SPRITE_THUMB;
-            int delBtnSize=(int)(16*L.s);
-            int eyeBtnSize=(int)(16*L.s);
 
             SDL_SetRenderDrawColor(rnd,230,230,240,255);
-            SDL_Rect spArea={stageX,spriteAreaY,stageW,spriteAreaH}; SDL_RenderFillRect(rnd,&spArea);
+            SDL_Rect spArea={stageX,spriteAreaY,stageW,spriteAreaH}; renderFillRect(rnd,&spArea);
 
-            int startX=stageX+5;
+            // نوار تصاویر کوچک با چرخ ماوس افقی اسکرول می‌شود
+            clampThumbScroll((int)sprites.size());
+            SDL_Rect strip=uiRect(UiId::THUMB,-1); SDL_RenderSetClipRect(rnd,&strip);
             for(int si=0;si<(int)sprites.size();si++){
-                int tx=startX+si*(thumbSz+8), ty=spriteAreaY;
+                SDL_Rect t=uiThumbRect(si);
+                if(t.x+t.w<=strip.x) continue;
+                if(t.x>=strip.x+strip.w) break;
+                int tx=t.x, ty=t.y;
                 bool isSel=(si==selectedSpriteIdx);
                 fillRoundedRect(rnd,tx,ty,thumbSz,thumbSz,6,isSel?200:240,isSel?220:240,isSel?255:240,255);
-                if(isSel){SDL_SetRenderDrawColor(rnd,50,150,255,255);SDL_Rect selBdr={tx,ty,thumbSz,thumbSz};SDL_RenderDrawRect(rnd,&selBdr);}
+                if(isSel){SDL_SetRenderDrawColor(rnd,50,150,255,255);SDL_Rect selBdr={tx,ty,thumbSz,thumbSz};renderDrawRect(rnd,&selBdr);}
 
                 SDL_Color thumbCol = sprites[si].color;
                 if(!sprites[si].visible){ thumbCol.r=(Uint8)(thumbCol.r*0.4f); thumbCol.g=(Uint8)(thumbCol.g*0.4f); thumbCol.b=(Uint8)(thumbCol.b*0.4f); }
@@ -1528,143 +6256,73 @@ updateAndDrawParticles(rnd, stageX, stageY, stageW, stageH, dt);            int
 
                 drawText(rnd,tx+2,ty+thumbSz-textHeight("A")-2,sprites[si].name.c_str(),0,0,0,255);
 
-                int eyeBtnX=tx+thumbSz-delBtnSize-eyeBtnSize-6, eyeBtnY=ty+2;
+                SDL_Rect eye=uiThumbRect(si,UiId::THUMB_EYE);
                 Uint8 eyeR=sprites[si].visible?50:150, eyeG=sprites[si].visible?150:150, eyeB2=sprites[si].visible?50:150;
-                fillRoundedRect(rnd,eyeBtnX,eyeBtnY,eyeBtnSize,eyeBtnSize,4,eyeR,eyeG,eyeB2,255);
-                drawText(rnd,eyeBtnX+eyeBtnSize/4,eyeBtnY+1,"O",255,255,255,255);
+                fillRoundedRect(rnd,eye.x,eye.y,eye.w,eye.h,4,eyeR,eyeG,eyeB2,255);
+                drawText(rnd,eye.x+eye.w/4,eye.y+1,"O",255,255,255,255);
 
-                int delBtnX=tx+thumbSz-delBtnSize-2, delBtnY=ty+2;
-                fillRoundedRect(rnd,delBtnX,delBtnY,delBtnSize,delBtnSize,4,220,50,50,255);
-                drawText(rnd,delBtnX+delBtnSize/4,delBtnY+1,"X",255,255,255,255);
+                SDL_Rect del=uiThumbRect(si,UiId::THUMB_DELETE);
+                fillRoundedRect(rnd,del.x,del.y,del.w,del.h,4,220,50,50,255);
+                drawText(rnd,del.x+del.w/4,del.y+1,"X",255,255,255,255);
             }
+            int contentW=(int)sprites.size()*gUiThumbStride-8;
+            if(contentW>strip.w&&strip.w>0){
+                SDL_Rect bar={strip.x+(int)((long long)gThumbScroll*strip.w/contentW),strip.y+strip.h-3,max(8,strip.w*strip.w/contentW),3};
+                SDL_SetRenderDrawColor(rnd,120,120,140,200); renderFillRect(rnd,&bar);
+            }
+            SDL_RenderSetClipRect(rnd,nullptr);
 
             // دکمه + اضافه کردن sprite
             {
-                int addBtnX=stageX+stageW-(int)(40*L.s), addBtnY=spriteAreaY, addBtnSz=(int)(30*L.s);
-                fillRoundedRect(rnd,addBtnX,addBtnY,addBtnSz,addBtnSz,8,50,150,50,255);
-                drawText(rnd,addBtnX+addBtnSz/3,addBtnY+addBtnSz/4,"+",255,255,255,255);
+                SDL_Rect ab=uiRect(UiId::ADD_SPRITE);
+                fillRoundedRect(rnd,ab.x,ab.y,ab.w,ab.h,8,50,150,50,255);
+                drawText(rnd,ab.x+ab.w/3,ab.y+ab.h/4,"+",255,255,255,255);
             }
 
             // ── Sprite info fields ──
             if(selectedSpriteIdx<(int)sprites.size()){
                 Sprite& sp=sprites[selectedSpriteIdx];
-                int infoY=spriteAreaY+thumbSz+10, infoX=stageX+5;
-                int fieldW2=(int)(stageW*0.35f), fieldH2=(int)(22*L.s);
-
-                // Name
-                {
-                    drawText(rnd,infoX,infoY+(fieldH2-textHeight("A"))/2,"Name:",80,80,80,255);
-                    int fx=infoX+(int)(40*L.s); bool editing=(sprInfoEdit.field==0);
-                    fillRoundedRect(rnd,fx,infoY,fieldW2*2,fieldH2,4,editing?255:245,255,editing?220:245,255);
-                    if(editing) drawRoundedRectOutline(rnd,fx-1,infoY-1,fieldW2*2+2,fieldH2+2,4,50,150,255,255);
-                    const char* dispText=editing?sprInfoEdit.buffer.c_str():sp.name.c_str();
-                    drawText(rnd,fx+4,infoY+(fieldH2-textHeight("A"))/2,dispText,0,0,0,255);
-                    if(editing){int cw=textWidth(dispText);SDL_SetRenderDrawColor(rnd,0,0,0,255);SDL_RenderDrawLine(rnd,fx+4+cw,infoY+2,fx+4+cw,infoY+fieldH2-2);}
-                }
-
-                int row2Y=infoY+fieldH2+8;
-                // X
-                {
-                    drawText(rnd,infoX,row2Y+(fieldH2-textHeight("A"))/2,"X:",80,80,80,255);
-                    int fx=infoX+(int)(15*L.s),fw=fieldW2-(int)(20*L.s); bool editing=(sprInfoEdit.field==1);
-                    fillRoundedRect(rnd,fx,row2Y,fw,fieldH2,4,editing?255:245,255,editing?220:245,255);
-                    if(editing) drawRoundedRectOutline(rnd,fx-1,row2Y-1,fw+2,fieldH2+2,4,50,150,255,255);
-                    string val=editing?sprInfoEdit.buffer:floatToString(sp.x);
-                    drawText(rnd,fx+4,row2Y+(fieldH2-textHeight("A"))/2,val.c_str(),0,0,0,255);
-                    if(editing){int cw=textWidth(val.c_str());SDL_SetRenderDrawColor(rnd,0,0,0,255);SDL_RenderDrawLine(rnd,fx+4+cw,row2Y+2,fx+4+cw,row2Y+fieldH2-2);}
-                }
-                // Y
-                {
-                    int fx=infoX+fieldW2+(int)(15*L.s),fw=fieldW2-(int)(20*L.s); bool editing=(sprInfoEdit.field==2);
-                    drawText(rnd,infoX+fieldW2,row2Y+(fieldH2-textHeight("A"))/2,"Y:",80,80,80,255);
-                    fillRoundedRect(rnd,fx,row2Y,fw,fieldH2,4,editing?255:245,255,editing?220:245,255);
-                    if(editing) drawRoundedRectOutline(rnd,fx-1,row2Y-1,fw+2,fieldH2+2,4,50,150,255,255);
-                    string val=editing?sprInfoEdit.buffer:floatToString(sp.y);
-                    drawText(rnd,fx+4,row2Y+(fieldH2-textHeight("A"))/2,val.c_str(),0,0,0,255);
-                    if(editing){int cw=textWidth(val.c_str());SDL_SetRenderDrawColor(rnd,0,0,0,255);SDL_RenderDrawLine(rnd,fx+4+cw,row2Y+2,fx+4+cw,row2Y+fieldH2-2);}
+                for(int fi=0;fi<NUM_SPRITE_FIELDS;fi++){
+                    SDL_Rect f=uiRect(UiId::SPRITE_FIELD,fi);
+                    bool editing=(sprInfoEdit.field==fi);
+                    int textY=f.y+(f.h-textHeight("A"))/2;
+                    drawText(rnd,f.x-(int)(SPRITE_FIELD_LABEL_W[fi]*L.s),textY,SPRITE_FIELD_LABELS[fi],80,80,80,255);
+                    fillRoundedRect(rnd,f.x,f.y,f.w,f.h,4,editing?255:245,255,editing?220:245,255);
+                    if(editing) drawRoundedRectOutline(rnd,f.x-1,f.y-1,f.w+2,f.h+2,4,50,150,255,255);
+                    const float nums[NUM_SPRITE_FIELDS]={0,sp.x,sp.y,sp.size,sp.direction,sp.ghostEffect};
+                    string val=editing?sprInfoEdit.buffer:fi==0?sp.name:floatToString(nums[fi]);
+                    drawText(rnd,f.x+4,textY,val.c_str(),0,0,0,255);
+                    if(editing){int cw=textWidth(val.c_str());SDL_SetRenderDrawColor(rnd,0,0,0,255);renderDrawLine(rnd,f.x+4+cw,f.y+2,f.x+4+cw,f.y+f.h-2);}
                 }
 
-                int row3Y=row2Y+fieldH2+8;
-                // Size
-                {
-                    drawText(rnd,infoX,row3Y+(fieldH2-textHeight("A"))/2,"Sz:",80,80,80,255);
-                    int fx=infoX+(int)(30*L.s),fw=fieldW2-(int)(20*L.s); bool editing=(sprInfoEdit.field==3);
-                    fillRoundedRect(rnd,fx,row3Y,fw,fieldH2,4,editing?255:245,255,editing?220:245,255);
-                    if(editing) drawRoundedRectOutline(rnd,fx-1,row3Y-1,fw+2,fieldH2+2,4,50,150,255,255);
-                    string val=editing?sprInfoEdit.buffer:floatToString(sp.size);
-                    drawText(rnd,fx+4,row3Y+(fieldH2-textHeight("A"))/2,val.c_str(),0,0,0,255);
-
-
-                    if(editing){int cw=textWidth(val.c_str());SDL_SetRenderDrawColor(rnd,0,0,0,255);SDL_RenderDrawLine(rnd,fx+4+cw,row3Y+2,fx+4+cw,row3Y+fieldH2-2);}
-                    // دکمه Upload Costume
-                    int uploadBtnW = (int)(60*L.s), uploadBtnH = fieldH2;
-                    int uploadBtnX = infoX + fieldW2*2 - uploadBtnW - 10;
-                    int uploadBtnY = infoY;
-                    fillRoundedRect(rnd, uploadBtnX, uploadBtnY, uploadBtnW, uploadBtnH, 4, 50,150,50,255);
-
-                    drawText(rnd, uploadBtnX+10, uploadBtnY+(uploadBtnH-textHeight("A"))/2, "Upload", 255,255,255,255);
-                    // دکمه Upload Costume
-                    uploadBtnW = (int)(60*L.s), uploadBtnH = fieldH2;
-                    uploadBtnX = infoX + fieldW2*2 - uploadBtnW - 10;
-                    uploadBtnY = infoY;
-                    fillRoundedRect(rnd, uploadBtnX, uploadBtnY, uploadBtnW, uploadBtnH, 4, 50,150,50,255);
-                    drawText(rnd, uploadBtnX+10, uploadBtnY+(uploadBtnH-textHeight("A"))/2, "Upload", 255,255,255,255);
-                    int row4Y = row3Y + fieldH2 + 8;
-
-                    int editBtnW = (int)(60*L.s), editBtnH = fieldH2;
-                    int editBtnX = uploadBtnX - editBtnW - 10;
-                    int editBtnY = uploadBtnY;
-                    fillRoundedRect(rnd, editBtnX, editBtnY, editBtnW, editBtnH, 4, 150,50,150,255);
-                    drawText(rnd, editBtnX+10, editBtnY+(editBtnH-textHeight("A"))/2, "Edit", 255,255,255,255);
-
-                    {
-                        drawText(rnd,infoX,row4Y+(fieldH2-textHeight("A"))/2,"Gh:",80,80,80,255);
-                        int fx=infoX+(int)(30*L.s),fw=fieldW2-(int)(20*L.s);
-                        bool editing=(sprInfoEdit.field==5);
-                        fillRoundedRect(rnd,fx,row4Y,fw,fieldH2,4,editing?255:245,255,editing?220:245,255);
-                        if(editing) drawRoundedRectOutline(rnd,fx-1,row4Y-1,fw+2,fieldH2+2,4,50,150,255,255);
-                        string val=editing?sprInfoEdit.buffer:floatToString(sp.ghostEffect);
-                        drawText(rnd,fx+4,row4Y+(fieldH2-textHeight("A"))/2,val.c_str(),0,0,0,255);
-                        if(editing){int cw=textWidth(val.c_str());SDL_SetRenderDrawColor(rnd,0,0,0,255);SDL_RenderDrawLine(rnd,fx+4+cw,row4Y+2,fx+4+cw,row4Y+fieldH2-2);}
-                    }
-                }
-                int layerBtnW = (int)(40 * L.s), layerBtnH = fieldH2;
-                int layerBtnY = row3Y; // هم‌ردیف Size
-
-                // دکمه Front (>>)
-                int frontBtnX = infoX + fieldW2 * 2 - layerBtnW - 5;
-                fillRoundedRect(rnd, frontBtnX, layerBtnY, layerBtnW, layerBtnH, 4, 50, 150, 50, 255);
-                drawText(rnd, frontBtnX + 10, layerBtnY + (layerBtnH - textHeight("A")) / 2, ">>", 255, 255, 255, 255);
-
-                // دکمه Back (<<)
-                int backBtnX = frontBtnX - layerBtnW - 5;
-                fillRoundedRect(rnd, backBtnX, layerBtnY, layerBtnW, layerBtnH, 4, 200, 50, 50, 255);
-                drawText(rnd, backBtnX + 10, layerBtnY + (layerBtnH - textHeight("A")) / 2, "<<", 255, 255, 255, 255);
-                // Direction
-                {
-                    int fx=infoX+fieldW2+(int)(25*L.s),fw=fieldW2-(int)(20*L.s); bool editing=(sprInfoEdit.field==4);
-                    drawText(rnd,infoX+fieldW2,row3Y+(fieldH2-textHeight("A"))/2,"Dir:",80,80,80,255);
-                    fillRoundedRect(rnd,fx,row3Y,fw,fieldH2,4,editing?255:245,255,editing?220:245,255);
-                    if(editing) drawRoundedRectOutline(rnd,fx-1,row3Y-1,fw+2,fieldH2+2,4,50,150,255,255);
-                    string val=editing?sprInfoEdit.buffer:floatToString(sp.direction);
-                    drawText(rnd,fx+4,row3Y+(fieldH2-textHeight("A"))/2,val.c_str(),0,0,0,255);
-                    if(editing){int cw=textWidth(val.c_str());SDL_SetRenderDrawColor(rnd,0,0,0,255);SDL_RenderDrawLine(rnd,fx+4+cw,row3Y+2,fx+4+cw,row3Y+fieldH2-2);}
+                // Upload / Edit costume / لایه عقب (<<) / لایه جلو (>>)، به ترتیب درخت
+                struct { UiId id; Uint8 r,g,b; const char* label; } buttons[] = {
+                    {UiId::UPLOAD,50,150,50,"Upload"}, {UiId::EDIT_COSTUME,150,50,150,"Edit"},
+                    {UiId::LAYER_BACK,200,50,50,"<<"}, {UiId::LAYER_FRONT,50,150,50,">>"}};
+                for(auto& bt:buttons){
+                    SDL_Rect r=uiRect(bt.id);
+                    fillRoundedRect(rnd,r.x,r.y,r.w,r.h,4,bt.r,bt.g,bt.b,255);
+                    drawText(rnd,r.x+10,r.y+(r.h-textHeight("A"))/2,bt.label,255,255,255,255);
                 }
             }
         }
 
         // ── Workspace ──
         {
+            PROF_SCOPE(PP_WORKSPACE);
             int wsX=L.PALETTE_WIDTH+L.STAGE_WIDTH, wsY=L.TOOLBAR_HEIGHT;
             int wsW=winW-wsX, wsH=winH-wsY;
             SDL_SetRenderDrawColor(rnd,245,245,250,255);
-            SDL_Rect wsRect={wsX,wsY,wsW,wsH}; SDL_RenderFillRect(rnd,&wsRect);
+            SDL_Rect wsRect={wsX,wsY,wsW,wsH}; renderFillRect(rnd,&wsRect);
             SDL_SetRenderDrawColor(rnd,230,230,235,255);
-            for(int gx=wsX;gx<wsX+wsW;gx+=40) SDL_RenderDrawLine(rnd,gx,wsY,gx,wsY+wsH);
-            for(int gy=wsY;gy<wsY+wsH;gy+=40) SDL_RenderDrawLine(rnd,wsX,gy,wsX+wsW,gy);
+            int grid=max(1,(int)(40*L.s));
+            int offX=((int)(L.camX*L.s)%grid+grid)%grid, offY=((int)(L.camY*L.s)%grid+grid)%grid;
+            for(int gx=wsX+(grid-offX)%grid;gx<wsX+wsW;gx+=grid) renderDrawLine(rnd,gx,wsY,gx,wsY+wsH);
+            for(int gy=wsY+(grid-offY)%grid;gy<wsY+wsH;gy+=grid) renderDrawLine(rnd,wsX,gy,wsX+wsW,gy);
             drawText(rnd,wsX+10,wsY+5,"Code Workspace",150,150,160,255);
         }
         if(costumeEditMode && costumeCanvas) {
+            PROF_SCOPE(PP_WORKSPACE);
             int editorX = L.PALETTE_WIDTH + L.STAGE_WIDTH + 20;
             int editorY = L.TOOLBAR_HEIGHT + 20;
             int editorW = canvasW + 40;
@@ -1672,10 +6330,25 @@ updateAndDrawParticles(rnd, stageX, stageY, stageW, stageH, dt);            int
 
             SDL_SetRenderDrawColor(rnd, 60, 60, 80, 255);
             SDL_Rect editorBg = {editorX, editorY, editorW, editorH};
-            SDL_RenderFillRect(rnd, &editorBg);
+            renderFillRect(rnd, &editorBg);
 
             SDL_Rect canvasRect = {editorX+20, editorY+20, canvasW, canvasH};
-            SDL_RenderCopy(rnd, costumeCanvas, nullptr, &canvasRect);
+            renderCopy(rnd, costumeCanvas, nullptr, &canvasRect);
+
+            // شکل در حال کشیدن (پیش‌نمایش)
+            if(gShapeDragging) {
+                int ox = canvasRect.x, oy = canvasRect.y;
+                SDL_RenderSetClipRect(rnd, &canvasRect);
+                static vector<SDL_Rect> spans;
+                spans.clear();
+                shapeSpans(gPaintTool, gShapeX0, gShapeY0, gShapeX1, gShapeY1, max(1, penSize), [&](int y, int a, int b) {
+                    a = max(a, 0); b = min(b, canvasW - 1);
+                    if (y >= 0 && y < canvasH && a <= b) spans.push_back({ox + a, oy + y, b - a + 1, 1});
+                });
+                SDL_SetRenderDrawColor(rnd, penColorR, penColorG, penColorB, 255);
+                renderFillRects(rnd, spans.data(), (int)spans.size());
+                SDL_RenderSetClipRect(rnd, nullptr);
+            }
 
             int toolbarY = editorY + canvasH + 30;
 
@@ -1690,31 +6363,109 @@ updateAndDrawParticles(rnd, stageX, stageY, stageW, stageH, dt);            int
 
             fillRoundedRect(rnd, editorX+230, toolbarY, 60, 30, 4, 100,100,100,255);
             drawText(rnd, editorX+240, toolbarY+5, "Exit", 255,255,255,255);
+
+            Uint8 undoC = gCanvasUndo.empty() ? 90 : 120, redoC = gCanvasRedo.empty() ? 90 : 120;
+            fillRoundedRect(rnd, editorX+300, toolbarY, 60, 30, 4, undoC,undoC,undoC+20,255);
+            drawText(rnd, editorX+310, toolbarY+5, "Undo", 255,255,255,255);
+
+            fillRoundedRect(rnd, editorX+370, toolbarY, 60, 30, 4, redoC,redoC,redoC+20,255);
+            drawText(rnd, editorX+380, toolbarY+5, "Redo", 255,255,255,255);
+
+            int toolRowY = toolbarY + 35;
+            const char* toolNames[] = {"Fill", "Rect", "Oval", "Line"};
+            PaintTool tools[] = {PaintTool::FILL, PaintTool::RECT, PaintTool::ELLIPSE, PaintTool::LINE};
+            for(int ti = 0; ti < 4; ti++) {
+                bool sel = (gPaintTool == tools[ti]);
+                fillRoundedRect(rnd, editorX+20+ti*70, toolRowY, 60, 30, 4, sel?230:90, sel?160:90, sel?40:110, 255);
+                drawText(rnd, editorX+30+ti*70, toolRowY+5, toolNames[ti], 255,255,255,255);
+            }
         }
 
         // ── Draw workspace blocks ──
         {
-            for(auto& b:blocks){if(b.inPalette||b.id==dragBlockId) continue; drawBlock(rnd,b,blocks);}
-            for(auto& b:blocks){if(b.inPalette) continue; for(auto& sl:b.opSlots){if(sl.embeddedBlockId>=0){Block* emb=findBlock(blocks,sl.embeddedBlockId);if(emb)drawBlock(rnd,*emb,blocks);}}}
+            PROF_SCOPE(PP_WORKSPACE);
+            markSelection(blocks);
+            // بلوک‌های ثابت به محدوده فضای کد بریده می‌شوند (دوربین ممکن است آن‌ها را زیر صحنه ببرد)
+            SDL_Rect wsClip={L.WS_X,L.TOOLBAR_HEIGHT,max(0,winW-L.WS_X),max(0,winH-L.TOOLBAR_HEIGHT)}; SDL_RenderSetClipRect(rnd,&wsClip);
+            for(size_t i=0;i<blocks.size();i++){if(gStackDrag.has(i)) continue; drawBlock(rnd,blocks[i],blocks,isSelected(i));}
+            for(auto& b:blocks){for(auto& sl:b.opSlots){if(sl.embeddedBlockId>=0){Block* emb=findBlock(blocks,sl.embeddedBlockId);if(emb&&!gStackDrag.has(emb-blocks.data()))drawBlock(rnd,*emb,blocks,isSelected(emb-blocks.data()));}}}
+            if(gFind.open){
+                // نتایج جستجو قاب زرد خودشان را دارند (جدا از رنگ انتخاب)؛ نتیجه‌ی فعلی قاب نارنجی دوخطی
+                for(int h=0;h<(int)gFind.hits.size();h++){
+                    Block* fb=findBlock(blocks,gFind.hits[h]);
+                    if(!fb||gStackDrag.has(fb-blocks.data())) continue;
+                    bool cur=h==gFind.cur; int pad=cur?4:2;
+                    SDL_Rect fr={(int)L.blockPxX(fb->x)-pad,(int)L.blockPxY(fb->y)-pad,(int)(fb->w*L.s)+pad*2,(int)(fb->h*L.s)+pad*2};
+                    if(fr.x>=winW||fr.y>=winH||fr.x+fr.w<=0||fr.y+fr.h<=0) continue;
+                    if(cur) SDL_SetRenderDrawColor(rnd,255,120,0,255); else SDL_SetRenderDrawColor(rnd,255,210,0,230);
+                    renderDrawRect(rnd,&fr);
+                    if(cur){SDL_Rect in={fr.x+1,fr.y+1,fr.w-2,fr.h-2};renderDrawRect(rnd,&in);}
+                }
+            }
+            SDL_RenderSetClipRect(rnd,nullptr);
+            if(gBand.active){
+                SDL_Rect band={(int)L.blockPxX(min(gBand.x0,gBand.x1)),(int)L.blockPxY(min(gBand.y0,gBand.y1)),(int)(fabsf(gBand.x1-gBand.x0)*L.s),(int)(fabsf(gBand.y1-gBand.y0)*L.s)};
+                SDL_SetRenderDrawColor(rnd,80,140,255,50); renderFillRect(rnd,&band);
+                SDL_SetRenderDrawColor(rnd,80,140,255,200); renderDrawRect(rnd,&band);
+            }
+            if(gFind.open){
+                string label="Find: "+gFind.query+"_";
+                string count=gFind.hits.empty()?(gFind.query.empty()?string():string("no matches")):
+                             gFind.cur<0?intToString((int)gFind.hits.size())+" matches":intToString(gFind.cur+1)+"/"+intToString((int)gFind.hits.size());
+                int pad=(int)(8*L.s), bw=max(textWidth(label.c_str())+textWidth(count.c_str())+pad*4,(int)(260*L.s)), bh=textHeight(label.c_str())+pad;
+                int bx=winW-bw-10, by=L.TOOLBAR_HEIGHT+8;
+                fillRoundedRect(rnd,bx,by,bw,bh,6,40,40,55,230);
+                drawText(rnd,bx+pad,by+pad/2,label.c_str(),255,255,255,255);
+                drawText(rnd,bx+bw-pad-textWidth(count.c_str()),by+pad/2,count.c_str(),180,180,200,255);
+            }
             if(dragBlockId>=0){
+                PROF_SCOPE(PP_DRAG_PREVIEW);
                 Block* db=findBlock(blocks,dragBlockId);
                 if(db){
-                    drawBlock(rnd,*db,blocks,true);
+                    // پشته کشیده‌شده با جابه‌جایی درگ رسم می‌شود؛ خود بلوک‌ها تا رها شدن ثابت‌اند
+                    const StackDrag& d=gStackDrag;
+                    SDL_FRect box={L.blockPxX(d.box.x+d.dx),L.blockPxY(d.box.y+d.dy),d.box.w*L.s,d.box.h*L.s};
+                    if(box.x<winW&&box.y<winH&&box.x+box.w>0&&box.y+box.h>0)
+                        for(size_t i=0;i<blocks.size();i++){
+                            if(!d.has(i)) continue;
+                            Block& b=blocks[i];
+                            SDL_FPoint at={L.blockPxX(b.x+d.dx),L.blockPxY(b.y+d.dy)};
+                            drawBlock(rnd,b,blocks,b.id==dragBlockId||isSelected(i),&at);
+                        }
+                    float dragX=db->x+d.dx, dragY=db->y+d.dy;
                     for(auto& other:blocks){
-                        if(other.id==dragBlockId||other.inPalette||other.nextBlockId>=0) continue;
+                        if(other.id==dragBlockId||other.nextBlockId>=0||d.has(&other-blocks.data())) continue;
                         if(other.shape==BlockShape::CAP||other.shape==BlockShape::REPORTER||other.shape==BlockShape::BOOLEAN) continue;
                         float ox=other.x,oy=other.y+other.h;
-                        if(abs(db->x-ox)<L.SNAP_DISTANCE&&abs(db->y-oy)<L.SNAP_DISTANCE){SDL_SetRenderDrawColor(rnd,50,150,255,150);SDL_Rect prev={(int)ox,(int)oy-2,(int)db->w,4};SDL_RenderFillRect(rnd,&prev);}
-                        if(other.shape==BlockShape::C_BLOCK){float indent=20*L.s,barH=L.CBLOCK_BAR_H,mouthX=other.x+indent,mouthY=other.y+barH;if(abs(db->x-mouthX)<L.SNAP_DISTANCE&&abs(db->y-mouthY)<L.SNAP_DISTANCE){SDL_SetRenderDrawColor(rnd,255,200,50,150);SDL_Rect prev={(int)mouthX,(int)mouthY-2,(int)(other.w-indent),4};SDL_RenderFillRect(rnd,&prev);}}
+                        if(abs(dragX-ox)<BASE_SNAP_DISTANCE&&abs(dragY-oy)<BASE_SNAP_DISTANCE){SDL_SetRenderDrawColor(rnd,50,150,255,150);SDL_Rect prev={(int)L.blockPxX(ox),(int)L.blockPxY(oy)-2,(int)(db->w*L.s),4};renderFillRect(rnd,&prev);}
+                        if(other.shape==BlockShape::C_BLOCK){float indent=20,barH=BASE_CBLOCK_BAR_H,mouthX=other.x+indent,mouthY=other.y+barH;if(abs(dragX-mouthX)<BASE_SNAP_DISTANCE&&abs(dragY-mouthY)<BASE_SNAP_DISTANCE){SDL_SetRenderDrawColor(rnd,255,200,50,150);SDL_Rect prev={(int)L.blockPxX(mouthX),(int)L.blockPxY(mouthY)-2,(int)((other.w-indent)*L.s),4};renderFillRect(rnd,&prev);}}
                     }
                 }
             }
         }
 
-        SDL_RenderPresent(rnd);
-        SDL_Delay(16);
+        // ── Costume save status ──
+        if (!gSaveStatusText.empty()) {
+            string msg = gSaveStatusText;
+            if (gSaveStatusTimer <= 0 && gSaveProgressRows && gSaveProgressTotal > 0)
+                msg += " " + intToString(gSaveProgressRows->load() * 100 / gSaveProgressTotal) + "%";
+            int tw = textWidth(msg.c_str()) + (int)(16*L.s), th = textHeight(msg.c_str()) + (int)(10*L.s);
+            int tx = winW - tw - 10, ty = winH - th - 10;
+            fillRoundedRect(rnd, tx, ty, tw, th, 6, 40, 40, 55, 230);
+            drawText(rnd, tx + (int)(8*L.s), ty + (int)(5*L.s), msg.c_str(), 255, 255, 255, 255);
+        }
+
+        drawBlockProfTable(rnd, blocks, sprites, winW, winH);
+        drawProfilerHud(rnd, winW);
+        finishFrame();
     } // end main loop
+    finishInput();
 
+    stopCostumeSaveWorker();
+    if (gInputMode == InputMode::LIVE) flushAutosave(blocks, sprites);
+    stopAutosaveWorker();
+    for(auto& sp : sprites)
+        for(auto& c : sp.costumes) if(c.texture) { SDL_DestroyTexture(c.texture); c.texture = nullptr; }
     SDL_StopTextInput();
     SDL_DestroyRenderer(rnd);
     SDL_DestroyWindow(window);